@@ -30,6 +30,16 @@ gflags.DEFINE_string(
     'Path to alice solver binary.')
 gflags.MarkFlagAsRequired('alice_solver')
 
+gflags.DEFINE_string(
+    'alice_fold_body_table', None,
+    'Fold body table file shared by alice processes. Written on the first '
+    'run; alice lists the fold bodies on every start if unset.')
+
+gflags.DEFINE_integer(
+    'alice_memory_budget_mb', 0,
+    'If positive, passed to alice as --memory_budget_mb, beyond which it '
+    'stops composing and only looks up the goals.')
+
 gflags.DEFINE_integer(
     'initial_arguments', 3,
     'Number of arguments initially given to cardinal.')
@@ -48,12 +58,31 @@ gflags.DEFINE_integer(
     'Time limit in seconds')
 
 
+# Seconds past its timeout after which a request is cancelled, in case
+# alice overruns it.
+CANCEL_GRACE_SEC = 5
+
+# Alice's reply to a request which found nothing in a table which took
+# --memory_budget_mb, so that a longer timeout would not help.
+MEMORY_LIMIT_REPLY = 'memory_limit'
+
+
 class Alice(object):
   def __init__(self):
+    command = [FLAGS.alice_solver]
+    if FLAGS.alice_fold_body_table:
+      command.append('--fold_body_table=%s' % FLAGS.alice_fold_body_table)
+    if FLAGS.alice_memory_budget_mb > 0:
+      command.append('--memory_budget_mb=%d' % FLAGS.alice_memory_budget_mb)
     self.proc = subprocess.Popen(
-        [FLAGS.alice_solver],
+        command,
         stdin=subprocess.PIPE,
         stdout=subprocess.PIPE)
+    # Requests are numbered from 1, as alice counts them for "cancel <n>".
+    self.num_requests = 0
+    # Whether the last request failed on the memory limit.
+    self.memory_limited = False
+    self.stdin_lock = threading.Lock()
     self._WaitReady()
 
   def _WaitReady(self):
@@ -95,12 +124,36 @@ class Alice(object):
     detail.write(request)
     detail.flush()
 
-    self.proc.stdin.write(request)
-    self.proc.stdin.flush()
+    with self.stdin_lock:
+      self.num_requests += 1
+      request_number = self.num_requests
+      self.proc.stdin.write(request)
+      self.proc.stdin.flush()
 
+    timer = threading.Timer(timeout_sec + CANCEL_GRACE_SEC, self.Cancel, [request_number])
+    timer.start()
     program = self.proc.stdout.readline().strip()
+    timer.cancel()
+    self.memory_limited = program == MEMORY_LIMIT_REPLY
+    if self.memory_limited:
+      logging.info('Alice reached the memory limit')
+      print >>detail, '=> memory limit'
+      detail.flush()
+      return ''
     return program
 
+  def Cancel(self, request_number):
+    """Makes alice reply empty to the request_number-th request.
+
+    Can be called from another thread while Request() waits, e.g. once a
+    parallel path has solved the problem. A request already replied to is
+    not affected.
+    """
+    logging.info('Cancelling Alice request %d', request_number)
+    with self.stdin_lock:
+      print >>self.proc.stdin, 'cancel %d' % request_number
+      self.proc.stdin.flush()
+
 
 def Guess(problem, program, detail):
   logging.info('=== %s', program)
@@ -156,6 +209,10 @@ def SolveInternal(problem, random_io_pairs, alice, detail,
         break
       # aaaaaaaaaa no example
 
+    if alice.memory_limited:
+      # The table is full, so a longer wait finds nothing more; other
+      # samples may.
+      continue
     trial += 1
     if trial >= 5:
       initial_wait += INITIAL_WAIT_INCREASE
@@ -207,9 +264,12 @@ def SolveInternal(problem, random_io_pairs, alice, detail,
       continue
 
     # docchi mo dame datta... orzorz
+    # Not longer if the table is full, as it would find nothing more.
+    if not alice.memory_limited:
+      bucketize_wait += BUCKETIZE_WAIT_INCREASE
     return SolveInternal(problem, random_io_pairs, alice, detail,
                          start_time,
-                         initial_wait, bucketize_wait+BUCKETIZE_WAIT_INCREASE)
+                         initial_wait, bucketize_wait)
 
 
 def Solve(problem, alice, detail):
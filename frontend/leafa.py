@@ -16,6 +16,7 @@ import gflags
 
 from frontend import frontend_util
 from util import api
+from util import cluster_dump
 from util import stdlog
 
 FLAGS = gflags.FLAGS
@@ -72,21 +73,16 @@ def RunClusterSolver(problem):
   size = max(2, size) + 1    # +1 for (lambda (x) ...) 
 
   logging.info('Running clusterer...')
-  cluster_solver_output = subprocess.check_output(
+  dump = cluster_dump.Run(
       [FLAGS.cluster_solver,
        '--size=%d' % size,
        '--operators=%s' % ','.join(operators_but_bonus)])
   logging.info('Finished.')
-  assert cluster_solver_output.startswith('argument: ')
-  lines = cluster_solver_output.splitlines()
-  arguments = [int(s, 0) for s in lines.pop(0).split()[1].split(',')]
+  arguments = dump.Argument()
   clusters = []
-  for line in lines:
-    if line.startswith('expected:'):
-      expected = [int(s, 0) for s in line.split()[1].split(',')]
-      clusters.append([expected, [], AsConditionBitVector(expected), None])
-    else:
-      clusters[-1][1].append(line)
+  for i in range(len(dump)):
+    expected = dump.Signature(i)
+    clusters.append([expected, dump.Programs(i), AsConditionBitVector(expected), None])
   return (arguments, clusters)
 
 
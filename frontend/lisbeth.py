@@ -27,6 +27,7 @@ gflags.MarkFlagAsRequired('genall_solver')
 
 def BruteForceGuessOrDie(problem, programs):
   for program in programs:
+    program = program.rstrip('\n')
     logging.info('=== %s', program)
     try:
       example = api.Guess(problem.id, program)
@@ -61,15 +62,18 @@ def main():
     logging.info('******** PROBLEM %d/%d: %r ********',
                  index + 1, len(problems), problem)
 
-    solver_output = subprocess.check_output(
+    # genall streams the candidates, so start guessing before it finishes.
+    proc = subprocess.Popen(
         [FLAGS.genall_solver,
          '--size=%d' % problem.size,
-         '--operators=%s' % ','.join(problem.operators)])
-    programs = solver_output.splitlines()
-
-    logging.info('Candidate programs: %d', len(programs))
-
-    BruteForceGuess(problem, programs)
+         '--operators=%s' % ','.join(problem.operators)],
+        stdout=subprocess.PIPE)
+    try:
+      BruteForceGuessOrDie(problem, iter(proc.stdout.readline, ''))
+    finally:
+      if proc.poll() is None:
+        proc.kill()
+      proc.wait()
 
 
 if __name__ == '__main__':
@@ -15,6 +15,7 @@ import gflags
 
 from frontend import frontend_util
 from util import api
+from util import cluster_dump
 from util import stdlog
 
 FLAGS = gflags.FLAGS
@@ -47,23 +48,13 @@ gflags.DEFINE_string(
 
 def RunClusterSolver(problem):
   logging.info('Running clusterer...')
-  cluster_solver_output = subprocess.check_output(
+  dump = cluster_dump.Run(
       [FLAGS.cluster_solver,
        '--size=%d' % problem.size,
        '--operators=%s' % ','.join(problem.operators),
        '--cache_dir=%s' % FLAGS.cache_dir])
   logging.info('Finished.')
-  assert cluster_solver_output.startswith('argument: ')
-  lines = cluster_solver_output.splitlines()
-  arguments = [int(s, 0) for s in lines.pop(0).split()[1].split(',')]
-  clusters = []
-  for line in lines:
-    if line.startswith('expected:'):
-      expected = [int(s, 0) for s in line.split()[1].split(',')]
-      clusters.append((expected, []))
-    else:
-      clusters[-1][1].append(line)
-  return (arguments, clusters)
+  return (dump.Argument(), dump)
 
 
 def BruteForceGuessOrDie(problem, programs):
@@ -127,12 +118,12 @@ def main():
     logging.info('******** PROBLEM %d/%d: %r ********',
                  index + 1, len(problems), problem)
 
-    arguments, clusters = RunClusterSolver(problem)
+    arguments, dump = RunClusterSolver(problem)
 
     cluster_sizes_decreasing = sorted(
-        [len(programs) for _, programs in clusters], reverse=True)
+        [len(dump.Programs(i)) for i in range(len(dump))], reverse=True)
     logging.info('Candidate programs: %d', sum(cluster_sizes_decreasing))
-    logging.info('Candidate clusters: %d', len(clusters))
+    logging.info('Candidate clusters: %d', len(dump))
     #logging.info('Cluster sizes: %s', ', '.join(map(str, cluster_sizes_decreasing)))
 
     if FLAGS.max_cluster_size > 0 and cluster_sizes_decreasing[0] > FLAGS.max_cluster_size:
@@ -143,8 +134,9 @@ def main():
     logging.info('Issueing /eval...')
     outputs = api.Eval(problem.id, arguments)
 
-    clusters_map = dict([(tuple(e), c) for e, c in clusters])
-    programs = clusters_map.get(tuple(outputs), [])
+    # Only the cluster of the outputs is decoded.
+    found = dump.Find(outputs)
+    programs = list(dump.Programs(found)) if found is not None else []
 
     #logging.info('%r -> %r', arguments, outputs)
     logging.info('Selected a cluster with population=%d', len(programs))
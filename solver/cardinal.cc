@@ -1,5 +1,4 @@
 #include <algorithm>
-#include <map>
 #include <string>
 #include <vector>
 
@@ -7,6 +6,7 @@
 #include <glog/logging.h>
 
 #include "expr.h"
+#include "signature_table.h"
 
 using namespace icfpc;
 
@@ -87,18 +87,10 @@ std::string OpTypeToString(OpType type) {
   }
 }
 
-struct Back {
-  OpType type;
-  const std::vector<uint64_t>* arg1;
-  const std::vector<uint64_t>* arg2;
-  const std::vector<uint64_t>* arg3;
-};
-
 static const OpType ALL_UNARY_OP_TYPES[] = {
   OpType::NOT,
   OpType::SHL1,
   OpType::SHR1,
-  OpType::SHR1,
   OpType::SHR4,
   OpType::SHR16,
 };
@@ -142,22 +134,19 @@ struct OpShr16 {
 };
 
 template<typename T>
-Key EvalUnaryInternal(const Key& input, T op) {
-  Key result;
-  result.reserve(input.size());
-  for (size_t i = 0; i < input.size(); ++i) {
-    result.push_back(op(input[i]));
+void EvalUnaryInternal(const uint64_t* input, std::size_t width, T op, uint64_t* result) {
+  for (size_t i = 0; i < width; ++i) {
+    result[i] = op(input[i]);
   }
-  return result;
 }
 
-Key EvalUnaryImmediate(OpType type, const Key& value) {
+void EvalUnaryImmediate(OpType type, const uint64_t* value, std::size_t width, uint64_t* result) {
   switch (type) {
-    case OpType::NOT: return EvalUnaryInternal(value, OpNot());
-    case OpType::SHL1: return EvalUnaryInternal(value, OpShl1());
-    case OpType::SHR1: return EvalUnaryInternal(value, OpShr1());
-    case OpType::SHR4: return EvalUnaryInternal(value, OpShr4());
-    case OpType::SHR16: return EvalUnaryInternal(value, OpShr16());
+    case OpType::NOT: return EvalUnaryInternal(value, width, OpNot(), result);
+    case OpType::SHL1: return EvalUnaryInternal(value, width, OpShl1(), result);
+    case OpType::SHR1: return EvalUnaryInternal(value, width, OpShr1(), result);
+    case OpType::SHR4: return EvalUnaryInternal(value, width, OpShr4(), result);
+    case OpType::SHR16: return EvalUnaryInternal(value, width, OpShr16(), result);
     default:
       LOG(FATAL) << "Unknown UnaryOpType.";
   }
@@ -177,91 +166,83 @@ struct PlusOp {
 };
 
 template<typename T>
-Key EvalBinaryInternal(const Key& input1, const Key& input2, T op) {
-  DCHECK_EQ(input1.size(), input2.size());
-  Key result;
-  result.reserve(input1.size());
-  for (size_t i = 0; i < input1.size(); ++i) {
-    result.push_back(op(input1[i], input2[i]));
+void EvalBinaryInternal(const uint64_t* input1, const uint64_t* input2, std::size_t width, T op,
+                        uint64_t* result) {
+  for (size_t i = 0; i < width; ++i) {
+    result[i] = op(input1[i], input2[i]);
   }
-  return result;
 }
 
-Key EvalBinaryImmediate(OpType type, const Key& value1, const Key& value2) {
+void EvalBinaryImmediate(OpType type, const uint64_t* value1, const uint64_t* value2,
+                         std::size_t width, uint64_t* result) {
   switch (type) {
-    case OpType::AND: return EvalBinaryInternal(value1, value2, AndOp());
-    case OpType::OR: return EvalBinaryInternal(value1, value2, OrOp());
-    case OpType::XOR: return EvalBinaryInternal(value1, value2, XorOp());
-    case OpType::PLUS: return EvalBinaryInternal(value1, value2, PlusOp());
+    case OpType::AND: return EvalBinaryInternal(value1, value2, width, AndOp(), result);
+    case OpType::OR: return EvalBinaryInternal(value1, value2, width, OrOp(), result);
+    case OpType::XOR: return EvalBinaryInternal(value1, value2, width, XorOp(), result);
+    case OpType::PLUS: return EvalBinaryInternal(value1, value2, width, PlusOp(), result);
     default:
       LOG(FATAL) << "Unknown BinaryOpType.";
   }
 }
 
-Key EvalIfImmediate(const Key& value1, const Key& value2, const Key& value3) {
-  Key result;
-  result.reserve(value1.size());
-  for (size_t i = 0; i < value1.size(); ++i) {
-    result.push_back(value1[i] == 0 ? value2[i] : value3[i]);
+void EvalIfImmediate(const uint64_t* value1, const uint64_t* value2, const uint64_t* value3,
+                     std::size_t width, uint64_t* result) {
+  for (size_t i = 0; i < width; ++i) {
+    result[i] = value1[i] == 0 ? value2[i] : value3[i];
   }
-  return result;
 }
 
-std::shared_ptr<Expr> MakeExpression(const std::map<Key, int>& size_dict,
-                                     const std::map<Key, Back> expr_dicts[],
-                                     const Key& key) {
-  auto found_size = size_dict.find(key);
-  if (found_size == size_dict.end()) {
+std::shared_ptr<Expr> MakeExpression(const SignatureTable& table, uint32_t index) {
+  if (index == SignatureTable::kNone) {
     LOG(ERROR) << "Not found";
     return std::shared_ptr<Expr>();
   }
-  auto found = expr_dicts[found_size->second].find(key);
-  switch (found->second.type) {
+  switch (table.type(index)) {
   case NOT:
     return UnaryOpExpr::Create(
         UnaryOpExpr::Type::NOT,
-        MakeExpression(size_dict, expr_dicts, *found->second.arg1));
+        MakeExpression(table, table.arg(index, 0)));
   case SHL1:
     return UnaryOpExpr::Create(
         UnaryOpExpr::Type::SHL1,
-        MakeExpression(size_dict, expr_dicts, *found->second.arg1));
+        MakeExpression(table, table.arg(index, 0)));
   case SHR1:
     return UnaryOpExpr::Create(
         UnaryOpExpr::Type::SHR1,
-        MakeExpression(size_dict, expr_dicts, *found->second.arg1));
+        MakeExpression(table, table.arg(index, 0)));
   case SHR4:
     return UnaryOpExpr::Create(
         UnaryOpExpr::Type::SHR4,
-        MakeExpression(size_dict, expr_dicts, *found->second.arg1));
+        MakeExpression(table, table.arg(index, 0)));
   case SHR16:
     return UnaryOpExpr::Create(
         UnaryOpExpr::Type::SHR16,
-        MakeExpression(size_dict, expr_dicts, *found->second.arg1));
+        MakeExpression(table, table.arg(index, 0)));
   case AND:
     return BinaryOpExpr::Create(
         BinaryOpExpr::Type::AND,
-        MakeExpression(size_dict, expr_dicts, *found->second.arg1),
-        MakeExpression(size_dict, expr_dicts, *found->second.arg2));
+        MakeExpression(table, table.arg(index, 0)),
+        MakeExpression(table, table.arg(index, 1)));
   case OR:
     return BinaryOpExpr::Create(
         BinaryOpExpr::Type::OR,
-        MakeExpression(size_dict, expr_dicts, *found->second.arg1),
-        MakeExpression(size_dict, expr_dicts, *found->second.arg2));
+        MakeExpression(table, table.arg(index, 0)),
+        MakeExpression(table, table.arg(index, 1)));
   case XOR:
     return BinaryOpExpr::Create(
         BinaryOpExpr::Type::XOR,
-        MakeExpression(size_dict, expr_dicts, *found->second.arg1),
-        MakeExpression(size_dict, expr_dicts, *found->second.arg2));
+        MakeExpression(table, table.arg(index, 0)),
+        MakeExpression(table, table.arg(index, 1)));
   case PLUS:
     return BinaryOpExpr::Create(
         BinaryOpExpr::Type::PLUS,
-        MakeExpression(size_dict, expr_dicts, *found->second.arg1),
-        MakeExpression(size_dict, expr_dicts, *found->second.arg2));
+        MakeExpression(table, table.arg(index, 0)),
+        MakeExpression(table, table.arg(index, 1)));
   case IF0:
     return If0Expr::Create(
-        MakeExpression(size_dict, expr_dicts, *found->second.arg1),
-        MakeExpression(size_dict, expr_dicts, *found->second.arg2),
-        MakeExpression(size_dict, expr_dicts, *found->second.arg3));
+        MakeExpression(table, table.arg(index, 0)),
+        MakeExpression(table, table.arg(index, 1)),
+        MakeExpression(table, table.arg(index, 2)));
   case FOLD:
     LOG(FATAL) << "Unsupported: FOLD";
   case TFOLD:
@@ -269,7 +250,7 @@ std::shared_ptr<Expr> MakeExpression(const std::map<Key, int>& size_dict,
   case LAMBDA:
     LOG(FATAL) << "Unexpected: Lambda";
   case CONSTANT:
-    return found->first[0] ? ConstantExpr::CreateOne() : ConstantExpr::CreateZero();
+    return table.values(index)[0] ? ConstantExpr::CreateOne() : ConstantExpr::CreateZero();
   case ID:
     // TODO
     return IdExpr::CreateX();
@@ -297,90 +278,80 @@ std::shared_ptr<Expr> Cardinal(const Key& arguments,
     if (op_type_set & type) binary_op_types.push_back(type);
   }
 
-  // { Output => Minimum Size }
-  std::map<Key, int> size_dict;
-
-  // TODO: To be std::map<std::vector<uint64_t>, std::shared_ptr<Expr> > dict;
-  // [output when |x0| is given, output when |x1| is given, ...] => backtrack
-  // { Size => { Output => Expr } }
-  std::map<Key, Back> expr_dicts[30];
+  // [output when |x0| is given, output when |x1| is given, ...] => backtrack,
+  // with the minimum size.
+  const std::size_t width = arguments.size();
+  SignatureTable table(width, max_size);
 
-  // unstable.insert(make_pair([0, 0, 0], ConstantExpr::CreateZero()));
-  Key zeroes, ones;
-  for (size_t i = 0; i < arguments.size(); ++i) {
-    zeroes.push_back(0);
-    ones.push_back(1);
-  }
-  expr_dicts[1].insert(std::make_pair(zeroes,
-                                      Back { OpType::CONSTANT }));
-  size_dict.insert(std::make_pair(zeroes, 1));
-  // unstable.insert(make_pair([1, 1, 1], ConstantExpr::CreateOne()));
-  expr_dicts[1].insert(std::make_pair(ones,
-                                      Back { OpType::CONSTANT }));
-  size_dict.insert(std::make_pair(ones, 1));
-  // unstable.insert(make_pair([a0, a1, a2], IdExpr::CreateX()));
-  expr_dicts[1].insert(std::make_pair(arguments,
-                                      Back { OpType::ID })); // Assumes ID = X
-  size_dict.insert(std::make_pair(arguments, 1));
+  Key zeroes(width, 0), ones(width, 1);
+  table.Insert(zeroes.data(), false, 1, OpType::CONSTANT);
+  table.Insert(ones.data(), false, 1, OpType::CONSTANT);
+  table.Insert(arguments.data(), false, 1, OpType::ID);  // Assumes ID = X
 
+  Key new_value(width);
   for (int size = 2; size <= max_size; ++size) {
     LOG(INFO) << "Size = " << size;
 
     // Randomize operator order.
     std::random_shuffle(unary_op_types.begin(), unary_op_types.end());
-    for (const auto& pair : expr_dicts[size - 1]) {
+    for (uint32_t e : table.level(size - 1)) {
+      const uint64_t* v = table.values(e);
       for (OpType type : unary_op_types) {
-        Key new_value = EvalUnaryImmediate(type, pair.first);
-        if (size_dict.insert(std::make_pair(new_value, size)).second) {
-          expr_dicts[size].insert(std::make_pair(new_value,
-                                                 Back { type, &pair.first }));
-        }
+        if (ComposesSmaller(table, type, e)) continue;
+        EvalUnaryImmediate(type, v, width, new_value.data());
+        table.Insert(new_value.data(), false, size, type, e);
       }
     }
-    LOG(INFO) << "  Dict[" << size << "] = " << expr_dicts[size].size() << " : Unary done";
+    LOG(INFO) << "  Dict[" << size << "] = " << table.level(size).size() << " : Unary done";
 
     // Randomize operator order.
     std::random_shuffle(binary_op_types.begin(), binary_op_types.end());
-    for (int arg1_size = 1; arg1_size < size - 1; ++arg1_size) {
+    // The binary operators are commutative, so the operands are taken with
+    // arg1 <= arg2 (by size, and then by index).
+    for (int arg1_size = 1; arg1_size <= size - 1 - arg1_size; ++arg1_size) {
       int arg2_size = size - 1 - arg1_size;
-      for (const auto& pair1 : expr_dicts[arg1_size]) {
-        for (const auto& pair2 : expr_dicts[arg2_size]) {
+      for (uint32_t e1 : table.level(arg1_size)) {
+        const uint64_t* v1 = table.values(e1);
+        for (uint32_t e2 : table.level(arg2_size)) {
+          if (arg1_size == arg2_size && e2 < e1) continue;
+          const uint64_t* v2 = table.values(e2);
           for (OpType type : binary_op_types) {
-            Key new_value = EvalBinaryImmediate(type, pair1.first, pair2.first);
-            if (size_dict.insert(std::make_pair(new_value, size)).second) {
-              expr_dicts[size].insert(std::make_pair(new_value,
-                                                     Back { type, &pair1.first, &pair2.first }));
-            }
+            if (ComposesSmaller(table, type, e1, e2)) continue;
+            EvalBinaryImmediate(type, v1, v2, width, new_value.data());
+            table.Insert(new_value.data(), false, size, type, e1, e2);
           }
         }
       }
     }
-    LOG(INFO) << "  Dict[" << size << "] = " << expr_dicts[size].size() << " : Binary done";
+    LOG(INFO) << "  Dict[" << size << "] = " << table.level(size).size() << " : Binary done";
 
     if (op_type_set & IF0) {
       for (int arg1_size = 1; arg1_size < size - 2; ++arg1_size) {
         for (int arg2_size = 1; arg2_size < size - arg1_size - 1; ++arg2_size) {
           int arg3_size = size - 1 - arg1_size - arg2_size;
-          for (const auto& pair1 : expr_dicts[arg1_size]) {
-            for (const auto& pair2 : expr_dicts[arg2_size]) {
-              for (const auto& pair3 : expr_dicts[arg3_size]) {
-                Key new_value = EvalIfImmediate(pair1.first, pair2.first, pair3.first);
-                if (size_dict.insert(std::make_pair(new_value, size)).second) {
-                  expr_dicts[size].insert(std::make_pair(new_value,
-                                                         Back { OpType::IF0,
-                                                                &pair1.first, &pair2.first, &pair3.first }));
-                }
+          for (uint32_t e1 : table.level(arg1_size)) {
+            const uint64_t* v1 = table.values(e1);
+            for (uint32_t e2 : table.level(arg2_size)) {
+              const uint64_t* v2 = table.values(e2);
+              for (uint32_t e3 : table.level(arg3_size)) {
+                // (if0 c t t) is t.
+                if (e3 == e2) continue;
+                const uint64_t* v3 = table.values(e3);
+                EvalIfImmediate(v1, v2, v3, width, new_value.data());
+                table.Insert(new_value.data(), false, size, OpType::IF0, e1, e2, e3);
               }
             }
           }
         }
       }
     }
-    LOG(INFO) << "  Dict[" << size << "] = " << expr_dicts[size].size() << " : If0 done";
+    LOG(INFO) << "  Dict[" << size << "] = " << table.level(size).size() << " : If0 done";
+    LOG(INFO) << "  Table = " << table.size() << " entries, "
+              << table.memory_bytes() / table.size() << " bytes/entry";
 
     if (mode == CONDITION || mode == BONUS_CONDITION) {
-      for (auto& item : expr_dicts[size]) {
-        const Key& k1 = item.first;
+      for (uint32_t e : table.level(size)) {
+        const uint64_t* k1 = table.values(e);
         bool mismatch = false;
         for (size_t i = 0; i < expecteds.size(); ++i) {
           if (mode == CONDITION) {
@@ -398,68 +369,20 @@ std::shared_ptr<Expr> Cardinal(const Key& arguments,
           }
         }
         if (!mismatch) {
-          return MakeExpression(size_dict, expr_dicts, k1);
+          return MakeExpression(table, e);
         }
       }
 
     } else {
       // TODO: Find it earlier.
-      std::map<Key, Back>::iterator found = expr_dicts[size].find(expecteds);
-      if (found != expr_dicts[size].end()) {
+      uint32_t found = table.Find(expecteds.data(), false);
+      if (found != SignatureTable::kNone && SignatureTable::expr_size(found) == size) {
         break;
       }
     }
   }
 
-#if 0
-  std::vector<std::pair<int, Key> > stack;
-  int depth = 0;
-  Key value = expecteds;
-
-  while (true) {
-    std::map<Key, int>::const_iterator found_size = size_dict.find(value);
-    if (found_size == size_dict.end()) {
-      std::cout << "Not found." << std::endl;
-      break;
-    }
-    int size = found_size->second;
-    std::map<Key, Back>::iterator found = expr_dicts[size].find(value);
-
-    for (int i = 0; i < depth; ++i) {
-      std::cout << " ";
-    }
-    std::cout << found->first << " <== "
-              << OpTypeToString(found->second.type) << " [size="
-              << size << "]" << std::endl;
-
-    if (found->second.type == CONSTANT ||
-        found->second.type == ID) {
-      if (stack.empty()) {
-        break;
-      }
-      std::pair<int, Key> popped = stack.back();
-      stack.pop_back();
-      depth = popped.first;
-      value = popped.second;
-    } else if (found->second.type == AND ||
-               found->second.type == OR ||
-               found->second.type == XOR ||
-               found->second.type == PLUS) {
-      ++depth;
-      value = *found->second.arg1;
-      stack.push_back(std::make_pair(depth, *found->second.arg2));
-    } else if (found->second.type == IF0) {
-      ++depth;
-      value = *found->second.arg1;
-      stack.push_back(std::make_pair(depth, *found->second.arg2));
-      stack.push_back(std::make_pair(depth, *found->second.arg3));
-    } else { // Unary
-      ++depth;
-      value = *found->second.arg1;
-    }
-  }
-#endif
-  return MakeExpression(size_dict, expr_dicts, expecteds);
+  return MakeExpression(table, table.Find(expecteds.data(), false));
 }
 
 
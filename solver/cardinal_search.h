@@ -0,0 +1,1500 @@
+#ifndef ICFPC_CARDINAL_SEARCH_H_
+#define ICFPC_CARDINAL_SEARCH_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "expr.h"
+#include "fold_body_table.h"
+#include "parallel.h"
+#include "signature_table.h"
+
+// The search of alice: Cardinal() composes the expressions of each size from
+// the smaller ones, keeping one of each signature (the outputs on the
+// arguments) in a SignatureTable, until one has the goal.
+
+namespace icfpc {
+
+std::string OpTypeToString(OpType type) {
+  switch (type) {
+  case NOT:
+    return "NOT";
+  case SHL1:
+    return "SHL1";
+  case SHR1:
+    return "SHR1";
+  case SHR4:
+    return "SHR4";
+  case SHR16:
+    return "SHR16";
+  case AND:
+    return "AND";
+  case OR:
+    return "OR";
+  case XOR:
+    return "XOR";
+  case PLUS:
+    return "PLUS";
+  case IF0:
+    return "IF0";
+  case FOLD:
+    return "FOLD";
+  case TFOLD:
+    return "TFOLD";
+  case LAMBDA:
+    return "LAMBDA";
+  case CONSTANT:
+    return "CONSTANT";
+  case ID:
+    return "ID";
+  default:
+    LOG(FATAL) << "Unknown OpType.";
+    abort();
+  }
+}
+
+static const OpType ALL_UNARY_OP_TYPES[] = {
+  OpType::NOT,
+  OpType::SHL1,
+  OpType::SHR1,
+  OpType::SHR4,
+  OpType::SHR16,
+};
+
+static const OpType ALL_BINARY_OP_TYPES[] = {
+  OpType::AND,
+  OpType::OR,
+  OpType::XOR,
+  OpType::PLUS,
+};
+
+// The fold bodies fold composes, which the caller lists or maps first. Those
+// of up to max_size() - 1 are composed.
+FoldBodyTable& FoldBodies() {
+  static FoldBodyTable table;
+  return table;
+}
+
+// The threads of ComposeCardinalLevel(), at most the hardware ones. Kept for
+// the sizes and the requests to come, and started again only for another
+// number of them.
+ThreadPool* CardinalThreadPool(int num_threads) {
+  static std::unique_ptr<ThreadPool> pool;
+  num_threads = std::max(1, HardwareThreads(num_threads));
+  if (!pool || pool->num_threads() != num_threads)
+    pool.reset(new ThreadPool(num_threads));
+  return pool.get();
+}
+
+struct OpNot {
+  uint64_t operator()(uint64_t value) const { return ~value; }
+};
+struct OpShl1 {
+  uint64_t operator()(uint64_t value) const { return value << 1; }
+};
+struct OpShr1 {
+  uint64_t operator()(uint64_t value) const { return value >> 1; }
+};
+struct OpShr4 {
+  uint64_t operator()(uint64_t value) const { return value >> 4; }
+};
+struct OpShr16 {
+  uint64_t operator()(uint64_t value) const { return value >> 16; }
+};
+
+template<typename T>
+void EvalUnaryInternal(const uint64_t* input, std::size_t width, T op, uint64_t* result) {
+  for (size_t i = 0; i < width; ++i) {
+    result[i] = op(input[i]);
+  }
+}
+
+void EvalUnaryImmediate(OpType type, const uint64_t* value, std::size_t width, uint64_t* result) {
+  switch (type) {
+    case OpType::NOT: return EvalUnaryInternal(value, width, OpNot(), result);
+    case OpType::SHL1: return EvalUnaryInternal(value, width, OpShl1(), result);
+    case OpType::SHR1: return EvalUnaryInternal(value, width, OpShr1(), result);
+    case OpType::SHR4: return EvalUnaryInternal(value, width, OpShr4(), result);
+    case OpType::SHR16: return EvalUnaryInternal(value, width, OpShr16(), result);
+    default:
+      LOG(FATAL) << "Unknown UnaryOpType.";
+      abort();
+  }
+}
+
+struct AndOp {
+  uint64_t operator()(uint64_t value1, uint64_t value2) const { return value1 & value2; }
+};
+struct OrOp {
+  uint64_t operator()(uint64_t value1, uint64_t value2) const { return value1 | value2; }
+};
+struct XorOp {
+  uint64_t operator()(uint64_t value1, uint64_t value2) const { return value1 ^ value2; }
+};
+struct PlusOp {
+  uint64_t operator()(uint64_t value1, uint64_t value2) const { return value1 + value2; }
+};
+
+template<typename T>
+void EvalBinaryInternal(const uint64_t* input1, const uint64_t* input2, std::size_t width, T op,
+                        uint64_t* result) {
+  for (size_t i = 0; i < width; ++i) {
+    result[i] = op(input1[i], input2[i]);
+  }
+}
+
+void EvalBinaryImmediate(OpType type, const uint64_t* value1, const uint64_t* value2,
+                         std::size_t width, uint64_t* result) {
+  switch (type) {
+    case OpType::AND: return EvalBinaryInternal(value1, value2, width, AndOp(), result);
+    case OpType::OR: return EvalBinaryInternal(value1, value2, width, OrOp(), result);
+    case OpType::XOR: return EvalBinaryInternal(value1, value2, width, XorOp(), result);
+    case OpType::PLUS: return EvalBinaryInternal(value1, value2, width, PlusOp(), result);
+    default:
+      LOG(FATAL) << "Unknown BinaryOpType.";
+      abort();
+  }
+}
+
+void EvalIfImmediate(const uint64_t* value1, const uint64_t* value2, const uint64_t* value3,
+                     std::size_t width, uint64_t* result) {
+  for (size_t i = 0; i < width; ++i) {
+    result[i] = value1[i] == 0 ? value2[i] : value3[i];
+  }
+}
+
+struct FoldOp {
+  uint64_t operator()(uint64_t x, uint64_t v, uint64_t init, const Expr& body) {
+    Env env;
+    env.x = x;
+    for (size_t i = 0; i < 8; ++i, v >>= 8) {
+      env.y = (v & 0xFF);
+      env.z = init;
+      init = body.Eval(env);
+    }
+    return init;
+  }
+};
+
+// Evaluates (fold value1 value2 (lambda (y z) body)) on all the arguments at
+// once, node by node with the immediate operators above. The outputs of the
+// nodes are kept in buffers of its own, not in the caches of Expr::Eval(), so
+// that the threads of FOLD_STEP, each with an evaluator, can share the bodies.
+class FoldEvaluator {
+ public:
+  explicit FoldEvaluator(const std::vector<uint64_t>& arguments)
+      : arguments_(arguments), y_(arguments.size()), z_(arguments.size()) {}
+
+  void Eval(const uint64_t* value1, const uint64_t* value2, const Expr& body,
+            uint64_t* result) {
+    const std::size_t width = arguments_.size();
+    std::copy(value2, value2 + width, z_.begin());
+    for (int shift = 0; shift < 64; shift += 8) {
+      for (std::size_t i = 0; i < width; ++i)
+        y_[i] = (value1[i] >> shift) & 0xFF;
+      const uint64_t* z = EvalBody(body, 0);
+      std::copy(z, z + width, z_.begin());
+    }
+    std::copy(z_.begin(), z_.end(), result);
+  }
+
+ private:
+  // Returns the outputs of |e|, in the buffer |depth|. Its operands take the
+  // buffers after it.
+  const uint64_t* EvalBody(const Expr& e, std::size_t depth) {
+    const std::size_t width = arguments_.size();
+    if (buffers_.size() <= depth)
+      buffers_.resize(depth + 1, std::vector<uint64_t>(width));
+    uint64_t* result = buffers_[depth].data();
+    switch (e.op_type()) {
+      case CONSTANT:
+        std::fill(result, result + width, static_cast<const ConstantExpr&>(e).value());
+        return result;
+      case ID:
+        switch (static_cast<const IdExpr&>(e).name()) {
+          case IdExpr::X: return arguments_.data();
+          case IdExpr::Y: return y_.data();
+          case IdExpr::Z: return z_.data();
+        }
+        break;
+      case NOT: case SHL1: case SHR1: case SHR4: case SHR16:
+        EvalUnaryImmediate(e.op_type(), EvalBody(*static_cast<const UnaryOpExpr&>(e).arg(),
+                                                 depth + 1),
+                           width, result);
+        return result;
+      case AND: case OR: case XOR: case PLUS: {
+        const BinaryOpExpr& binary = static_cast<const BinaryOpExpr&>(e);
+        const uint64_t* lhs = EvalBody(*binary.arg1(), depth + 1);
+        EvalBinaryImmediate(e.op_type(), lhs, EvalBody(*binary.arg2(), depth + 2), width, result);
+        return result;
+      }
+      case IF0: {
+        const If0Expr& if0 = static_cast<const If0Expr&>(e);
+        const uint64_t* cond = EvalBody(*if0.cond(), depth + 1);
+        const uint64_t* then_body = EvalBody(*if0.then_body(), depth + 2);
+        EvalIfImmediate(cond, then_body, EvalBody(*if0.else_body(), depth + 3), width, result);
+        return result;
+      }
+      default:
+        break;
+    }
+    LOG(FATAL) << "Unexpected in a fold body: " << e;
+    return result;
+  }
+
+  const std::vector<uint64_t>& arguments_;
+  std::vector<uint64_t> y_, z_;
+  std::vector<std::vector<uint64_t> > buffers_;
+
+  DISALLOW_COPY_AND_ASSIGN(FoldEvaluator);
+};
+
+// The fold body of a FOLD entry of SignatureTable, as its size and index in
+// FoldBodies().
+const int kFoldBodyIndexBits = 24;
+
+uint32_t FoldBodyRef(std::size_t body_size, std::size_t k) {
+  CHECK_LT(k, std::size_t(1) << kFoldBodyIndexBits);
+  return (body_size << kFoldBodyIndexBits) | k;
+}
+
+std::shared_ptr<Expr> FoldBodyFromRef(uint32_t ref) {
+  return FoldBodies().body(ref >> kFoldBodyIndexBits, ref & ((1U << kFoldBodyIndexBits) - 1));
+}
+
+std::shared_ptr<Expr> MakeExpression(const SignatureTable& table, uint32_t index);
+
+// Makes the expression of the entry |index| of |table|, whose operands are
+// entries of |operands|.
+std::shared_ptr<Expr> MakeExpression(const SignatureTable& table, uint32_t index,
+                                     const SignatureTable& operands) {
+  if (index == SignatureTable::kNone) {
+    LOG(ERROR) << "Not found";
+    return std::shared_ptr<Expr>();
+  }
+  switch (table.type(index)) {
+  case NOT:
+    return UnaryOpExpr::Create(
+        UnaryOpExpr::Type::NOT,
+        MakeExpression(operands, table.arg(index, 0)));
+  case SHL1:
+    return UnaryOpExpr::Create(
+        UnaryOpExpr::Type::SHL1,
+        MakeExpression(operands, table.arg(index, 0)));
+  case SHR1:
+    return UnaryOpExpr::Create(
+        UnaryOpExpr::Type::SHR1,
+        MakeExpression(operands, table.arg(index, 0)));
+  case SHR4:
+    return UnaryOpExpr::Create(
+        UnaryOpExpr::Type::SHR4,
+        MakeExpression(operands, table.arg(index, 0)));
+  case SHR16:
+    return UnaryOpExpr::Create(
+        UnaryOpExpr::Type::SHR16,
+        MakeExpression(operands, table.arg(index, 0)));
+  case AND:
+    return BinaryOpExpr::Create(
+        BinaryOpExpr::Type::AND,
+        MakeExpression(operands, table.arg(index, 0)),
+        MakeExpression(operands, table.arg(index, 1)));
+  case OR:
+    return BinaryOpExpr::Create(
+        BinaryOpExpr::Type::OR,
+        MakeExpression(operands, table.arg(index, 0)),
+        MakeExpression(operands, table.arg(index, 1)));
+  case XOR:
+    return BinaryOpExpr::Create(
+        BinaryOpExpr::Type::XOR,
+        MakeExpression(operands, table.arg(index, 0)),
+        MakeExpression(operands, table.arg(index, 1)));
+  case PLUS:
+    return BinaryOpExpr::Create(
+        BinaryOpExpr::Type::PLUS,
+        MakeExpression(operands, table.arg(index, 0)),
+        MakeExpression(operands, table.arg(index, 1)));
+  case IF0:
+    return If0Expr::Create(
+        MakeExpression(operands, table.arg(index, 0)),
+        MakeExpression(operands, table.arg(index, 1)),
+        MakeExpression(operands, table.arg(index, 2)));
+  case FOLD:
+    return FoldExpr::Create(
+        MakeExpression(operands, table.arg(index, 0)),
+        MakeExpression(operands, table.arg(index, 1)),
+        FoldBodyFromRef(table.arg(index, 2)));
+  case TFOLD:
+    LOG(FATAL) << "Unsupported: TFOLD";
+  case LAMBDA:
+    LOG(FATAL) << "Unexpected: Lambda";
+  case CONSTANT:
+    return table.values(index)[0] ? ConstantExpr::CreateOne() : ConstantExpr::CreateZero();
+  case ID:
+    // TODO
+    return IdExpr::CreateX();
+  default:
+    LOG(FATAL) << "Unknown OpType.";
+    abort();
+  }
+}
+
+std::shared_ptr<Expr> MakeExpression(const SignatureTable& table, uint32_t index) {
+  return MakeExpression(table, index, table);
+}
+
+// The time limit of a call to Cardinal(), on the monotonic clock, which is
+// cut short once *|cancelled| is set, if given.
+class Deadline {
+ public:
+  Deadline(int timeout_sec, const std::atomic<bool>* cancelled)
+      : end_(std::chrono::steady_clock::now() + std::chrono::seconds(timeout_sec)),
+        cancelled_(cancelled) {}
+
+  bool Passed() const {
+    return (cancelled_ && *cancelled_) || std::chrono::steady_clock::now() > end_;
+  }
+
+ private:
+  const std::chrono::steady_clock::time_point end_;
+  const std::atomic<bool>* cancelled_;
+};
+
+// A part of a step of Cardinal(): the entries [begin[0], end[0]) of the size
+// arg_sizes[0] (or of its conditions, for if0), composed with the entries
+// [begin[k], end[k]) of arg_sizes[k] (or the fold bodies of arg_sizes[2],
+// for fold).
+struct CardinalTask {
+  int arg_sizes[3];
+  std::size_t begin[3], end[3];
+};
+
+// Splits the entries of the first operand of |task| into tasks, each of
+// which composes about the same number of outputs of |width|, given that an
+// entry composes |per_entry| expressions.
+void AddCardinalTasks(const CardinalTask& task, std::size_t width, std::size_t per_entry,
+                      std::vector<CardinalTask>* tasks) {
+  const std::size_t kTaskOutputs = 1 << 18;
+  std::size_t block = std::max<std::size_t>(
+      1, kTaskOutputs / std::max<std::size_t>(1, per_entry * width));
+  for (std::size_t begin = task.begin[0]; begin < task.end[0]; begin += block) {
+    CardinalTask part = task;
+    part.begin[0] = begin;
+    part.end[0] = std::min(task.end[0], begin + block);
+    tasks->push_back(part);
+  }
+}
+
+// Takes the expressions a CardinalTask composes. Adds them to the table
+// right away, calling |stop| with each entry added, or, in a thread of
+// ComposeCardinalLevel(), keeps those not in the table yet to be added later.
+// Those with fold are dropped if the signature is there without fold. Those
+// not added are kept as duplicates (see SignatureTable). Stops when
+// |deadline| has passed, which it checks every 1024 expressions. If |pack| is
+// given, the table takes pack(values) as the signature instead, and keeps no
+// duplicates.
+class CardinalSink {
+ public:
+  typedef std::function<void(const uint64_t* values, uint64_t* signature)> Pack;
+
+  CardinalSink(SignatureTable* table, int size, bool has_fold, const Deadline* deadline,
+               const Pack* pack, const std::function<bool(uint32_t)>* stop)
+      : table_(table), size_(size), has_fold_(has_fold), deadline_(deadline), pack_(pack),
+        stop_(stop), keeps_duplicates_(pack == NULL), num_calls_(0), is_stopped_(false) {}
+
+  void Add(const uint64_t* values, OpType type, uint32_t arg1 = SignatureTable::kNone,
+           uint32_t arg2 = SignatureTable::kNone, uint32_t arg3 = SignatureTable::kNone) {
+    if ((++num_calls_ & 0x3FF) == 0 && deadline_->Passed())
+      is_stopped_ = true;
+    if (is_stopped_)
+      return;
+    if (pack_) {
+      packed_.resize(table_->width());
+      (*pack_)(values, packed_.data());
+      values = packed_.data();
+    }
+    // Found non-has-fold entry.
+    if (has_fold_) {
+      uint32_t entry = table_->Find(values, false);
+      if (entry != SignatureTable::kNone)
+        return AddDuplicate(type, entry, arg1, arg2, arg3);
+    }
+    if (stop_) {
+      uint32_t entry;
+      if (!table_->Insert(values, has_fold_, size_, type, arg1, arg2, arg3, &entry))
+        return AddDuplicate(type, entry, arg1, arg2, arg3);
+      if ((*stop_)(entry))
+        is_stopped_ = true;
+      return;
+    }
+    uint32_t entry = table_->Find(values, has_fold_);
+    if (entry != SignatureTable::kNone)
+      return AddDuplicate(type, entry, arg1, arg2, arg3);
+    values_.insert(values_.end(), values, values + table_->width());
+    types_.push_back(type);
+    args_.insert(args_.end(), { SignatureTable::kNone, arg1, arg2, arg3 });
+  }
+
+  // Adds the kept expressions to the table, in the order they were composed.
+  // Returns false if stopped.
+  bool Flush(const std::function<bool(uint32_t)>& stop) {
+    CardinalSink sink(table_, size_, has_fold_, deadline_, NULL, &stop);
+    sink.keeps_duplicates_ = keeps_duplicates_;
+    const uint64_t* values = values_.data();
+    for (std::size_t i = 0; i < types_.size() && !sink.is_stopped(); ++i) {
+      const uint32_t* args = &args_[i * 4];
+      if (args[0] != SignatureTable::kNone) {
+        sink.AddDuplicate(types_[i], args[0], args[1], args[2], args[3]);
+        continue;
+      }
+      sink.Add(values, types_[i], args[1], args[2], args[3]);
+      values += table_->width();
+    }
+    return !sink.is_stopped() && !is_stopped_;
+  }
+
+  bool has_fold() const { return has_fold_; }
+  bool is_stopped() const { return is_stopped_; }
+
+  // The bytes of the expressions kept.
+  std::size_t memory_bytes() const {
+    return (packed_.capacity() + values_.capacity()) * sizeof(uint64_t) +
+        types_.capacity() * sizeof(OpType) + args_.capacity() * sizeof(uint32_t);
+  }
+
+ private:
+  void AddDuplicate(OpType type, uint32_t entry, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+    if (!keeps_duplicates_)
+      return;
+    if (stop_)
+      return table_->AddDuplicate(size_, type, has_fold_, entry, arg1, arg2, arg3);
+    types_.push_back(type);
+    args_.insert(args_.end(), { entry, arg1, arg2, arg3 });
+  }
+
+  SignatureTable* table_;
+  int size_;
+  bool has_fold_;
+  const Deadline* deadline_;
+  const Pack* pack_;  // NULL if the values are the signature
+  const std::function<bool(uint32_t)>* stop_;  // NULL if kept
+  bool keeps_duplicates_;  // false with |pack_|
+  std::size_t num_calls_;
+  bool is_stopped_;
+  std::vector<uint64_t> packed_;
+  // The expressions kept, of which the values of those to add.
+  std::vector<uint64_t> values_;
+  std::vector<OpType> types_;
+  std::vector<uint32_t> args_;  // the entry of a duplicate or kNone, and the operands
+};
+
+// Runs compose(task, &sink) for |tasks| from *|next_task| on |num_threads|
+// threads, adding what they compose to |table| as of |size|, packed by
+// |pack| if given (see CardinalSink). The threads run
+// batches of tasks while the table is only read, and then what they compose
+// is added on the calling thread in the task order, so that the table is the
+// same as on a single thread. *|sink_bytes|, if given, is the bytes of what
+// is left to add meanwhile. Returns false once |deadline| has passed, or
+// |stop| returns true on an entry added, with *|next_task| at the first task
+// not added in full.
+template<typename Compose>
+bool ComposeCardinalLevel(SignatureTable* table, int size, bool has_fold, int num_threads,
+                          const std::vector<CardinalTask>& tasks, std::size_t* next_task,
+                          Compose compose, const Deadline& deadline,
+                          const CardinalSink::Pack* pack,
+                          const std::function<bool(uint32_t)>& stop,
+                          std::size_t* sink_bytes = NULL) {
+  ThreadPool* pool = CardinalThreadPool(num_threads);
+  if (pool->num_threads() <= 1) {
+    for (; *next_task < tasks.size(); ++*next_task) {
+      CardinalSink sink(table, size, has_fold, &deadline, pack, &stop);
+      compose(tasks[*next_task], &sink);
+      if (sink.is_stopped())
+        return false;
+    }
+    return true;
+  }
+
+  std::size_t unused_bytes;
+  if (!sink_bytes)
+    sink_bytes = &unused_bytes;
+  const std::size_t batch_size = pool->num_threads() * 4;
+  while (*next_task < tasks.size()) {
+    std::size_t first = *next_task;
+    std::size_t last = std::min(tasks.size(), first + batch_size);
+    std::vector<CardinalSink> sinks(last - first,
+                                    CardinalSink(table, size, has_fold, &deadline, pack, NULL));
+    pool->ParallelFor(last - first, [&](std::size_t i) {
+      compose(tasks[first + i], &sinks[i]);
+    });
+    *sink_bytes = 0;
+    for (const CardinalSink& sink : sinks)
+      *sink_bytes += sink.memory_bytes();
+    for (CardinalSink& sink : sinks) {
+      bool flushed = sink.Flush(stop);
+      *sink_bytes -= sink.memory_bytes();
+      sink = CardinalSink(table, size, has_fold, &deadline, pack, NULL);
+      if (!flushed) {
+        *sink_bytes = 0;
+        return false;
+      }
+      ++*next_task;
+    }
+  }
+  return true;
+}
+
+enum CardinalMode {
+  SOLVE, CONDITION, BONUS_CONDITION,
+};
+
+// Packs in |bits| what a condition takes from each of |values|: whether it
+// is non-zero in CONDITION, and its LSB in BONUS_CONDITION.
+void PackConditionOutcomes(CardinalMode mode, const uint64_t* values, std::size_t width,
+                           uint64_t* bits) {
+  std::fill(bits, bits + (width + 63) / 64, 0);
+  for (std::size_t i = 0; i < width; ++i) {
+    bool outcome = mode == CONDITION ? values[i] != 0 : (values[i] & 1) != 0;
+    bits[i / 64] |= static_cast<uint64_t>(outcome) << (i % 64);
+  }
+}
+
+// The steps of composing a size, in order. Those from FOLD_UNARY_STEP
+// compose the expressions with fold, and run only with fold among the
+// operators.
+enum CardinalStep {
+  UNARY_STEP, BINARY_STEP, IF0_STEP, FOLD_UNARY_STEP, FOLD_BINARY_STEP, FOLD_STEP,
+};
+
+// The entries of a table being widened which it had before (see
+// WidenCardinalBank()), by size: the first num_plain[size] without fold and
+// the first num_fold[size] with fold, and the first num_conditions[size]
+// conditions.
+struct CardinalOldEntries {
+  explicit CardinalOldEntries(int max_size)
+      : num_plain(max_size + 1), num_fold(max_size + 1), num_conditions(max_size + 1) {}
+
+  std::vector<std::size_t> num_plain, num_fold, num_conditions;
+};
+
+// Composes the expressions of a size from the entries of |table| of the
+// smaller sizes, in the steps above.
+class CardinalComposer {
+ public:
+  CardinalComposer(const SignatureTable& table, const std::vector<uint64_t>& arguments,
+                   int op_type_set)
+      : table_(table), arguments_(arguments), op_type_set_(op_type_set),
+        conditions_(table.max_size() + 1), zero_masks_((table.width() + 63) / 64, table.max_size()),
+        conditions_size_(0) {
+    for (OpType type : ALL_UNARY_OP_TYPES) {
+      if (op_type_set & type) unary_op_types_.push_back(type);
+    }
+    for (OpType type : ALL_BINARY_OP_TYPES) {
+      if (op_type_set & type) binary_op_types_.push_back(type);
+    }
+  }
+
+  // Randomize operator order.
+  void Shuffle(CardinalStep step) {
+    if (step == UNARY_STEP || step == FOLD_UNARY_STEP)
+      std::random_shuffle(unary_op_types_.begin(), unary_op_types_.end());
+    if (step == BINARY_STEP || step == FOLD_BINARY_STEP)
+      std::random_shuffle(binary_op_types_.begin(), binary_op_types_.end());
+  }
+
+  // The conditions of if0 composed, by size: the first of each zero-mask
+  // (see PackConditionOutcomes()) of the smallest size. The output of
+  // (if0 c t e) depends on c only through it, so the other conditions
+  // compose nothing new, nor do those zero or non-zero on all the
+  // arguments, as t or e is smaller.
+  const std::vector<std::vector<uint32_t> >& conditions() const { return conditions_; }
+
+  // Adds the conditions of up to |max_condition_size|, trying those of
+  // |first| (by size) before the others.
+  void AddConditions(int max_condition_size,
+                     const std::vector<std::vector<uint32_t> >* first = NULL) {
+    const std::size_t width = table_.width();
+    std::vector<uint64_t> zero_mask(zero_masks_.width());
+    auto add = [&](uint32_t e) {
+      const uint64_t* v = table_.values(e);
+      std::size_t i = 1;
+      while (i < width && (v[i] != 0) == (v[0] != 0))
+        ++i;
+      if (i == width)
+        return;
+      PackConditionOutcomes(CONDITION, v, width, zero_mask.data());
+      if (zero_masks_.Insert(zero_mask.data(), false, conditions_size_, OpType::CONSTANT, e))
+        conditions_[conditions_size_].push_back(e);
+    };
+    while (conditions_size_ < max_condition_size) {
+      ++conditions_size_;
+      if (first) {
+        for (uint32_t e : (*first)[conditions_size_])
+          add(e);
+      }
+      for (uint32_t e : table_.level(conditions_size_)) {
+        if (table_.has_fold(e)) break;
+        add(e);
+      }
+    }
+  }
+
+  // Returns the tasks of |step| for |size|, which compose all the
+  // expressions, or, if |old| is given, those of which an operand is not
+  // among it, each once.
+  std::vector<CardinalTask> Tasks(CardinalStep step, int size,
+                                  const CardinalOldEntries* old = NULL) {
+    typedef std::pair<std::size_t, std::size_t> Range;
+    auto count = [](const Range& range) { return range.second - range.first; };
+    auto all = [&](int arg_size) { return Range(0, table_.level(arg_size).size()); };
+    // The entries of |arg_size| among |old|, and those not, without fold
+    // and with fold.
+    auto old_ranges = [&](int arg_size) {
+      const std::size_t num_plain = table_.num_plain(arg_size);
+      return std::vector<Range>{ Range(0, old->num_plain[arg_size]),
+                                 Range(num_plain, num_plain + old->num_fold[arg_size]) };
+    };
+    auto new_ranges = [&](int arg_size) {
+      const std::size_t num_plain = table_.num_plain(arg_size);
+      return std::vector<Range>{ Range(old->num_plain[arg_size], num_plain),
+                                 Range(num_plain + old->num_fold[arg_size],
+                                       table_.level(arg_size).size()) };
+    };
+
+    std::vector<CardinalTask> tasks;
+    auto add = [&](int arg1_size, Range range1, int arg2_size, Range range2,
+                   int arg3_size, Range range3, std::size_t per_entry) {
+      if (count(range1) == 0 || per_entry == 0)
+        return;
+      CardinalTask task = {
+        { arg1_size, arg2_size, arg3_size },
+        { range1.first, range2.first, range3.first },
+        { range1.second, range2.second, range3.second }
+      };
+      AddCardinalTasks(task, table_.width(), per_entry, &tasks);
+    };
+
+    switch (step) {
+      case UNARY_STEP:
+      case FOLD_UNARY_STEP: {
+        Range range = all(size - 1);
+        if (old)
+          range = new_ranges(size - 1)[step == FOLD_UNARY_STEP];
+        add(size - 1, range, 0, Range(), 0, Range(), unary_op_types_.size());
+        break;
+      }
+      case BINARY_STEP:
+      case FOLD_BINARY_STEP:
+        // The binary operators are commutative, so the operands are taken
+        // with arg1 <= arg2 (by size, and then by index).
+        for (int arg1_size = 1; arg1_size <= size - 1 - arg1_size; ++arg1_size) {
+          const int arg2_size = size - 1 - arg1_size;
+          auto add_pairs = [&](Range range1, Range range2) {
+            add(arg1_size, range1, arg2_size, range2, 0, Range(),
+                count(range2) * binary_op_types_.size());
+          };
+          if (!old) {
+            add_pairs(all(arg1_size), all(arg2_size));
+            continue;
+          }
+          // With arg1 new, or else arg2.
+          for (const Range& range1 : new_ranges(arg1_size))
+            add_pairs(range1, all(arg2_size));
+          for (const Range& range1 : old_ranges(arg1_size)) {
+            for (const Range& range2 : new_ranges(arg2_size))
+              add_pairs(range1, range2);
+          }
+        }
+        break;
+      case IF0_STEP:
+        if (!(op_type_set_ & OpType::IF0))
+          break;
+        AddConditions(size - 3);
+        for (int arg1_size = 1; arg1_size < size - 2; ++arg1_size) {
+          const Range conditions(0, conditions_[arg1_size].size());
+          for (int arg2_size = 1; arg2_size < size - arg1_size - 1; ++arg2_size) {
+            const int arg3_size = size - 1 - arg1_size - arg2_size;
+            auto add_triples = [&](Range range1, Range range2, Range range3) {
+              add(arg1_size, range1, arg2_size, range2, arg3_size, range3,
+                  count(range2) * count(range3));
+            };
+            if (!old) {
+              add_triples(conditions, all(arg2_size), all(arg3_size));
+              continue;
+            }
+            // With the condition new, or else the then-branch, or else the
+            // else-branch.
+            const Range old_conditions(0, old->num_conditions[arg1_size]);
+            add_triples(Range(old_conditions.second, conditions.second), all(arg2_size),
+                        all(arg3_size));
+            for (const Range& range2 : new_ranges(arg2_size))
+              add_triples(old_conditions, range2, all(arg3_size));
+            for (const Range& range2 : old_ranges(arg2_size)) {
+              for (const Range& range3 : new_ranges(arg3_size))
+                add_triples(old_conditions, range2, range3);
+            }
+          }
+        }
+        break;
+      case FOLD_STEP: {
+        FoldBodyTable& fold_bodies = FoldBodies();
+        for (int body_size = 1;
+             body_size < std::min<int>(size - 2, fold_bodies.max_size()); ++body_size) {
+          // Decoded here, so that the tasks only read them.
+          const Range bodies(0, fold_bodies.bodies(body_size).size());
+          for (int arg1_size = 1; arg1_size < size - body_size - 1; ++arg1_size) {
+            const int arg2_size = size - 1 - body_size - arg1_size;
+            auto add_folds = [&](Range range1, Range range2) {
+              add(arg1_size, range1, arg2_size, range2, body_size, bodies,
+                  count(range2) * count(bodies));
+            };
+            if (!old) {
+              add_folds(all(arg1_size), all(arg2_size));
+              continue;
+            }
+            // With the first new, or else the second.
+            for (const Range& range1 : new_ranges(arg1_size))
+              add_folds(range1, all(arg2_size));
+            for (const Range& range1 : old_ranges(arg1_size)) {
+              for (const Range& range2 : new_ranges(arg2_size))
+                add_folds(range1, range2);
+            }
+          }
+        }
+        break;
+      }
+    }
+    return tasks;
+  }
+
+  // Composes the expressions of |task| of |step| to |sink|. Only reads the
+  // composer, the table and the fold bodies, so the tasks may run on many
+  // threads.
+  void Compose(CardinalStep step, const CardinalTask& task, CardinalSink* sink) {
+    switch (step) {
+      case UNARY_STEP:
+      case FOLD_UNARY_STEP:
+        return ComposeUnary(task, sink);
+      case BINARY_STEP:
+      case FOLD_BINARY_STEP:
+        return ComposeBinary(task, sink);
+      case IF0_STEP:
+        return ComposeIf0(task, sink);
+      case FOLD_STEP:
+        return ComposeFold(task, sink);
+    }
+  }
+
+ private:
+  void ComposeUnary(const CardinalTask& task, CardinalSink* sink) const {
+    std::vector<uint64_t> new_value(table_.width());
+    for (std::size_t i = task.begin[0]; i < task.end[0] && !sink->is_stopped(); ++i) {
+      uint32_t e = SignatureTable::Ref(task.arg_sizes[0], i);
+      if (table_.has_fold(e) != sink->has_fold()) continue;
+      const uint64_t* v = table_.values(e);
+      for (OpType type : unary_op_types_) {
+        if (ComposesSmaller(table_, type, e)) continue;
+        EvalUnaryImmediate(type, v, table_.width(), new_value.data());
+        // TODO
+        sink->Add(new_value.data(), type, e);
+      }
+    }
+  }
+
+  void ComposeBinary(const CardinalTask& task, CardinalSink* sink) const {
+    std::vector<uint64_t> new_value(table_.width());
+    const bool same_size = task.arg_sizes[0] == task.arg_sizes[1];
+    for (std::size_t i = task.begin[0]; i < task.end[0] && !sink->is_stopped(); ++i) {
+      uint32_t e1 = SignatureTable::Ref(task.arg_sizes[0], i);
+      if (!sink->has_fold() && table_.has_fold(e1)) break;
+      const uint64_t* v1 = table_.values(e1);
+      std::size_t begin = same_size ? std::max(i, task.begin[1]) : task.begin[1];
+      // With fold, an e1 without fold only goes with the e2 with fold, so the
+      // loop skips to them rather than spin on the others without calling
+      // Add(), which is where the deadline is checked.
+      if (sink->has_fold() && !table_.has_fold(e1))
+        begin = std::max(begin, table_.num_plain(task.arg_sizes[1]));
+      for (std::size_t j = begin; j < task.end[1]; ++j) {
+        uint32_t e2 = SignatureTable::Ref(task.arg_sizes[1], j);
+        if (!sink->has_fold() && table_.has_fold(e2)) break;
+        const uint64_t* v2 = table_.values(e2);
+        for (OpType type : binary_op_types_) {
+          if (ComposesSmaller(table_, type, e1, e2)) continue;
+          EvalBinaryImmediate(type, v1, v2, table_.width(), new_value.data());
+          // TODO
+          sink->Add(new_value.data(), type, e1, e2);
+        }
+      }
+    }
+  }
+
+  void ComposeIf0(const CardinalTask& task, CardinalSink* sink) const {
+    std::vector<uint64_t> new_value(table_.width());
+    for (std::size_t i = task.begin[0]; i < task.end[0] && !sink->is_stopped(); ++i) {
+      uint32_t e1 = conditions_[task.arg_sizes[0]][i];
+      const uint64_t* v1 = table_.values(e1);
+      for (std::size_t j = task.begin[1]; j < task.end[1]; ++j) {
+        uint32_t e2 = SignatureTable::Ref(task.arg_sizes[1], j);
+        if (table_.has_fold(e2) || sink->is_stopped()) break;
+        const uint64_t* v2 = table_.values(e2);
+        for (std::size_t k = task.begin[2]; k < task.end[2]; ++k) {
+          uint32_t e3 = SignatureTable::Ref(task.arg_sizes[2], k);
+          if (table_.has_fold(e3)) break;
+          // (if0 c t t) is t.
+          if (e3 == e2) continue;
+          const uint64_t* v3 = table_.values(e3);
+          EvalIfImmediate(v1, v2, v3, table_.width(), new_value.data());
+          // TODO
+          sink->Add(new_value.data(), OpType::IF0, e1, e2, e3);
+        }
+      }
+    }
+  }
+
+  void ComposeFold(const CardinalTask& task, CardinalSink* sink) const {
+    const std::vector<std::shared_ptr<Expr> >& bodies = FoldBodies().bodies(task.arg_sizes[2]);
+    FoldEvaluator evaluator(arguments_);
+    std::vector<uint64_t> new_value(table_.width());
+    for (std::size_t i = task.begin[0]; i < task.end[0] && !sink->is_stopped(); ++i) {
+      uint32_t e1 = SignatureTable::Ref(task.arg_sizes[0], i);
+      if (table_.has_fold(e1)) break;
+      const uint64_t* v1 = table_.values(e1);
+      for (std::size_t j = task.begin[1]; j < task.end[1]; ++j) {
+        uint32_t e2 = SignatureTable::Ref(task.arg_sizes[1], j);
+        if (table_.has_fold(e2) || sink->is_stopped()) break;
+        const uint64_t* v2 = table_.values(e2);
+        for (std::size_t k = task.begin[2]; k < task.end[2]; ++k) {
+          evaluator.Eval(v1, v2, *bodies[k], new_value.data());
+          sink->Add(new_value.data(), OpType::FOLD, e1, e2, FoldBodyRef(task.arg_sizes[2], k));
+        }
+      }
+    }
+  }
+
+  const SignatureTable& table_;
+  const std::vector<uint64_t>& arguments_;  // of the columns of |table_|
+  const int op_type_set_;
+  std::vector<OpType> unary_op_types_;
+  std::vector<OpType> binary_op_types_;
+  std::vector<std::vector<uint32_t> > conditions_;
+  SignatureTable zero_masks_;  // of |conditions_|
+  int conditions_size_;  // the size |conditions_| are added up to
+
+  DISALLOW_COPY_AND_ASSIGN(CardinalComposer);
+};
+
+// The signature table of a call site of Cardinal(), kept across the requests
+// of a problem. When a request has new arguments besides those of the table,
+// they are added as columns (see WidenCardinalBank()), and the search resumes
+// after the sizes built. A request which timed out or found its goal is
+// resumed from the task it stopped at, if it has no new arguments.
+struct CardinalBank {
+  CardinalBank()
+      : op_type_set(0), mode(SOLVE), built_size(0), step(0), next_task(0), full(false),
+        sink_bytes(0) {}
+
+  void Reset() {
+    table.reset();
+    outcomes.reset();
+    arguments.clear();
+    step = 0;
+    next_task = 0;
+    full = false;
+  }
+
+  std::size_t memory_bytes() const {
+    return (table ? table->memory_bytes() : 0) + (outcomes ? outcomes->memory_bytes() : 0) +
+        sink_bytes;
+  }
+
+  std::unique_ptr<SignatureTable> table;
+  // In the condition modes, the outcomes of the expressions of size 2 and
+  // more (see PackConditionOutcomes()), each with the operator and the
+  // operands (in |table|) of the first one which has them. Many expressions
+  // have the same outcomes, so the goal is looked up here. Nothing is
+  // composed of those of the largest size, so they are only kept here.
+  // Built on the first use, and dropped with new columns.
+  std::unique_ptr<SignatureTable> outcomes;
+  std::vector<uint64_t> arguments;  // of the columns of |table|, distinct
+  int op_type_set;
+  CardinalMode mode;
+  int built_size;  // the last size composed in full
+  // The CardinalStep for the size after |built_size|, and its first task not
+  // composed in full.
+  int step;
+  std::size_t next_task;
+  // Whether composing reached --memory_budget_mb. Only the goal is looked up
+  // then, until the bank is reset.
+  bool full;
+  // The bytes of what the threads composed and ComposeCardinalLevel() has
+  // not added to the table yet.
+  std::size_t sink_bytes;
+};
+
+// Adds the columns of |new_arguments| to the table of |bank|, making it the
+// table composing the sizes built on all the arguments would make, up to
+// which expression an entry is made of. Each size is made in turn from the
+// smaller ones:
+// - Its entries are evaluated on |new_arguments| from their operands.
+// - So are its duplicates (see SignatureTable). Those which differ from
+//   their entry there split off, as entries, or duplicates of an entry split
+//   off before.
+// - The expressions of which an operand is new are composed, on
+//   |num_threads| threads.
+// The sizes after bank->built_size are dropped, to be composed again.
+// Returns false if |deadline| passed first.
+bool WidenCardinalBank(CardinalBank* bank, const std::vector<uint64_t>& new_arguments,
+                       int num_threads, const Deadline& deadline) {
+  const SignatureTable& old = *bank->table;
+  const std::size_t old_width = old.width();
+  const std::size_t num_new = new_arguments.size();
+  std::vector<uint64_t> arguments = bank->arguments;
+  arguments.insert(arguments.end(), new_arguments.begin(), new_arguments.end());
+  std::unique_ptr<SignatureTable> table(new SignatureTable(arguments.size(), old.max_size()));
+
+  CardinalComposer old_composer(old, bank->arguments, bank->op_type_set);
+  old_composer.AddConditions(bank->built_size - 3);
+  CardinalComposer composer(*table, arguments, bank->op_type_set);
+  CardinalOldEntries old_entries(old.max_size());
+  // The entries of |old| in |table|. Those without fold come first, so only
+  // those with fold move.
+  auto entry = [&](uint32_t e) {
+    const int size = SignatureTable::expr_size(e);
+    const std::size_t index = SignatureTable::index(e);
+    if (index < old_entries.num_plain[size])
+      return e;
+    return SignatureTable::Ref(size, table->num_plain(size) + index - old_entries.num_plain[size]);
+  };
+  std::vector<uint64_t> value(arguments.size());
+  uint64_t* added = value.data() + old_width;
+  FoldEvaluator fold_evaluator(new_arguments);
+  uint32_t args[3];
+  // Takes the operands of (|type| |old_args|) in |table| to |args|, and
+  // evaluates it on |new_arguments| to |added|.
+  auto evaluate = [&](OpType type, const uint32_t* old_args) {
+    for (int k = 0; k < 3; ++k) {
+      const bool is_entry = old_args[k] != SignatureTable::kNone && (type != FOLD || k < 2);
+      args[k] = is_entry ? entry(old_args[k]) : old_args[k];
+    }
+    auto arg = [&](int k) { return table->values(args[k]) + old_width; };
+    switch (type) {
+      case NOT: case SHL1: case SHR1: case SHR4: case SHR16:
+        EvalUnaryImmediate(type, arg(0), num_new, added);
+        break;
+      case AND: case OR: case XOR: case PLUS:
+        EvalBinaryImmediate(type, arg(0), arg(1), num_new, added);
+        break;
+      case IF0:
+        EvalIfImmediate(arg(0), arg(1), arg(2), num_new, added);
+        break;
+      case FOLD:
+        fold_evaluator.Eval(arg(0), arg(1), *FoldBodyFromRef(args[2]), added);
+        break;
+      case ID:
+        std::copy(new_arguments.begin(), new_arguments.end(), added);
+        break;
+      default:
+        LOG(FATAL) << "Unexpected: " << OpTypeToString(type);
+    }
+  };
+
+  const std::function<bool(uint32_t)> no_stop = [](uint32_t) { return false; };
+  for (int size = 1; size <= bank->built_size; ++size) {
+    old_entries.num_plain[size] = old.num_plain(size);
+    old_entries.num_fold[size] = old.level(size).size() - old.num_plain(size);
+    if (size <= bank->built_size - 3)
+      old_entries.num_conditions[size] = old_composer.conditions()[size].size();
+    for (bool has_fold : { false, true }) {
+      for (uint32_t e : old.level(size)) {
+        if (old.has_fold(e) != has_fold) continue;
+        const uint64_t* v = old.values(e);
+        std::copy(v, v + old_width, value.begin());
+        const uint32_t old_args[3] = { old.arg(e, 0), old.arg(e, 1), old.arg(e, 2) };
+        OpType type = old.type(e);
+        if (type == CONSTANT) {
+          std::fill(added, added + num_new, v[0]);
+          std::copy(old_args, old_args + 3, args);
+        } else {
+          evaluate(type, old_args);
+        }
+        // The entries stay distinct with more outputs, and no new one has
+        // their signature at a smaller size, as its expression on the old
+        // arguments would have been there.
+        CHECK(table->Insert(value.data(), has_fold, size, type, args[0], args[1], args[2]));
+      }
+
+      CardinalSink sink(table.get(), size, has_fold, &deadline, NULL, &no_stop);
+      for (std::size_t i = 0; i < old.num_duplicates(size) && !sink.is_stopped(); ++i) {
+        SignatureTable::Duplicate duplicate = old.duplicate(size, i);
+        if (duplicate.has_fold != has_fold) continue;
+        evaluate(duplicate.type, duplicate.args);
+        const uint32_t of = entry(duplicate.entry);
+        const uint64_t* v = table->values(of);
+        if (std::equal(added, added + num_new, v + old_width)) {
+          table->AddDuplicate(size, duplicate.type, has_fold, of, args[0], args[1], args[2]);
+          continue;
+        }
+        std::copy(v, v + old_width, value.begin());
+        sink.Add(value.data(), duplicate.type, args[0], args[1], args[2]);
+      }
+      if (sink.is_stopped())
+        return false;
+
+      const CardinalStep first_step = has_fold ? FOLD_UNARY_STEP : UNARY_STEP;
+      const CardinalStep last_step = has_fold ? FOLD_STEP : IF0_STEP;
+      if (has_fold && !(bank->op_type_set & OpType::FOLD))
+        continue;
+      if (!has_fold && (bank->op_type_set & OpType::IF0))
+        composer.AddConditions(size - 3, &old_composer.conditions());
+      for (int step = first_step; step <= last_step; ++step) {
+        std::vector<CardinalTask> tasks =
+            composer.Tasks(static_cast<CardinalStep>(step), size, &old_entries);
+        std::size_t next_task = 0;
+        if (!ComposeCardinalLevel(table.get(), size, has_fold, num_threads, tasks, &next_task,
+                                  [&](const CardinalTask& task, CardinalSink* sink) {
+                                    composer.Compose(static_cast<CardinalStep>(step), task, sink);
+                                  },
+                                  deadline, NULL, no_stop))
+          return false;
+      }
+    }
+  }
+  LOG(INFO) << "Widened to " << table->size() << " entries";
+
+  bank->table = std::move(table);
+  bank->outcomes.reset();
+  bank->arguments = arguments;
+  bank->step = 0;
+  bank->next_task = 0;
+  return true;
+}
+
+// Makes |bank| hold the signatures on |arguments| for |max_size|,
+// |op_type_set| and |mode|, keeping what it has if all its arguments are
+// among them, and adding the others on |num_threads| threads. Sets |columns|
+// to the column of each of |arguments|. Returns false, with |bank| reset, if
+// |deadline| passed first.
+bool PrepareCardinalBank(CardinalBank* bank, const std::vector<uint64_t>& arguments,
+                         int max_size, int op_type_set, CardinalMode mode, int num_threads,
+                         const Deadline& deadline, std::vector<std::size_t>* columns) {
+  auto contains = [](const std::vector<uint64_t>& values, uint64_t value) {
+    return std::find(values.begin(), values.end(), value) != values.end();
+  };
+  bool reusable = bank->table && bank->op_type_set == op_type_set && bank->mode == mode &&
+      bank->table->max_size() == max_size;
+  for (std::size_t i = 0; reusable && i < bank->arguments.size(); ++i)
+    reusable = contains(arguments, bank->arguments[i]);
+  // A full bank has no room for more columns.
+  for (std::size_t i = 0; reusable && bank->full && i < arguments.size(); ++i)
+    reusable = contains(bank->arguments, arguments[i]);
+  if (!reusable)
+    bank->Reset();
+
+  std::vector<uint64_t> new_arguments;
+  for (uint64_t argument : arguments) {
+    if (!contains(bank->arguments, argument) && !contains(new_arguments, argument))
+      new_arguments.push_back(argument);
+  }
+  if (!bank->table) {
+    const std::size_t width = new_arguments.size();
+    bank->table.reset(new SignatureTable(width, max_size));
+    bank->arguments = new_arguments;
+    bank->op_type_set = op_type_set;
+    bank->mode = mode;
+    bank->built_size = 1;
+    std::vector<uint64_t> zeroes(width, 0), ones(width, 1);
+    bank->table->Insert(zeroes.data(), false, 1, OpType::CONSTANT);
+    bank->table->Insert(ones.data(), false, 1, OpType::CONSTANT);
+    // Assumes ID = X. It is kept as a duplicate if the arguments are all 0 or
+    // all 1, so that it splits off with others.
+    uint32_t entry;
+    if (!bank->table->Insert(bank->arguments.data(), false, 1, OpType::ID,
+                             SignatureTable::kNone, SignatureTable::kNone, SignatureTable::kNone,
+                             &entry))
+      bank->table->AddDuplicate(1, OpType::ID, false, entry, SignatureTable::kNone,
+                                SignatureTable::kNone, SignatureTable::kNone);
+  } else if (!new_arguments.empty()) {
+    LOG(INFO) << "Adding " << new_arguments.size() << " arguments to "
+              << bank->table->size() << " entries, built up to size " << bank->built_size;
+    // The expressions of |max_size| were only in the outcomes.
+    if (mode != SOLVE && bank->built_size >= max_size)
+      bank->built_size = max_size - 1;
+    if (!WidenCardinalBank(bank, new_arguments, num_threads, deadline)) {
+      LOG(INFO) << "Timed out adding the arguments";
+      bank->Reset();
+      return false;
+    }
+  }
+
+  columns->clear();
+  for (uint64_t argument : arguments) {
+    columns->push_back(std::find(bank->arguments.begin(), bank->arguments.end(), argument) -
+                       bank->arguments.begin());
+  }
+  return true;
+}
+
+// Looks for |goal| as (op a b) of an entry a of |size|, where b is the only
+// signature op takes to |goal| with a: g ^ a for xor and g - a for plus; and
+// as (not b) of an entry b of |size|, with b = ~g. So the expressions of up
+// to 2 * |size| + 1 are found without composing them. The shifts are not
+// inverted, as they have 2 preimages on each argument. The pairs which
+// ComposesSmaller() are skipped, e.g. (xor 0 g), as g is smaller. Returns
+// null if none is of up to |max_size|.
+std::shared_ptr<Expr> FindGoalByInverse(const SignatureTable& table,
+                                        const std::vector<uint64_t>& goal,
+                                        int size, int max_size, int op_type_set) {
+  const std::size_t width = table.width();
+  std::vector<uint64_t> partner(width);
+  // The entry of |partner| of up to |max_partner_size|, without fold if
+  // |with_fold| has it.
+  auto find_partner = [&](int max_partner_size, bool with_fold) {
+    uint32_t found = table.Find(partner.data(), false);
+    if (found != SignatureTable::kNone && SignatureTable::expr_size(found) <= max_partner_size)
+      return found;
+    if (with_fold)
+      return static_cast<uint32_t>(SignatureTable::kNone);
+    found = table.Find(partner.data(), true);
+    if (found != SignatureTable::kNone && SignatureTable::expr_size(found) <= max_partner_size)
+      return found;
+    return static_cast<uint32_t>(SignatureTable::kNone);
+  };
+
+  if ((op_type_set & OpType::NOT) && size < max_size) {
+    for (std::size_t i = 0; i < width; ++i)
+      partner[i] = ~goal[i];
+    uint32_t found = find_partner(size, false);
+    if (found != SignatureTable::kNone && SignatureTable::expr_size(found) == size &&
+        !ComposesSmaller(table, OpType::NOT, found)) {
+      LOG(INFO) << "Found as not of size " << size;
+      return UnaryOpExpr::Create(UnaryOpExpr::Type::NOT, MakeExpression(table, found));
+    }
+  }
+
+  const int max_partner_size = max_size - 1 - size;
+  if (max_partner_size < 1)
+    return std::shared_ptr<Expr>();
+  for (uint32_t e : table.level(size)) {
+    const uint64_t* v = table.values(e);
+    if (op_type_set & OpType::XOR) {
+      for (std::size_t i = 0; i < width; ++i)
+        partner[i] = goal[i] ^ v[i];
+      uint32_t found = find_partner(max_partner_size, table.has_fold(e));
+      if (found != SignatureTable::kNone && !ComposesSmaller(table, OpType::XOR, e, found)) {
+        LOG(INFO) << "Found as xor of size " << size << " and "
+                  << SignatureTable::expr_size(found);
+        return BinaryOpExpr::Create(BinaryOpExpr::Type::XOR, MakeExpression(table, e),
+                                    MakeExpression(table, found));
+      }
+    }
+    if (op_type_set & OpType::PLUS) {
+      for (std::size_t i = 0; i < width; ++i)
+        partner[i] = goal[i] - v[i];
+      uint32_t found = find_partner(max_partner_size, table.has_fold(e));
+      if (found != SignatureTable::kNone && !ComposesSmaller(table, OpType::PLUS, e, found)) {
+        LOG(INFO) << "Found as plus of size " << size << " and "
+                  << SignatureTable::expr_size(found);
+        return BinaryOpExpr::Create(BinaryOpExpr::Type::PLUS, MakeExpression(table, e),
+                                    MakeExpression(table, found));
+      }
+    }
+  }
+  return std::shared_ptr<Expr>();
+}
+
+// Looks for |goal| as (if0 c t e) of a condition c of |conditions| (one of
+// each zero-mask, by size; see CardinalComposer::conditions()), where t and
+// e match |goal| on the arguments where c is zero and non-zero respectively.
+// The entries are told apart by where they match |goal|, so each condition
+// is tried with the smallest entry of each of those, which are few. So an
+// if0 is found without composing it with all the pairs. Returns null if none
+// is of up to |max_size|, or if one is of less than |min_size|, which
+// composing the next size finds at its smallest.
+std::shared_ptr<Expr> FindGoalByIf0(const SignatureTable& table,
+                                    const std::vector<uint64_t>& goal,
+                                    const std::vector<std::vector<uint32_t> >& conditions,
+                                    int min_size, int max_size) {
+  const std::size_t width = table.width();
+  const std::size_t mask_width = (width + 63) / 64;
+  std::vector<uint64_t> valid(mask_width, ~0ULL), mask(mask_width);
+  if (width % 64)
+    valid.back() = (1ULL << (width % 64)) - 1;
+  // The smallest entry without fold of each set of arguments it matches
+  // |goal| on, by size.
+  SignatureTable matches(mask_width, max_size);
+  for (int size = 1; size <= max_size - 3; ++size) {
+    for (uint32_t e : table.level(size)) {
+      if (table.has_fold(e)) break;
+      const uint64_t* v = table.values(e);
+      std::fill(mask.begin(), mask.end(), 0);
+      for (std::size_t i = 0; i < width; ++i)
+        mask[i / 64] |= static_cast<uint64_t>(v[i] == goal[i]) << (i % 64);
+      matches.Insert(mask.data(), false, size, OpType::CONSTANT, e);
+    }
+  }
+  // The smallest entry of up to |max_entry_size| which matches |goal| where
+  // |zero_mask| is 0 (or 1 if |non_zero|), or kNone.
+  auto find_branch = [&](const uint64_t* zero_mask, bool non_zero, int max_entry_size) {
+    for (int size = 1; size <= max_entry_size; ++size) {
+      for (uint32_t m : matches.level(size)) {
+        const uint64_t* match = matches.values(m);
+        std::size_t k = 0;
+        while (k < mask_width &&
+               ((non_zero ? zero_mask[k] : ~zero_mask[k]) & valid[k] & ~match[k]) == 0)
+          ++k;
+        if (k == mask_width)
+          return matches.arg(m, 0);
+      }
+    }
+    return static_cast<uint32_t>(SignatureTable::kNone);
+  };
+
+  for (int size = 1; size <= max_size - 3 && size < static_cast<int>(conditions.size()); ++size) {
+    for (uint32_t c : conditions[size]) {
+      PackConditionOutcomes(CONDITION, table.values(c), width, mask.data());
+      uint32_t then_found = find_branch(mask.data(), false, max_size - 2 - size);
+      if (then_found == SignatureTable::kNone)
+        continue;
+      const int then_size = SignatureTable::expr_size(then_found);
+      uint32_t else_found = find_branch(mask.data(), true, max_size - 1 - size - then_size);
+      if (else_found == SignatureTable::kNone)
+        continue;
+      if (1 + size + then_size + SignatureTable::expr_size(else_found) < min_size)
+        return std::shared_ptr<Expr>();
+      LOG(INFO) << "Found as if0 of size " << size << ", " << then_size << " and "
+                << SignatureTable::expr_size(else_found);
+      return If0Expr::Create(MakeExpression(table, c), MakeExpression(table, then_found),
+                             MakeExpression(table, else_found));
+    }
+  }
+  return std::shared_ptr<Expr>();
+}
+
+// Looks for an expression of up to |max_size| which takes |arguments| to
+// |expecteds| (or has their outcomes, in the condition modes), keeping the
+// table in |bank| for the requests to come. Composes on |num_threads|
+// threads, and only looks up the goal once |bank| takes |max_memory_bytes|.
+// Returns null if none is found before |deadline|.
+// TODO: The argument to be a vector to pass multiple arguments.
+std::shared_ptr<Expr> Cardinal(CardinalBank* bank,
+                               const std::vector<uint64_t>& arguments,
+                               const std::vector<uint64_t>& expecteds,
+                               int max_size, int op_type_set,
+                               CardinalMode mode,
+                               const Deadline& deadline, std::size_t max_memory_bytes,
+                               int num_threads) {
+  // [output when |x0| is given, output when |x1| is given, ...] and has_fold
+  // => backtrack, with the minimum size.
+  std::vector<std::size_t> columns;
+  if (!PrepareCardinalBank(bank, arguments, max_size, op_type_set, mode, num_threads, deadline,
+                           &columns))
+    return std::shared_ptr<Expr>();
+  SignatureTable& table = *bank->table;
+  const std::size_t width = table.width();
+  // |expecteds| on the columns of |table|.
+  std::vector<uint64_t> goal(width);
+  for (std::size_t i = 0; i < columns.size(); ++i)
+    goal[columns[i]] = expecteds[i];
+
+  // In the condition modes, the outcomes of |goal|, and the entries found
+  // are those of bank->outcomes.
+  const std::size_t outcome_width = (width + 63) / 64;
+  std::vector<uint64_t> goal_outcomes(outcome_width), outcomes(outcome_width);
+  // Adds the outcomes of the entry |e| of |table| to bank->outcomes, and
+  // returns the entry added, or kNone if they are there.
+  auto add_outcomes = [&](uint32_t e) -> uint32_t {
+    PackConditionOutcomes(mode, table.values(e), width, outcomes.data());
+    int size = SignatureTable::expr_size(e);
+    if (!bank->outcomes->Insert(outcomes.data(), false, size, table.type(e),
+                                table.arg(e, 0), table.arg(e, 1), table.arg(e, 2)))
+      return SignatureTable::kNone;
+    return SignatureTable::Ref(size, bank->outcomes->level(size).size() - 1);
+  };
+  if (mode != SOLVE) {
+    PackConditionOutcomes(mode, goal.data(), width, goal_outcomes.data());
+    if (!bank->outcomes) {
+      bank->outcomes.reset(new SignatureTable(outcome_width, max_size));
+      for (int size = 2; size <= max_size; ++size) {
+        for (uint32_t e : table.level(size))
+          add_outcomes(e);
+      }
+    }
+  }
+  auto make_expression = [&](uint32_t e) {
+    return mode == SOLVE ? MakeExpression(table, e) : MakeExpression(*bank->outcomes, e, table);
+  };
+
+  CardinalComposer composer(table, bank->arguments, op_type_set);
+  // Looks for the goal as if0 of what is in |table| so far.
+  auto find_goal_by_if0 = [&]() {
+    if (mode != SOLVE || !(op_type_set & OpType::IF0))
+      return std::shared_ptr<Expr>();
+    composer.AddConditions(std::min(bank->built_size, max_size - 3));
+    return FindGoalByIf0(table, goal, composer.conditions(), bank->built_size + 2, max_size);
+  };
+
+  auto find_goal = [&](int size) -> uint32_t {
+    if (mode == CONDITION || mode == BONUS_CONDITION) {
+      uint32_t found = bank->outcomes->Find(goal_outcomes.data(), false);
+      if (found != SignatureTable::kNone && SignatureTable::expr_size(found) == size)
+        return found;
+      return SignatureTable::kNone;
+    }
+
+    uint32_t found = table.Find(goal.data(), false);
+    if (found == SignatureTable::kNone || SignatureTable::expr_size(found) != size)
+      found = table.Find(goal.data(), true);
+    if (found != SignatureTable::kNone && SignatureTable::expr_size(found) == size)
+      return found;
+    return SignatureTable::kNone;
+  };
+  // The goal is looked up in the size left partly composed too, before the
+  // lookups which may find a larger expression. Those of size 1 (0, 1 and x)
+  // are never composed again, so they are only found here.
+  for (int size = 1; size <= bank->built_size + 1; ++size) {
+    uint32_t found = find_goal(size);
+    if (found != SignatureTable::kNone)
+      return make_expression(found);
+  }
+  for (int size = 1; mode == SOLVE && size <= bank->built_size; ++size) {
+    std::shared_ptr<Expr> expr = FindGoalByInverse(table, goal, size, max_size, op_type_set);
+    if (expr)
+      return expr;
+  }
+  std::shared_ptr<Expr> if0_expr = find_goal_by_if0();
+  if (if0_expr)
+    return if0_expr;
+  // Looks up the goal in the part of |size| composed.
+  auto look_up_partial = [&](int size) {
+    uint32_t found = find_goal(size);
+    if (found != SignatureTable::kNone)
+      return make_expression(found);
+    if (mode != SOLVE)
+      return std::shared_ptr<Expr>();
+    std::shared_ptr<Expr> expr = FindGoalByInverse(table, goal, size, max_size, op_type_set);
+    return expr ? expr : find_goal_by_if0();
+  };
+  if (bank->full) {
+    LOG(INFO) << "The table is full; looking up the goal only";
+    return look_up_partial(bank->built_size + 1);
+  }
+
+  // The table the size composed takes its entries: bank->outcomes for
+  // |max_size| in the condition modes, as packed by |pack|.
+  SignatureTable* level_table = &table;
+  const CardinalSink::Pack pack = [&](const uint64_t* values, uint64_t* signature) {
+    PackConditionOutcomes(mode, values, width, signature);
+  };
+  // Stops composing at the first entry added which matches the goal. The
+  // smaller sizes have no match, so it is of the minimum size. The size is
+  // left partly composed, with bank->step and bank->next_task at the task
+  // stopped in: the next request on the same arguments composes the rest of
+  // it from that task, and one with new arguments drops it (see
+  // WidenCardinalBank()), as the new columns split its entries.
+  uint32_t found = SignatureTable::kNone;
+  std::function<bool(uint32_t)> stop = [&](uint32_t e) {
+    if (mode == SOLVE) {
+      if (memcmp(table.values(e), goal.data(), width * sizeof(uint64_t)) == 0)
+        found = e;
+    } else {
+      if (level_table == &table)
+        e = add_outcomes(e);
+      if (e != SignatureTable::kNone &&
+          memcmp(bank->outcomes->values(e), goal_outcomes.data(),
+                 outcome_width * sizeof(uint64_t)) == 0)
+        found = e;
+    }
+    if (found != SignatureTable::kNone)
+      return true;
+    if ((level_table->size() & 0x3FFF) == 0 && bank->memory_bytes() > max_memory_bytes) {
+      bank->full = true;
+      return true;
+    }
+    return false;
+  };
+  auto stopped = [&](int size) {
+    if (found != SignatureTable::kNone)
+      return make_expression(found);
+    if (!bank->full)
+      return std::shared_ptr<Expr>();
+    LOG(WARNING) << "Reached --memory_budget_mb at size " << size << " with " << table.size()
+                 << " entries, " << bank->memory_bytes() << " bytes; looking up the goal only";
+    return look_up_partial(size);
+  };
+  static const char* const kStepNames[] = {
+    "Unary", "Binary", "If0", "Fold Unary", "Fold Binary", "Fold",
+  };
+  // Runs a step of composing a size, or skips it if done before a timeout.
+  // The tasks of a step depend only on the smaller sizes, so they are the
+  // same on the retry; a task partly added is composed again, and the table
+  // drops what it has.
+  auto run_step = [&](int size, CardinalStep step) {
+    if (step < bank->step)
+      return true;
+    if (step > bank->step)
+      bank->next_task = 0;
+    bank->step = step;
+    composer.Shuffle(step);
+    std::vector<CardinalTask> tasks = composer.Tasks(step, size);
+    if (!ComposeCardinalLevel(level_table, size, step >= FOLD_UNARY_STEP,
+                              num_threads, tasks, &bank->next_task,
+                              [&](const CardinalTask& task, CardinalSink* sink) {
+                                composer.Compose(step, task, sink);
+                              },
+                              deadline, level_table == &table ? NULL : &pack, stop,
+                              &bank->sink_bytes)) {
+      if (found == SignatureTable::kNone && !bank->full) {
+        LOG(INFO) << "Timed out at step " << step << " task " << bank->next_task << " of "
+                  << tasks.size() << " for size " << size;
+      }
+      return false;
+    }
+    return true;
+  };
+  const int last_step = (op_type_set & OpType::FOLD) ? FOLD_STEP : IF0_STEP;
+  for (int size = bank->built_size + 1; size <= max_size; ++size) {
+    LOG(INFO) << "Size = " << size;
+    if (mode != SOLVE && size == max_size)
+      level_table = bank->outcomes.get();
+
+    for (int step = UNARY_STEP; step <= last_step; ++step) {
+      if (!run_step(size, static_cast<CardinalStep>(step))) {
+        return stopped(size);
+      }
+      LOG(INFO) << "  Dict[" << size << "] = " << level_table->level(size).size() << " : "
+                << kStepNames[step] << " done";
+    }
+    bank->built_size = size;
+    bank->step = 0;
+    bank->next_task = 0;
+    LOG(INFO) << "  Table = " << table.size() << " entries, "
+              << table.memory_bytes() / table.size() << " bytes/entry";
+
+    // The entries added before a timeout are not checked on the way.
+    found = find_goal(size);
+    if (found != SignatureTable::kNone)
+      return make_expression(found);
+    if (mode == SOLVE) {
+      std::shared_ptr<Expr> expr = FindGoalByInverse(table, goal, size, max_size, op_type_set);
+      if (!expr)
+        expr = find_goal_by_if0();
+      if (expr)
+        return expr;
+    }
+  }
+
+  return std::shared_ptr<Expr>();
+}
+
+}  // namespace icfpc
+
+#endif  // ICFPC_CARDINAL_SEARCH_H_
@@ -30,10 +30,28 @@ std::vector<uint64_t> CreateKey() {
   return keys;
 }
 
-// Classify by key.
-std::map<std::vector<uint64_t>, std::vector<std::shared_ptr<Expr> > >
-CreateCluster(const std::vector<uint64_t>& input,
-              const std::vector<std::shared_ptr<Expr> >& expr_list) {
+// Returns a hash of the outputs of |expr| on |input|. Expressions using y or
+// z (i.e. fold bodies) are evaluated with y and z taken from rotated |input|,
+// so that bodies computing different functions get different signatures.
+// Expressions with and without fold, or with and without y/z, never share a
+// signature since they can not replace each other in all contexts.
+uint64_t HashSignature(const std::vector<uint64_t>& input, const Expr& expr) {
+  std::vector<uint64_t> outputs(input.size());
+  Env env;
+  for (size_t i = 0; i < input.size(); ++i) {
+    env.x = input[i];
+    env.y = input[(i + input.size() / 3) % input.size()] & 0xFF;
+    env.z = input[(i + input.size() * 2 / 3) % input.size()];
+    outputs[i] = expr.Eval(env);
+  }
+  uint64_t kind = (expr.has_fold() ? 1 : 0) | (expr.in_fold() ? 2 : 0);
+  return HashKey(outputs) ^ (kind * 0x9E3779B97F4A7C15ULL);
+}
+
+// Classifies |expr_list| by key and adds them to |cluster|.
+void AddToCluster(const std::vector<uint64_t>& input,
+                  const std::vector<std::shared_ptr<Expr> >& expr_list,
+                  std::map<std::vector<uint64_t>, std::vector<std::shared_ptr<Expr> > >* cluster) {
   std::vector<std::vector<uint64_t> > keys(expr_list.size(), std::vector<uint64_t>(input.size()));
   for (size_t i = 0; i < input.size(); ++i) {
     uint64_t x = input[i];
@@ -44,9 +62,16 @@ CreateCluster(const std::vector<uint64_t>& input,
     }
   }
 
-  std::map<std::vector<uint64_t>, std::vector<std::shared_ptr<Expr> > > result;
   for (size_t k = 0; k < expr_list.size(); ++k)
-    result[keys[k]].push_back(expr_list[k]);
+    (*cluster)[keys[k]].push_back(expr_list[k]);
+}
+
+// Classify by key.
+std::map<std::vector<uint64_t>, std::vector<std::shared_ptr<Expr> > >
+CreateCluster(const std::vector<uint64_t>& input,
+              const std::vector<std::shared_ptr<Expr> >& expr_list) {
+  std::map<std::vector<uint64_t>, std::vector<std::shared_ptr<Expr> > > result;
+  AddToCluster(input, expr_list, &result);
   return result;
 }
 
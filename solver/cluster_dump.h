@@ -0,0 +1,389 @@
+#ifndef ICFPC_CLUSTER_DUMP_H_
+#define ICFPC_CLUSTER_DUMP_H_
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "expr.h"
+
+namespace icfpc {
+
+// Binary dump of the clusters (--format=binary of cluster_main and
+// simplify_main), to be memory-mapped by the readers instead of parsing the
+// "argument:"/"expected:" text. All the numbers are uint64 in the host
+// (little-endian) byte order, so every section is 8-byte aligned:
+//
+//   "icfpcls1", num_clusters, num_programs
+//   argument[256]
+//   signature[num_clusters][256]     the expected outputs, in ascending order
+//   cluster_begin[num_clusters + 1]  index of the first program of a cluster
+//   program_begin[num_programs + 1]  byte offset of a program in the code
+//   code                             the programs, one byte per node in
+//                                    prefix order (see ClusterDumpCode)
+//
+// The reader for the frontends is util/cluster_dump.py.
+//
+// The signatures are 2 KB of mostly random outputs per cluster, and take
+// almost all of the dump, so it is only about half the size of the text
+// (49 MB against 106 MB for simplify_main --size=11, 23525 clusters). The
+// gain is in the readers, which skip the parsing: looking up one cluster
+// takes 14 ms against 1.9 s, and listing all the signatures 0.6 s against
+// 2.1 s.
+enum ClusterDumpCode {
+  // 0 .. 10: the operators, i.e. the bit index of NOT .. FOLD in OpType.
+  DUMP_LAMBDA = 12,
+  DUMP_ZERO = 13,
+  DUMP_ONE = 14,
+  DUMP_X = 15,
+  DUMP_Y = 16,
+  DUMP_Z = 17,
+  DUMP_CONSTANT = 18,  // followed by the 8-byte value
+};
+
+const char kClusterDumpMagic[] = "icfpcls1";
+const std::size_t kClusterDumpSignatureSize = 256;
+
+void EncodeDumpExpr(const Expr& e, std::string* code) {
+  switch (e.op_type()) {
+    case OpType::LAMBDA:
+      code->push_back(DUMP_LAMBDA);
+      EncodeDumpExpr(*static_cast<const LambdaExpr&>(e).body(), code);
+      return;
+    case OpType::CONSTANT: {
+      uint64_t value = static_cast<const ConstantExpr&>(e).value();
+      if (value <= 1) {
+        code->push_back(value ? DUMP_ONE : DUMP_ZERO);
+      } else {
+        code->push_back(DUMP_CONSTANT);
+        code->append(reinterpret_cast<const char*>(&value), sizeof(value));
+      }
+      return;
+    }
+    case OpType::ID:
+      switch (static_cast<const IdExpr&>(e).name()) {
+        case IdExpr::Name::X: code->push_back(DUMP_X); break;
+        case IdExpr::Name::Y: code->push_back(DUMP_Y); break;
+        case IdExpr::Name::Z: code->push_back(DUMP_Z); break;
+      }
+      return;
+    case OpType::IF0: {
+      auto& i0 = static_cast<const If0Expr&>(e);
+      code->push_back(__builtin_ctz(OpType::IF0));
+      EncodeDumpExpr(*i0.cond(), code);
+      EncodeDumpExpr(*i0.then_body(), code);
+      EncodeDumpExpr(*i0.else_body(), code);
+      return;
+    }
+    case OpType::FOLD:
+    case OpType::TFOLD: {
+      // TFOLD is output as a plain fold, so it is dumped as one too.
+      auto& fold = static_cast<const FoldExpr&>(e);
+      code->push_back(__builtin_ctz(OpType::FOLD));
+      EncodeDumpExpr(*fold.value(), code);
+      EncodeDumpExpr(*fold.init_value(), code);
+      EncodeDumpExpr(*fold.body(), code);
+      return;
+    }
+    case OpType::AND:
+    case OpType::OR:
+    case OpType::XOR:
+    case OpType::PLUS: {
+      auto& binary = static_cast<const BinaryOpExpr&>(e);
+      code->push_back(__builtin_ctz(e.op_type()));
+      EncodeDumpExpr(*binary.arg1(), code);
+      EncodeDumpExpr(*binary.arg2(), code);
+      return;
+    }
+    default:
+      code->push_back(__builtin_ctz(e.op_type()));
+      EncodeDumpExpr(*static_cast<const UnaryOpExpr&>(e).arg(), code);
+      return;
+  }
+}
+
+// Decodes the expression at |*p|, and advances |*p| past it. Returns null if
+// the code is broken.
+std::shared_ptr<Expr> DecodeDumpExpr(const uint8_t** p, const uint8_t* end) {
+  if (*p >= end)
+    return std::shared_ptr<Expr>();
+  int code = *(*p)++;
+  switch (code) {
+    case DUMP_ZERO: return ConstantExpr::CreateZero();
+    case DUMP_ONE: return ConstantExpr::CreateOne();
+    case DUMP_X: return IdExpr::CreateX();
+    case DUMP_Y: return IdExpr::CreateY();
+    case DUMP_Z: return IdExpr::CreateZ();
+    case DUMP_CONSTANT: {
+      uint64_t value;
+      if (end - *p < static_cast<std::ptrdiff_t>(sizeof(value)))
+        return std::shared_ptr<Expr>();
+      memcpy(&value, *p, sizeof(value));
+      *p += sizeof(value);
+      return ConstantExpr::Create(value);
+    }
+  }
+
+  int arity = (code == DUMP_LAMBDA) ? 1 :
+      (code > __builtin_ctz(OpType::FOLD)) ? 0 :
+      (1 << code) & (OpType::IF0 | OpType::FOLD) ? 3 :
+      (1 << code) & (OpType::AND | OpType::OR | OpType::XOR | OpType::PLUS) ? 2 :
+      (1 << code) & (OpType::NOT | OpType::SHL1 | OpType::SHR1 | OpType::SHR4 | OpType::SHR16) ? 1 : 0;
+  if (arity == 0)
+    return std::shared_ptr<Expr>();
+  std::shared_ptr<Expr> args[3];
+  for (int i = 0; i < arity; ++i)
+    if (!(args[i] = DecodeDumpExpr(p, end)))
+      return std::shared_ptr<Expr>();
+
+  switch (code) {
+    case DUMP_LAMBDA: return LambdaExpr::Create(args[0]);
+    case 0: return UnaryOpExpr::Create(UnaryOpExpr::Type::NOT, args[0]);
+    case 1: return UnaryOpExpr::Create(UnaryOpExpr::Type::SHL1, args[0]);
+    case 2: return UnaryOpExpr::Create(UnaryOpExpr::Type::SHR1, args[0]);
+    case 3: return UnaryOpExpr::Create(UnaryOpExpr::Type::SHR4, args[0]);
+    case 4: return UnaryOpExpr::Create(UnaryOpExpr::Type::SHR16, args[0]);
+    case 5: return BinaryOpExpr::Create(BinaryOpExpr::Type::AND, args[0], args[1]);
+    case 6: return BinaryOpExpr::Create(BinaryOpExpr::Type::OR, args[0], args[1]);
+    case 7: return BinaryOpExpr::Create(BinaryOpExpr::Type::XOR, args[0], args[1]);
+    case 8: return BinaryOpExpr::Create(BinaryOpExpr::Type::PLUS, args[0], args[1]);
+    case 9: return If0Expr::Create(args[0], args[1], args[2]);
+    default: return FoldExpr::Create(args[0], args[1], args[2]);
+  }
+}
+
+// Writes a dump cluster by cluster, in ascending order of signatures. The
+// signatures, the program offsets and the code precede one another in the
+// dump, so each is spooled to a temporary file until Finish(), and only the
+// cluster offsets are kept in memory (8 bytes per cluster, against the 2 KB
+// of its signature).
+class ClusterDumpWriter {
+ public:
+  // Spools to unnamed files in |spool_dir|, or in the default temporary dir
+  // if empty.
+  explicit ClusterDumpWriter(const std::string& spool_dir = "")
+      : signatures_(OpenSpool(spool_dir)), program_begin_(OpenSpool(spool_dir)),
+        code_(OpenSpool(spool_dir)), num_clusters_(0), num_programs_(0), code_size_(0),
+        cluster_begin_(1, 0) {
+    const uint64_t zero = 0;
+    if (program_begin_)
+      fwrite(&zero, sizeof(zero), 1, program_begin_);
+  }
+
+  ~ClusterDumpWriter() {
+    for (FILE* fp : { signatures_, program_begin_, code_ }) {
+      if (fp)
+        fclose(fp);
+    }
+  }
+
+  void Add(const std::vector<uint64_t>& signature,
+           const std::vector<std::shared_ptr<Expr> >& programs) {
+    if (!signatures_ || !program_begin_ || !code_)
+      return;
+    fwrite(signature.data(), sizeof(uint64_t), signature.size(), signatures_);
+    ++num_clusters_;
+    std::string code;
+    for (const std::shared_ptr<Expr>& e : programs) {
+      code.clear();
+      EncodeDumpExpr(*e, &code);
+      fwrite(code.data(), 1, code.size(), code_);
+      code_size_ += code.size();
+      fwrite(&code_size_, sizeof(code_size_), 1, program_begin_);
+    }
+    num_programs_ += programs.size();
+    cluster_begin_.push_back(num_programs_);
+  }
+
+  // Writes the dump with |argument| to |fp|. Returns false on an I/O error.
+  bool Finish(FILE* fp, const std::vector<uint64_t>& argument) {
+    for (FILE* spool : { signatures_, program_begin_, code_ }) {
+      if (!spool || fflush(spool) != 0 || ferror(spool))
+        return false;
+    }
+    uint64_t header[2] = { num_clusters_, num_programs_ };
+    fwrite(kClusterDumpMagic, 1, 8, fp);
+    fwrite(header, sizeof(uint64_t), 2, fp);
+    fwrite(argument.data(), sizeof(uint64_t), argument.size(), fp);
+    CopySpool(signatures_, fp);
+    fwrite(cluster_begin_.data(), sizeof(uint64_t), cluster_begin_.size(), fp);
+    CopySpool(program_begin_, fp);
+    CopySpool(code_, fp);
+    return !ferror(signatures_) && !ferror(program_begin_) && !ferror(code_) &&
+        fflush(fp) == 0 && !ferror(fp);
+  }
+
+ private:
+  static FILE* OpenSpool(const std::string& dir) {
+    if (dir.empty())
+      return tmpfile();
+    std::string path = dir + "/dump-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0)
+      return NULL;
+    unlink(path.c_str());
+    FILE* fp = fdopen(fd, "w+b");
+    if (!fp)
+      close(fd);
+    return fp;
+  }
+
+  static void CopySpool(FILE* spool, FILE* fp) {
+    rewind(spool);
+    char buffer[1 << 16];
+    std::size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), spool)) > 0)
+      fwrite(buffer, 1, size, fp);
+  }
+
+  FILE* signatures_;
+  FILE* program_begin_;  // the end of each program in |code_|, after a 0
+  FILE* code_;
+  uint64_t num_clusters_;
+  uint64_t num_programs_;
+  uint64_t code_size_;
+  std::vector<uint64_t> cluster_begin_;
+
+  DISALLOW_COPY_AND_ASSIGN(ClusterDumpWriter);
+};
+
+// Writes |argument| and |cluster| to |fp|. Returns false on an I/O error.
+bool WriteClusterDump(
+    FILE* fp, const std::vector<uint64_t>& argument,
+    const std::map<std::vector<uint64_t>, std::vector<std::shared_ptr<Expr> > >& cluster) {
+  ClusterDumpWriter writer;
+  for (auto iter = cluster.cbegin(); iter != cluster.cend(); ++iter)
+    writer.Add(iter->first, iter->second);
+  return writer.Finish(fp, argument);
+}
+
+// Read-only view of a memory-mapped cluster dump.
+class ClusterDump {
+ public:
+  ClusterDump() : data_(nullptr), size_(0), num_clusters_(0), num_programs_(0) {
+  }
+
+  ~ClusterDump() {
+    Close();
+  }
+
+  // Maps the dump at |path|. Returns false if it is missing or broken.
+  bool Open(const std::string& path) {
+    Close();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = static_cast<const uint8_t*>(data);
+        size_ = st.st_size;
+      }
+    }
+    close(fd);
+    if (!data_ || !Validate()) {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  void Close() {
+    if (data_)
+      munmap(const_cast<uint8_t*>(data_), size_);
+    data_ = nullptr;
+    size_ = 0;
+    num_clusters_ = num_programs_ = 0;
+  }
+
+  std::size_t num_clusters() const { return num_clusters_; }
+  std::size_t num_programs() const { return num_programs_; }
+
+  // The arrays of kClusterDumpSignatureSize values.
+  const uint64_t* argument() const { return words() + 3; }
+  const uint64_t* signature(std::size_t i) const {
+    return argument() + (i + 1) * kClusterDumpSignatureSize;
+  }
+
+  std::size_t cluster_size(std::size_t i) const {
+    return cluster_begin()[i + 1] - cluster_begin()[i];
+  }
+
+  // Returns the |k|-th program of the |i|-th cluster.
+  std::shared_ptr<Expr> program(std::size_t i, std::size_t k) const {
+    std::size_t index = cluster_begin()[i] + k;
+    const uint8_t* p = code() + program_begin()[index];
+    return DecodeDumpExpr(&p, code() + program_begin()[index + 1]);
+  }
+
+  // Returns the index of the cluster whose signature is |outputs|, or
+  // num_clusters() if there is none.
+  std::size_t Find(const std::vector<uint64_t>& outputs) const {
+    if (outputs.size() != kClusterDumpSignatureSize)
+      return num_clusters_;
+    std::size_t lo = 0, hi = num_clusters_;
+    while (lo < hi) {
+      std::size_t mid = (lo + hi) / 2;
+      const uint64_t* s = signature(mid);
+      if (std::lexicographical_compare(s, s + kClusterDumpSignatureSize,
+                                       outputs.begin(), outputs.end()))
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo < num_clusters_ && std::equal(outputs.begin(), outputs.end(), signature(lo)))
+      return lo;
+    return num_clusters_;
+  }
+
+ private:
+  const uint64_t* words() const { return reinterpret_cast<const uint64_t*>(data_); }
+  const uint64_t* cluster_begin() const {
+    return signature(num_clusters_);
+  }
+  const uint64_t* program_begin() const {
+    return cluster_begin() + num_clusters_ + 1;
+  }
+  const uint8_t* code() const {
+    return reinterpret_cast<const uint8_t*>(program_begin() + num_programs_ + 1);
+  }
+
+  bool Validate() {
+    const std::size_t kWords = 3 + kClusterDumpSignatureSize;
+    if (size_ < kWords * sizeof(uint64_t) || memcmp(data_, kClusterDumpMagic, 8) != 0)
+      return false;
+    num_clusters_ = words()[1];
+    num_programs_ = words()[2];
+    std::size_t num_words = kWords + num_clusters_ * kClusterDumpSignatureSize +
+        num_clusters_ + 1 + num_programs_ + 1;
+    if (num_clusters_ > size_ / sizeof(uint64_t) || num_programs_ > size_ / sizeof(uint64_t) ||
+        size_ < num_words * sizeof(uint64_t))
+      return false;
+    std::size_t code_size = size_ - num_words * sizeof(uint64_t);
+    return cluster_begin()[num_clusters_] == num_programs_ &&
+        program_begin()[num_programs_] == code_size;
+  }
+
+  const uint8_t* data_;
+  std::size_t size_;
+  std::size_t num_clusters_;
+  std::size_t num_programs_;
+
+  DISALLOW_COPY_AND_ASSIGN(ClusterDump);
+};
+
+}  // namespace icfpc
+
+#endif  // ICFPC_CLUSTER_DUMP_H_
@@ -4,11 +4,16 @@
 #include "expr.h"
 #include "expr_list.h"
 #include "cluster.h"
+#include "cluster_dump.h"
+#include "util.h"
 
 using namespace icfpc;
 
 DEFINE_int32(size, -1, "Size of the expression");
 DEFINE_string(operators, "", "List of the operators");
+DEFINE_int32(threads, 1, "Number of threads to enumerate expressions");
+DEFINE_int32(chunk_size, 1 << 16, "Number of programs evaluated at once");
+DEFINE_string(format, "text", "{text,binary}: format of the clusters output (see cluster_dump.h)");
 
 int main(int argc, char* argv[]) {
   google::InstallFailureSignalHandler();
@@ -18,29 +23,48 @@ int main(int argc, char* argv[]) {
 
   CHECK(FLAGS_size >= 3) << "--size should be specified";
   CHECK(!FLAGS_operators.empty()) << "--operators should be specified";
+  CHECK(FLAGS_format == "text" || FLAGS_format == "binary") << "--format should be text or binary";
 
   int op_type_set = ParseOpTypeSet(FLAGS_operators);
 
-  std::vector<std::shared_ptr<Expr> > result = ListExpr(FLAGS_size, op_type_set, NO_SIMPLIFY);
+  // Cluster the programs chunk by chunk as they are generated, so that neither
+  // the whole program list nor all of their keys have to be held at once.
   std::vector<uint64_t> key = CreateKey();
-  std::map<std::vector<uint64_t>, std::vector<std::shared_ptr<Expr> > > cluster =
-      CreateCluster(key, result);
-
-  std::cout << "argument: ";
-  PrintCollection(&std::cout, key, ",");
-  std::cout << "\n";
-
-  int i = 0;
-  for (auto iter = cluster.cbegin(); iter != cluster.cend(); ++iter) {
-    LOG(INFO) << "Output Cluster " << i++ << ": " << iter->second.size();
-    std::cout << "expected: ";
-    PrintCollection(&std::cout, iter->first, ",");
+  std::map<std::vector<uint64_t>, std::vector<std::shared_ptr<Expr> > > cluster;
+  std::vector<std::shared_ptr<Expr> > chunk;
+  chunk.reserve(FLAGS_chunk_size);
+  ForEachExpr(FLAGS_size, op_type_set, NO_SIMPLIFY,
+              [&](const std::shared_ptr<Expr>& e) {
+                chunk.push_back(e);
+                if (chunk.size() >= static_cast<std::size_t>(FLAGS_chunk_size)) {
+                  AddToCluster(key, chunk, &cluster);
+                  chunk.clear();
+                }
+              },
+              FLAGS_threads);
+  AddToCluster(key, chunk, &cluster);
+  chunk.clear();
+
+  if (FLAGS_format == "binary") {
+    CHECK(WriteClusterDump(stdout, key, cluster)) << "Failed to write the clusters";
+  } else {
+    std::cout << "argument: ";
+    PrintCollection(&std::cout, key, ",");
     std::cout << "\n";
 
-    for (const std::shared_ptr<Expr>& e : iter->second) {
-      std::cout << *e << "\n";
+    int i = 0;
+    for (auto iter = cluster.cbegin(); iter != cluster.cend(); ++iter) {
+      LOG(INFO) << "Output Cluster " << i++ << ": " << iter->second.size();
+      std::cout << "expected: ";
+      PrintCollection(&std::cout, iter->first, ",");
+      std::cout << "\n";
+
+      for (const std::shared_ptr<Expr>& e : iter->second) {
+        std::cout << *e << "\n";
+      }
     }
   }
 
+  LOG(INFO) << "Peak RSS: " << GetPeakRssKb() << " KB";
   return 0;
 }
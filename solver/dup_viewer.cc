@@ -10,6 +10,7 @@ using namespace icfpc;
 
 DEFINE_int32(size, -1, "Size of the expression");
 DEFINE_string(operators, "", "List of the operators");
+DEFINE_int32(threads, 1, "Number of threads to enumerate expressions");
 DEFINE_string(simplify, "global", "{no,each,global}");
 
 int main(int argc, char* argv[]) {
@@ -27,7 +28,7 @@ int main(int argc, char* argv[]) {
      FLAGS_simplify=="global" ? GLOBAL_SIMPLIFY :
        FLAGS_simplify=="each" ? SIMPLIFY_EACH_STEP : NO_SIMPLIFY;
 
-  std::vector<std::shared_ptr<Expr> > result = ListExpr(FLAGS_size, op_type_set, simp_mode);
+  std::vector<std::shared_ptr<Expr> > result = ListExpr(FLAGS_size, op_type_set, simp_mode, FLAGS_threads);
   if (simp_mode == NO_SIMPLIFY)
     result = SimplifyExprList(result);
   LOG(INFO) << "SIZE[FIN] " <<  result.size();
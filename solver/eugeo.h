@@ -6,12 +6,15 @@
 // ListFoldBody(max_size = default-is-9):
 //     Returns |table|, where table[s] is vector<shared_ptr<Expr>> of size |s| bodies.
 //     E.g., table[3] = {(or y z), (and y z), ...}
+//     Only the smallest body of each simplified form is listed.
 //
 // EvalFoldBody(e, x, value, init):
 //     Evaluates e with the given arguments.
 //
 
 #include <algorithm>
+#include <set>
+#include <string>
 #include <vector>
 #include "expr.h"
 #include "simplify.h"
@@ -65,26 +68,34 @@ std::vector<std::shared_ptr<Expr> > ListExprInternal(
 std::vector<std::vector<std::shared_ptr<Expr> > > PreComputeTable(std::size_t depth) {
   std::vector<std::vector<std::shared_ptr<Expr> > > table(1);
   std::vector<std::vector<std::shared_ptr<Expr> > > filtered_table(1);
+  // Whether a body has y and z, and its simplified form.
   std::set<std::string> already_known;
 
   for (size_t d = 1; d <= depth; ++d) {
     auto es = ListExprInternal(table, d);
 
+    // Keeps the first (i.e. the smallest) body of each simplified form, so
+    // that the larger ones are not composed nor tried in every fold. Those
+    // with other variables are kept apart, so that a body the filter below
+    // drops never hides one it passes.
     table.emplace_back();
-    for (auto& e: es)
-      if (already_known.insert(Simplify(e)->ToString()).second)
+    for (auto& e: es) {
+      std::string key = std::string(e->has_y() ? "y" : "-") + (e->has_z() ? "z" : "-") +
+          Simplify(e)->ToString();
+      if (already_known.insert(key).second)
         table.back().push_back(e);
+    }
 
     filtered_table.emplace_back();
-    for (auto& e: es) {
+    for (auto& e: table.back()) {
       if (!e->has_x() && !e->has_y() && !e->has_z()) continue;  // Constant is always useless.
       if (!e->has_y()) continue;  // No y may useless: BODY[z/INIT] has same effect w/o fold.
       if (!e->has_z()) continue;  // No z may be: BODY[y/(VALUE>>16>>16>>16>>4>>4)]
       filtered_table.back().push_back(e);
     }
 
-    LOG(INFO) << "[SIZE " << d << "] done. " << table.back().size() << " => " <<
-        filtered_table.back().size() << " exprs.";
+    LOG(INFO) << "[SIZE " << d << "] done. " << es.size() << " => " << table.back().size()
+              << " => " << filtered_table.back().size() << " exprs.";
     for (size_t i = 0; i < filtered_table.back().size(); ++i)
       if (i < 2 || i+2 >= filtered_table.back().size())
         LOG(INFO) << " => " << *filtered_table.back()[i];
@@ -2,8 +2,14 @@
 #define ICFPC_EXPR_LIST_H_
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <unordered_set>
 #include <vector>
+#include "cluster.h"
 #include "expr.h"
+#include "expr_table_cache.h"
+#include "parallel.h"
 #include "simplify.h"
 
 namespace icfpc {
@@ -23,90 +29,298 @@ std::vector<std::shared_ptr<Expr> > ListExprDepth1(int op_type_set) {
   return result;
 }
 
-std::vector<std::shared_ptr<Expr> > ListExprInternal(
+bool IsConstantLeaf(const Expr& e, uint64_t value) {
+  uint64_t v;
+  return MatchConstant(e, &v) && v == value;
+}
+
+// Rules for the canonical-form generation. Each returns true if the composed
+// expression always has an equivalent one which is smaller or is generated
+// anyway, so that it does not need to be composed.
+bool IsRedundantUnary(UnaryOpExpr::Type type, const Expr& arg) {
+  switch (type) {
+    case UnaryOpExpr::Type::NOT:
+      return arg.op_type() == OpType::NOT;  // (not (not e)) = e
+    case UnaryOpExpr::Type::SHL1:
+      return IsConstantLeaf(arg, 0);  // (shl1 0) = 0
+    default:
+      return IsConstantLeaf(arg, 0) || IsConstantLeaf(arg, 1);  // (shr1 1) = 0
+  }
+}
+
+bool IsRedundantBinary(BinaryOpExpr::Type type, const Expr& lhs, const Expr& rhs,
+                       int op_type_set) {
+  // (and 0 e) = 0, (or 0 e) = (xor 0 e) = (plus 0 e) = e.
+  if (IsConstantLeaf(lhs, 0) || IsConstantLeaf(rhs, 0))
+    return true;
+  // (and e e) = (or e e) = e, (xor e e) = 0, (plus e e) = (shl1 e).
+  if (&lhs == &rhs)
+    return type != BinaryOpExpr::Type::PLUS || (op_type_set & OpType::SHL1);
+  return false;
+}
+
+bool IsRedundantIf0(const Expr& cond, const Expr& then_body, const Expr& else_body) {
+  // A constant condition always takes the same branch, and (if0 c e e) = e.
+  return (cond.variables() == 0 && !cond.has_fold()) || &then_body == &else_body;
+}
+
+bool IsRedundantFold(const Expr& body) {
+  // A body without y and z ignores the loop: (fold v i body) = body.
+  return !body.in_fold();
+}
+
+// Returns the minimum number of nodes to be added around an expression so
+// that the whole program contains every operator in |op_type_set|. Each
+// operator node brings at least one leaf per extra operand, i.e. costs its
+// arity (fold costs 4 with its lambda). Looked up in a precomputed table.
+std::size_t MinCoverSize(int op_type_set) {
+  static const std::vector<std::size_t> table = []() {
+    const int kNumOps = 12;  // NOT .. TFOLD
+    std::vector<std::size_t> result(1 << kNumOps);
+    for (int s = 1; s < (1 << kNumOps); ++s) {
+      int op = s & -s;
+      std::size_t cost =
+          (op & (OpType::AND | OpType::OR | OpType::XOR | OpType::PLUS)) ? 2 :
+          (op & OpType::IF0) ? 3 :
+          (op & (OpType::FOLD | OpType::TFOLD)) ? 4 : 1;
+      result[s] = result[s & ~op] + cost;
+    }
+    return result;
+  }();
+  return table[op_type_set & (OpType::LAMBDA - 1)];
+}
+
+// A slice of the composition loops for one size level: the operands of the
+// outermost loop in table[i][begin, end) for the given operand sizes (i, j).
+// Visiting the tasks of ListExprTasks() in order enumerates exactly what
+// VisitExprInternal() does, in the same order.
+struct ExprListTask {
+  enum Kind { UNARY, BINARY, IF0, FOLD } kind;
+  std::size_t i;
+  std::size_t j;
+  std::size_t begin;
+  std::size_t end;
+};
+
+// Splits the composition of size |depth| into tasks. The outermost operand
+// range is cut so that each task composes roughly |max_work| expressions.
+std::vector<ExprListTask> ListExprTasks(
     const std::vector<std::vector<std::shared_ptr<Expr> > >& table,
-    std::size_t depth, int op_type_set) {
-  std::vector<std::shared_ptr<Expr> > result;
+    std::size_t depth, int op_type_set, std::size_t max_work) {
+  std::vector<ExprListTask> tasks;
+  auto add = [&](ExprListTask::Kind kind, std::size_t i, std::size_t j,
+                 std::size_t outer_size, std::size_t inner_work) {
+    std::size_t block = std::max<std::size_t>(1, max_work / std::max<std::size_t>(1, inner_work));
+    for (std::size_t begin = 0; begin < outer_size; begin += block)
+      tasks.push_back(ExprListTask { kind, i, j, begin, std::min(outer_size, begin + block) });
+  };
 
-  // Unary.
   if (depth >= 2 &&
-      (op_type_set & (OpType::NOT | OpType::SHL1 | OpType::SHR1 | OpType::SHR4 | OpType::SHR16))) {
-    for (auto& e : table[depth - 1]) {
-      if (op_type_set & OpType::NOT)
-        result.push_back(UnaryOpExpr::Create(UnaryOpExpr::Type::NOT, e));
-      if (op_type_set & OpType::SHL1)
-        result.push_back(UnaryOpExpr::Create(UnaryOpExpr::Type::SHL1, e));
-      if (op_type_set & OpType::SHR1)
-        result.push_back(UnaryOpExpr::Create(UnaryOpExpr::Type::SHR1, e));
-      if (op_type_set & OpType::SHR4)
-        result.push_back(UnaryOpExpr::Create(UnaryOpExpr::Type::SHR4, e));
-      if (op_type_set & OpType::SHR16)
-        result.push_back(UnaryOpExpr::Create(UnaryOpExpr::Type::SHR16, e));
-    }
-  }
+      (op_type_set & (OpType::NOT | OpType::SHL1 | OpType::SHR1 | OpType::SHR4 | OpType::SHR16)))
+    add(ExprListTask::UNARY, depth - 1, 0, table[depth - 1].size(), 1);
 
-  // Binary.
   if (depth >= 3 &&
-      (op_type_set & (OpType::AND | OpType::OR | OpType::XOR | OpType::PLUS))) {
-    for (std::size_t i = 1; i < depth - 1; ++i) if (i <= depth - 1 - i) { // Only emit smaller left
-      for (auto& lhs : table[i]) {
-        for (auto& rhs : table[depth - 1 - i]) {
+      (op_type_set & (OpType::AND | OpType::OR | OpType::XOR | OpType::PLUS)))
+    for (std::size_t i = 1; i < depth - 1; ++i) if (i <= depth - 1 - i)
+      add(ExprListTask::BINARY, i, 0, table[i].size(), table[depth - 1 - i].size());
+
+  if (depth >= 4 && (op_type_set & OpType::IF0))
+    for (size_t i = 1; i < depth - 2; ++i)
+      for (size_t j = 1; j < depth - i - 1; ++j)
+        add(ExprListTask::IF0, i, j, table[i].size(),
+            table[j].size() * table[depth - 1 - i - j].size());
+
+  if (depth >= 5 && (op_type_set & OpType::FOLD))
+    for (size_t i = 1; i < depth - 3; ++i)
+      for (size_t j = 1; j < depth - i - 2; ++j)
+        add(ExprListTask::FOLD, i, j, table[i].size(),
+            table[j].size() * table[depth - 2 - i - j].size());
+
+  return tasks;
+}
+
+// Calls |visitor| with each expression of size |depth| in the slice |task|.
+// If |canonical| is set, the expressions matching the IsRedundant*() rules,
+// and (op b a) for the commutative binary ops when a, b are of the same size
+// and a comes before b in the table, are not composed. Neither are the ones
+// built only from the operators in |known_op_type_set| (if non-zero), which
+// are taken from a cached table.
+template<typename Visitor>
+void VisitExprTask(
+    const std::vector<std::vector<std::shared_ptr<Expr> > >& table,
+    std::size_t depth, int op_type_set, const ExprListTask& task, Visitor visitor,
+    bool canonical = false, int known_op_type_set = 0) {
+  const std::size_t i = task.i;
+  const std::size_t j = task.j;
+  auto known = [known_op_type_set](OpType op, const Expr* e1, const Expr* e2, const Expr* e3) {
+    return known_op_type_set && (known_op_type_set & op) &&
+        IsEnumeratedWith(*e1, known_op_type_set) &&
+        (!e2 || IsEnumeratedWith(*e2, known_op_type_set)) &&
+        (!e3 || IsEnumeratedWith(*e3, known_op_type_set));
+  };
+  switch (task.kind) {
+    // Unary.
+    case ExprListTask::UNARY:
+      for (std::size_t k = task.begin; k < task.end; ++k) {
+        auto& e = table[depth - 1][k];
+        auto unary = [&](UnaryOpExpr::Type type) {
+          if ((op_type_set & UnaryOpExpr::ToOpType(type)) &&
+              !(canonical && IsRedundantUnary(type, *e)) &&
+              !known(UnaryOpExpr::ToOpType(type), e.get(), nullptr, nullptr))
+            visitor(UnaryOpExpr::Create(type, e));
+        };
+        unary(UnaryOpExpr::Type::NOT);
+        unary(UnaryOpExpr::Type::SHL1);
+        unary(UnaryOpExpr::Type::SHR1);
+        unary(UnaryOpExpr::Type::SHR4);
+        unary(UnaryOpExpr::Type::SHR16);
+      }
+      break;
+
+    // Binary.
+    case ExprListTask::BINARY: {
+      auto& rhs_table = table[depth - 1 - i];
+      for (std::size_t k = task.begin; k < task.end; ++k) {
+        auto& lhs = table[i][k];
+        // All the binary ops are commutative; take lhs <= rhs for equal sizes.
+        std::size_t rhs_begin = (canonical && i == depth - 1 - i) ? k : 0;
+        for (std::size_t r = rhs_begin; r < rhs_table.size(); ++r) {
+          auto& rhs = rhs_table[r];
           int has_fold_cnt = (lhs->has_fold() ? 1 : 0) + (rhs->has_fold() ? 1 : 0);
           int in_fold_cnt  = (lhs->in_fold() ? 1 : 0) + (rhs->in_fold() ? 1 : 0);
-          if(has_fold_cnt > 1) break;
-          if(has_fold_cnt == 1 && in_fold_cnt >= 1) break;
-
-          if (op_type_set & OpType::AND)
-            result.push_back(BinaryOpExpr::Create(BinaryOpExpr::Type::AND, lhs, rhs));
-          if (op_type_set & OpType::OR)
-            result.push_back(BinaryOpExpr::Create(BinaryOpExpr::Type::OR, lhs, rhs));
-          if (op_type_set & OpType::XOR)
-            result.push_back(BinaryOpExpr::Create(BinaryOpExpr::Type::XOR, lhs, rhs));
-          if (op_type_set & OpType::PLUS)
-            result.push_back(BinaryOpExpr::Create(BinaryOpExpr::Type::PLUS, lhs, rhs));
+          if(has_fold_cnt > 1) continue;
+          if(has_fold_cnt == 1 && in_fold_cnt >= 1) continue;
+
+          auto binary = [&](BinaryOpExpr::Type type) {
+            if ((op_type_set & BinaryOpExpr::ToOpType(type)) &&
+                !(canonical && IsRedundantBinary(type, *lhs, *rhs, op_type_set)) &&
+                !known(BinaryOpExpr::ToOpType(type), lhs.get(), rhs.get(), nullptr))
+              visitor(BinaryOpExpr::Create(type, lhs, rhs));
+          };
+          binary(BinaryOpExpr::Type::AND);
+          binary(BinaryOpExpr::Type::OR);
+          binary(BinaryOpExpr::Type::XOR);
+          binary(BinaryOpExpr::Type::PLUS);
         }
       }
+      break;
     }
-  }
 
-  // Ternary: if0.
-  if (depth >= 4 && (op_type_set & OpType::IF0)) {
-    for (size_t i = 1; i < depth - 2; ++i) {
-      for (size_t j = 1; j < depth - i - 1; ++j) {
-        for (auto& e_cond : table[i]) {
-          for (auto& e_then : table[j]) {
-            for (auto& e_else : table[depth - 1 - i - j]) {
-              int has_fold_cnt = (e_cond->has_fold() ? 1 : 0) + (e_then->has_fold() ? 1 : 0) + (e_else->has_fold() ? 1 : 0);
-              int  in_fold_cnt = (e_cond->in_fold()  ? 1 : 0) + (e_then->in_fold()  ? 1 : 0) + (e_else->in_fold()  ? 1 : 0);
-              if(has_fold_cnt > 1) break;
-              if(has_fold_cnt == 1 && in_fold_cnt >= 1) break;
-
-              result.push_back(If0Expr::Create(e_cond, e_then, e_else));
-            }
+    // Ternary: if0.
+    case ExprListTask::IF0:
+      for (std::size_t k = task.begin; k < task.end; ++k) {
+        auto& e_cond = table[i][k];
+        for (auto& e_then : table[j]) {
+          for (auto& e_else : table[depth - 1 - i - j]) {
+            int has_fold_cnt = (e_cond->has_fold() ? 1 : 0) + (e_then->has_fold() ? 1 : 0) + (e_else->has_fold() ? 1 : 0);
+            int  in_fold_cnt = (e_cond->in_fold()  ? 1 : 0) + (e_then->in_fold()  ? 1 : 0) + (e_else->in_fold()  ? 1 : 0);
+            if(has_fold_cnt > 1) continue;
+            if(has_fold_cnt == 1 && in_fold_cnt >= 1) continue;
+            if (canonical && IsRedundantIf0(*e_cond, *e_then, *e_else)) continue;
+            if (known(OpType::IF0, e_cond.get(), e_then.get(), e_else.get())) continue;
+
+            visitor(If0Expr::Create(e_cond, e_then, e_else));
           }
         }
       }
-    }
-  }
+      break;
 
-  // Ternary: fold.
-  if (depth >= 5 && (op_type_set & OpType::FOLD)) {
-    for (size_t i = 1; i < depth - 3; ++i) {
-      for (size_t j = 1; j < depth - i - 2; ++j) {
-        for (auto& e_value: table[i]) {
-          if (e_value->has_fold() || e_value->in_fold()) continue;
-          for (auto& e_init: table[j]) {
-            if (e_init->has_fold() || e_init->in_fold()) continue;
-            for (auto& e_body: table[depth - 2 - i - j]) {
-              if (e_body->has_fold()) continue;
-              result.push_back(FoldExpr::Create(e_value, e_init, e_body));
-            }
+    // Ternary: fold.
+    case ExprListTask::FOLD:
+      for (std::size_t k = task.begin; k < task.end; ++k) {
+        auto& e_value = table[i][k];
+        if (e_value->has_fold() || e_value->in_fold()) continue;
+        for (auto& e_init: table[j]) {
+          if (e_init->has_fold() || e_init->in_fold()) continue;
+          for (auto& e_body: table[depth - 2 - i - j]) {
+            if (e_body->has_fold()) continue;
+            if (canonical && IsRedundantFold(*e_body)) continue;
+            if (known(OpType::FOLD, e_value.get(), e_init.get(), e_body.get())) continue;
+            visitor(FoldExpr::Create(e_value, e_init, e_body));
           }
         }
       }
-    }
+      break;
+  }
+}
+
+// Calls |visitor| with each expression of size |depth| composed from |table|,
+// without materializing them.
+template<typename Visitor>
+void VisitExprInternal(
+    const std::vector<std::vector<std::shared_ptr<Expr> > >& table,
+    std::size_t depth, int op_type_set, Visitor visitor, bool canonical = false,
+    int known_op_type_set = 0) {
+  for (const ExprListTask& task : ListExprTasks(table, depth, op_type_set, ~std::size_t(0)))
+    VisitExprTask(table, depth, op_type_set, task, visitor, canonical, known_op_type_set);
+}
+
+// A slice of the last size level for sharded enumeration: the tasks of
+// ListExprTasks() with (task index) % num_shards == index. While an
+// expression is visited, |group| tells where it comes from: 0 for the
+// smaller sizes, and 1 + the task index for the last level, so that the
+// outputs of all the shards can be merged back in the unsharded order.
+struct ExprShard {
+  int index;
+  int num_shards;
+  std::size_t group;
+};
+
+// Composes the expressions of size |depth| on the threads of |pool|. Workers
+// map each expression with |transform|, which must be thread-safe and returns
+// nullptr to drop it; |visitor| receives the results on the calling thread,
+// in the same order as VisitExprInternal(). Only the slice |shard| is
+// composed if given.
+template<typename Transform, typename Visitor>
+void VisitExprParallel(
+    const std::vector<std::vector<std::shared_ptr<Expr> > >& table,
+    std::size_t depth, int op_type_set, ThreadPool* pool,
+    Transform transform, Visitor visitor, bool canonical = false,
+    int known_op_type_set = 0, ExprShard* shard = nullptr) {
+  if (pool->num_threads() <= 1 && !shard) {
+    VisitExprInternal(table, depth, op_type_set, [&](const std::shared_ptr<Expr>& e) {
+      std::shared_ptr<Expr> t = transform(e);
+      if (t) visitor(t);
+    }, canonical, known_op_type_set);
+    return;
   }
 
+  // Only a bounded number of tasks is composed ahead of the one handed to
+  // |visitor|, so that only so many expressions are buffered.
+  const std::size_t kTaskWork = 1 << 13;
+  const std::size_t window = pool->num_threads() * 4;
+  std::vector<ExprListTask> all_tasks = ListExprTasks(table, depth, op_type_set, kTaskWork);
+  std::vector<std::size_t> task_ids;
+  for (std::size_t t = 0; t < all_tasks.size(); ++t)
+    if (!shard || static_cast<int>(t % shard->num_shards) == shard->index)
+      task_ids.push_back(t);
+  std::vector<std::vector<std::shared_ptr<Expr> > > outputs(task_ids.size());
+  pool->RunOrdered(
+      task_ids.size(), window,
+      [&](std::size_t k) {
+        VisitExprTask(table, depth, op_type_set, all_tasks[task_ids[k]],
+                      [&](const std::shared_ptr<Expr>& e) {
+                        std::shared_ptr<Expr> t = transform(e);
+                        if (t) outputs[k].push_back(std::move(t));
+                      },
+                      canonical, known_op_type_set);
+      },
+      [&](std::size_t k) {
+        if (shard)
+          shard->group = task_ids[k] + 1;
+        for (auto& e : outputs[k])
+          visitor(e);
+        std::vector<std::shared_ptr<Expr> >().swap(outputs[k]);
+        return true;
+      });
+}
+
+std::vector<std::shared_ptr<Expr> > ListExprInternal(
+    const std::vector<std::vector<std::shared_ptr<Expr> > >& table,
+    std::size_t depth, int op_type_set) {
+  std::vector<std::shared_ptr<Expr> > result;
+  VisitExprInternal(table, depth, op_type_set,
+                    [&result](const std::shared_ptr<Expr>& e) { result.push_back(e); });
   return result;
 }
 
@@ -114,6 +328,12 @@ enum GenAllSimplifyMode {
   NO_SIMPLIFY,
   SIMPLIFY_EACH_STEP,
   GLOBAL_SIMPLIFY,
+  // Keeps only the first program for each output signature on CreateKey(),
+  // and composes the later levels from those representatives only.
+  OBSERVATIONAL,
+  // Same as OBSERVATIONAL, but the other programs with a known signature are
+  // emitted too (while still not being used to compose larger ones).
+  OBSERVATIONAL_KEEP_MEMBERS,
 };
 
 std::vector<std::shared_ptr<Expr> > RemoveInFold(
@@ -125,82 +345,264 @@ std::vector<std::shared_ptr<Expr> > RemoveInFold(
   return result;
 }
 
-std::vector<std::shared_ptr<Expr> > ListExpr(
-    std::size_t depth, int op_type_set, GenAllSimplifyMode mode) {
+// Streams the programs ListExpr() returns to |visitor|, in the same order.
+// Only the tables of the sizes below the last level are kept in memory; the
+// last level is handed to |visitor| as soon as each expression is composed.
+// Each level is composed on |num_threads| threads (at most the hardware
+// threads), which are started once for all the levels; the output does not
+// depend on it. Returns the number of the streamed programs.
+// If |table_cache_dir| is given, GLOBAL_SIMPLIFY and OBSERVATIONAL reuse the
+// tables cached there for the largest subset of the operators, and cache the
+// tables for |op_type_set|. The programs are then emitted in another order,
+// and other representatives may be taken for the same simplified forms.
+// If |shard| is given, only its slice of the last level is composed, and the
+// smaller sizes are emitted by the shard 0 only.
+template<typename Visitor>
+std::size_t ForEachExpr(
+    std::size_t depth, int op_type_set, GenAllSimplifyMode mode, Visitor visitor,
+    int num_threads = 1, const std::string& table_cache_dir = "",
+    ExprShard* shard = nullptr) {
   std::vector<std::vector<std::shared_ptr<Expr> > > table(1);
+  ThreadPool pool(HardwareThreads(num_threads));
+  bool is_tfold = op_type_set & OpType::TFOLD;
+  bool is_observational = (mode == OBSERVATIONAL || mode == OBSERVATIONAL_KEEP_MEMBERS);
+  bool takes_all_sizes = (mode == GLOBAL_SIMPLIFY || is_observational);
+  // Redundant forms need not be composed when every smaller size is taken
+  // and deduplicated anyway. The other modes keep the exact enumeration, and
+  // OBSERVATIONAL_KEEP_MEMBERS outputs the redundant forms as members.
+  bool canonical = (mode == GLOBAL_SIMPLIFY || mode == OBSERVATIONAL);
 
   // For TFOLD, the size of the body is by |lambda|+|fold|+|x|+|0| = 5 smaller.
   std::size_t table_gen_limit =
-    (op_type_set & OpType::TFOLD ? (depth >= 6 ? depth - 5 : 1) : depth - 1);
+    (is_tfold ? (depth >= 6 ? depth - 5 : 1) : depth - 1);
 
   std::set<std::string> already_known;
+  std::unordered_set<uint64_t> known_signatures;
+  std::vector<uint64_t> key;
+  if (is_observational)
+    key = CreateKey();
 
-  // Generate size=1 expressions.
-  table.push_back(ListExprDepth1(op_type_set));
-  for (auto& e: table.back())
-    already_known.insert(Simplify(e)->ToString());
-
-  // Generate size=d expressions.
-  for (size_t d = 2; d <= table_gen_limit; ++d) {
-    auto table_d = ListExprInternal(table, d, op_type_set);
+  // Operators every program must contain. Only NO_SIMPLIFY filters the
+  // programs by the exact operator set.
+  int required_ops = (mode == NO_SIMPLIFY ? op_type_set & ~OpType::TFOLD : 0);
 
+  // This runs on the worker threads.
+  auto prefilter = [depth, required_ops, table_gen_limit](
+      std::size_t d, const std::shared_ptr<Expr>& e) -> bool {
     // If it is to late to form fold, discard in_fold elements.
-    if (d + 5 > depth)
-      table_d = RemoveInFold(table_d);
+    if (d + 5 > depth && e->in_fold())
+      return false;
+    // Discard the ones too large to add the missing operators around them.
+    return d + MinCoverSize(required_ops & ~e->op_type_set()) <= table_gen_limit;
+  };
 
-    // Simplify
+  // Returns true if |e| survives the simplification. This runs on the calling
+  // thread only, since Simplify() and Eval() cache their results in the shared
+  // subtrees.
+  auto keep = [&](const std::shared_ptr<Expr>& e, std::set<std::string>* level_known) -> bool {
     switch (mode) {
       case NO_SIMPLIFY:
-        break;
+        return true;
       case SIMPLIFY_EACH_STEP:
-        table_d = SimplifyExprList(table_d);
-        break;
-      case GLOBAL_SIMPLIFY: {
-        std::vector<std::shared_ptr<Expr> > global_simplified;
-        for (auto& e: table_d) {
-          std::string key = Simplify(e)->ToString();
-          if (already_known.insert(Simplify(e)->ToString()).second)
-            global_simplified.push_back(e);
-        }
-        table_d = std::move(global_simplified);
-        break;
-      }
+        return level_known->insert(Simplify(e)->ToString()).second;
+      case GLOBAL_SIMPLIFY:
+        return already_known.insert(Simplify(e)->ToString()).second;
+      case OBSERVATIONAL:
+      case OBSERVATIONAL_KEEP_MEMBERS:
+        return known_signatures.insert(HashSignature(key, *e)).second;
     }
+    return true;
+  };
 
-    table.push_back(table_d);
-    LOG(INFO) << "SIZE[" << d << "] " << table_d.size();
-  }
+  // Wraps |e| into the final program, or returns nullptr if it is not one.
+  auto wrap = [mode, takes_all_sizes, is_tfold, op_type_set](
+      const std::shared_ptr<Expr>& e) -> std::shared_ptr<Expr> {
+    if (is_tfold) {
+      // GLOBAL_SIMPLIFY and OBSERVATIONAL take every body as is.
+      if (!takes_all_sizes && e->has_fold())
+        return std::shared_ptr<Expr>();
+      std::shared_ptr<Expr> tfold = FoldExpr::CreateTFold(e);
+      if (mode == NO_SIMPLIFY && tfold->op_type_set() != op_type_set)
+        return std::shared_ptr<Expr>();
+      return LambdaExpr::Create(tfold);
+    }
+    if (e->in_fold())
+      return std::shared_ptr<Expr>();
+    if (mode == NO_SIMPLIFY && e->op_type_set() != op_type_set)
+      return std::shared_ptr<Expr>();
+    return LambdaExpr::Create(e);
+  };
 
-  std::vector<std::shared_ptr<Expr> > result;
-  if (mode == GLOBAL_SIMPLIFY) {
-    // GLOBAL_SIMPLIFY ==> Take all the possible sizes.
-    if (op_type_set & OpType::TFOLD) {
-      for (auto& table_d : table)
-        for (auto& e : table_d)
-          result.push_back(LambdaExpr::Create(FoldExpr::CreateTFold(e)));
+  std::size_t num_emitted = 0;
+  if (shard)
+    shard->group = 0;
+  auto emit = [&](const std::shared_ptr<Expr>& program) {
+    if (program && (!shard || shard->group > 0 || shard->index == 0)) {
+      visitor(program);
+      ++num_emitted;
+    }
+  };
+
+  // The levels below |cached.size()| start with the expressions read from the
+  // cache, and only the compositions using the other operators are made.
+  bool use_cache = !table_cache_dir.empty() && table_gen_limit > 1 && !shard &&
+      (mode == GLOBAL_SIMPLIFY || mode == OBSERVATIONAL);
+  std::string mode_name = (mode == GLOBAL_SIMPLIFY ? "global" : "observational");
+  auto start_time = std::chrono::steady_clock::now();
+  auto elapsed_sec = [&start_time]() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  };
+  ExprTable cached;
+  std::vector<double> cached_sec;
+  int cached_op_type_set = 0;
+  double load_sec = 0;
+  if (use_cache) {
+    std::string path;
+    std::size_t levels = FindCachedExprTable(
+        table_cache_dir, mode_name, op_type_set, depth, table_gen_limit,
+        &path, &cached_op_type_set);
+    if (levels && ReadExprTable(path, levels, &cached, &cached_sec)) {
+      load_sec = elapsed_sec();
+      LOG(INFO) << "Table cache hit: " << path << " up to SIZE[" << levels
+                << "] (loaded in " << load_sec << " s, saved "
+                << cached_sec.back() - load_sec << " s)";
     } else {
-      for (auto& table_d : table)
-        for (auto& e : table_d)
-          if (!e->in_fold())
-            result.push_back(LambdaExpr::Create(e));
+      cached.clear();
+      LOG(INFO) << "Table cache miss";
     }
-  } else {
-    // NO_SIMPLIFY & SIMPLIFY_EACH_STEP ==> Take the exact size.
-    if (op_type_set & OpType::TFOLD) {
-      table.resize(depth);
-      if (depth >= 5)
-        for (auto& e_body : table[depth - 5])
-          if (!e_body->has_fold())
-            table[depth - 1].push_back(FoldExpr::CreateTFold(e_body));
+  }
+  std::vector<double> build_sec(2, 0.0);
+  auto record_build_sec = [&](std::size_t d) {
+    build_sec.push_back(elapsed_sec());
+    if (!cached.empty())
+      build_sec.back() += cached_sec[std::min(d, cached.size() - 1)] - load_sec;
+  };
+  // Takes the cached expressions of size |d| which survive the simplification.
+  auto take_cached = [&](std::size_t d, std::set<std::string>* level_known,
+                         std::vector<std::shared_ptr<Expr> >* table_d) {
+    if (d >= cached.size())
+      return;
+    for (auto& e : cached[d]) {
+      if (keep(e, level_known)) {
+        table_d->push_back(e);
+        emit(wrap(e));
+      }
     }
+  };
 
-    for (auto& e: table[depth - 1]) {
-      if (e->in_fold())
-        continue;
-      if (mode != NO_SIMPLIFY || e->op_type_set() == op_type_set)
-        result.push_back(LambdaExpr::Create(e));
-    }
+  // Generate size=1 expressions.
+  table.push_back(ListExprDepth1(op_type_set));
+  for (auto& e: table.back()) {
+    if (is_observational)
+      known_signatures.insert(HashSignature(key, *e));
+    else
+      already_known.insert(Simplify(e)->ToString());
+  }
+
+  // GLOBAL_SIMPLIFY & OBSERVATIONAL ==> Take all the possible sizes.
+  // Each level is emitted as soon as it is built.
+  if (takes_all_sizes && table_gen_limit > 1)
+    for (auto& e : table[1])
+      emit(wrap(e));
+
+  // Generate size=d expressions, except for the last level.
+  for (size_t d = 2; d < table_gen_limit; ++d) {
+    std::vector<std::shared_ptr<Expr> > table_d;
+    std::set<std::string> level_known;
+    std::atomic<std::size_t> num_composed(0);
+    take_cached(d, &level_known, &table_d);
+    VisitExprParallel(
+        table, d, op_type_set, &pool,
+        [&](const std::shared_ptr<Expr>& e) {
+          ++num_composed;
+          return prefilter(d, e) ? e : std::shared_ptr<Expr>();
+        },
+        [&](const std::shared_ptr<Expr>& e) {
+          if (keep(e, &level_known)) {
+            table_d.push_back(e);
+            if (takes_all_sizes)
+              emit(wrap(e));
+          } else if (mode == OBSERVATIONAL_KEEP_MEMBERS) {
+            emit(wrap(e));
+          }
+        },
+        canonical, d < cached.size() ? cached_op_type_set : 0);
+    table.push_back(std::move(table_d));
+    record_build_sec(d);
+    LOG(INFO) << "SIZE[" << d << "] " << table.back().size()
+              << " (composed " << num_composed << ")";
+  }
+
+  // NO_SIMPLIFY & SIMPLIFY_EACH_STEP ==> Take the exact size.
+  bool emit_last = (takes_all_sizes || !is_tfold || table_gen_limit + 5 == depth);
+  std::atomic<std::size_t> last_size(0);
+  std::atomic<std::size_t> num_composed(0);
+  if (table_gen_limit == 1) {
+    last_size = table[1].size();
+    if (emit_last)
+      for (auto& e : table[1])
+        emit(wrap(e));
+  } else if (mode == NO_SIMPLIFY) {
+    // Nothing to do on the calling thread, so wrap the programs in workers.
+    VisitExprParallel(
+        table, table_gen_limit, op_type_set, &pool,
+        [&](const std::shared_ptr<Expr>& e) -> std::shared_ptr<Expr> {
+          ++num_composed;
+          if (!prefilter(table_gen_limit, e))
+            return std::shared_ptr<Expr>();
+          ++last_size;
+          return emit_last ? wrap(e) : std::shared_ptr<Expr>();
+        },
+        emit, canonical, 0, shard);
+  } else {
+    // The last level is kept only to be cached.
+    std::set<std::string> level_known;
+    std::vector<std::shared_ptr<Expr> > table_d;
+    take_cached(table_gen_limit, &level_known, &table_d);
+    last_size = table_d.size();
+    VisitExprParallel(
+        table, table_gen_limit, op_type_set, &pool,
+        [&](const std::shared_ptr<Expr>& e) {
+          ++num_composed;
+          return prefilter(table_gen_limit, e) ? e : std::shared_ptr<Expr>();
+        },
+        [&](const std::shared_ptr<Expr>& e) {
+          if (!keep(e, &level_known)) {
+            if (mode == OBSERVATIONAL_KEEP_MEMBERS)
+              emit(wrap(e));
+            return;
+          }
+          ++last_size;
+          if (use_cache)
+            table_d.push_back(e);
+          if (emit_last)
+            emit(wrap(e));
+        },
+        canonical, table_gen_limit < cached.size() ? cached_op_type_set : 0, shard);
+    table.push_back(std::move(table_d));
+    record_build_sec(table_gen_limit);
   }
+  LOG(INFO) << "SIZE[" << table_gen_limit << "] " << last_size
+            << " (composed " << num_composed << ")";
+
+  if (use_cache &&
+      !(cached_op_type_set == op_type_set && cached.size() > table_gen_limit)) {
+    std::string path = ExprTablePath(table_cache_dir, mode_name, op_type_set, depth);
+    if (WriteExprTable(path, op_type_set, depth, table, build_sec))
+      LOG(INFO) << "Table cache: wrote " << path;
+    else
+      LOG(WARNING) << "Table cache: failed to write " << path;
+  }
+  return num_emitted;
+}
+
+std::vector<std::shared_ptr<Expr> > ListExpr(
+    std::size_t depth, int op_type_set, GenAllSimplifyMode mode, int num_threads = 1,
+    const std::string& table_cache_dir = "") {
+  std::vector<std::shared_ptr<Expr> > result;
+  ForEachExpr(depth, op_type_set, mode,
+              [&result](const std::shared_ptr<Expr>& e) { result.push_back(e); },
+              num_threads, table_cache_dir);
   LOG(INFO) << "SIZE[GEN] " << result.size();
   return result;
 }
@@ -0,0 +1,294 @@
+#ifndef ICFPC_EXPR_TABLE_CACHE_H_
+#define ICFPC_EXPR_TABLE_CACHE_H_
+
+#include <dirent.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "expr.h"
+
+namespace icfpc {
+
+// On-disk cache of the per-size tables built by ForEachExpr(), so that the
+// problems of the same or a larger operator set do not enumerate them again.
+//
+// File format (text): a header line
+//   exprtable 1 <op_type_set> <depth>
+// followed by the number of nodes and one node per line, children first:
+//   <op_type> <value>            constant
+//   <op_type> <x=0|y=1|z=2>      id
+//   <op_type> <arg>...           unary, binary, if0, fold (node indices)
+// and then the number of levels and, for each level d >= 1, one line
+//   <build_sec> <count> <node>...
+// where build_sec is the time spent to build the levels up to d.
+typedef std::vector<std::vector<std::shared_ptr<Expr> > > ExprTable;
+
+// Returns true if |e| is composed only from the operators in |op_type_set|,
+// i.e. the enumeration for |op_type_set| generates it too.
+bool IsEnumeratedWith(const Expr& e, int op_type_set) {
+  return !(e.op_type_set() & ~op_type_set) &&
+         (!e.in_fold() || (op_type_set & (OpType::FOLD | OpType::TFOLD)));
+}
+
+// Returns the largest size whose table does not depend on the program size.
+// The in_fold expressions are dropped from the levels which can not be a fold
+// body any more, i.e. above depth - 5 when fold is not the outermost.
+std::size_t SizeIndependentLevels(int op_type_set, std::size_t depth) {
+  if (!(op_type_set & OpType::FOLD) || (op_type_set & OpType::TFOLD))
+    return ~std::size_t(0);
+  return depth > 5 ? depth - 5 : 0;
+}
+
+std::string ExprTablePath(const std::string& dir, const std::string& mode_name,
+                          int op_type_set, std::size_t depth) {
+  char filename[64];
+  sprintf(filename, "/%s-%03x-%02d.tbl", mode_name.c_str(), op_type_set,
+          static_cast<int>(depth));
+  return dir + filename;
+}
+
+// Writes |table| (levels 1 .. table.size() - 1) to |path|. The file is
+// renamed into place, so that concurrent readers never see a partial one.
+bool WriteExprTable(const std::string& path, int op_type_set, std::size_t depth,
+                    const ExprTable& table, const std::vector<double>& build_sec) {
+  std::unordered_map<const Expr*, std::size_t> ids;
+  std::vector<const Expr*> nodes;
+  std::vector<std::vector<std::size_t> > args;
+  // Assigns the ids to the subtrees first, without recursion.
+  auto add = [&](const Expr* root) {
+    std::vector<std::pair<const Expr*, bool> > stack(1, std::make_pair(root, false));
+    while (!stack.empty()) {
+      const Expr* e = stack.back().first;
+      bool expanded = stack.back().second;
+      stack.pop_back();
+      if (ids.count(e))
+        continue;
+      std::vector<const Expr*> children;
+      switch (e->op_type()) {
+        case OpType::CONSTANT:
+        case OpType::ID:
+          break;
+        case OpType::IF0: {
+          auto& i0 = static_cast<const If0Expr&>(*e);
+          children = { i0.cond().get(), i0.then_body().get(), i0.else_body().get() };
+          break;
+        }
+        case OpType::FOLD:
+        case OpType::TFOLD: {
+          auto& fold = static_cast<const FoldExpr&>(*e);
+          children = { fold.value().get(), fold.init_value().get(), fold.body().get() };
+          break;
+        }
+        case OpType::AND:
+        case OpType::OR:
+        case OpType::XOR:
+        case OpType::PLUS: {
+          auto& binary = static_cast<const BinaryOpExpr&>(*e);
+          children = { binary.arg1().get(), binary.arg2().get() };
+          break;
+        }
+        default:
+          children = { static_cast<const UnaryOpExpr&>(*e).arg().get() };
+          break;
+      }
+      if (!expanded) {
+        stack.push_back(std::make_pair(e, true));
+        for (const Expr* child : children)
+          stack.push_back(std::make_pair(child, false));
+        continue;
+      }
+      std::vector<std::size_t> arg_ids;
+      for (const Expr* child : children)
+        arg_ids.push_back(ids[child]);
+      ids[e] = nodes.size();
+      nodes.push_back(e);
+      args.push_back(std::move(arg_ids));
+    }
+  };
+  for (std::size_t d = 1; d < table.size(); ++d)
+    for (auto& e : table[d])
+      add(e.get());
+
+  std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+  {
+    std::ofstream os(tmp_path.c_str());
+    os << "exprtable 1 " << op_type_set << " " << depth << "\n";
+    os << nodes.size() << "\n";
+    for (std::size_t k = 0; k < nodes.size(); ++k) {
+      const Expr* e = nodes[k];
+      os << static_cast<int>(e->op_type());
+      if (e->op_type() == OpType::CONSTANT)
+        os << " " << static_cast<const ConstantExpr&>(*e).value();
+      else if (e->op_type() == OpType::ID)
+        os << " " << static_cast<int>(static_cast<const IdExpr&>(*e).name());
+      for (std::size_t arg : args[k])
+        os << " " << arg;
+      os << "\n";
+    }
+    os << table.size() - 1 << "\n";
+    for (std::size_t d = 1; d < table.size(); ++d) {
+      os << build_sec[d] << " " << table[d].size();
+      for (auto& e : table[d])
+        os << " " << ids[e.get()];
+      os << "\n";
+    }
+    if (!os) {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+  }
+  return rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+// Reads the levels 1 .. |max_level| of the table at |path|. Returns false if
+// the file is broken.
+bool ReadExprTable(const std::string& path, std::size_t max_level,
+                   ExprTable* table, std::vector<double>* build_sec) {
+  std::ifstream is(path.c_str());
+  std::string magic;
+  int version, op_type_set;
+  std::size_t depth, num_nodes;
+  if (!(is >> magic >> version >> op_type_set >> depth >> num_nodes) ||
+      magic != "exprtable" || version != 1)
+    return false;
+
+  std::vector<std::shared_ptr<Expr> > nodes;
+  nodes.reserve(num_nodes);
+  auto arg = [&]() -> std::shared_ptr<Expr> {
+    std::size_t k = num_nodes;
+    is >> k;
+    return k < nodes.size() ? nodes[k] : std::shared_ptr<Expr>();
+  };
+  for (std::size_t k = 0; k < num_nodes; ++k) {
+    int op_type = 0;
+    is >> op_type;
+    std::shared_ptr<Expr> e;
+    switch (op_type) {
+      case OpType::CONSTANT: {
+        uint64_t value = 0;
+        is >> value;
+        e = (value == 0 ? ConstantExpr::CreateZero() :
+             value == 1 ? ConstantExpr::CreateOne() : ConstantExpr::Create(value));
+        break;
+      }
+      case OpType::ID: {
+        int name = 0;
+        is >> name;
+        e = IdExpr::Create(static_cast<IdExpr::Name>(name));
+        break;
+      }
+      case OpType::NOT: e = UnaryOpExpr::Create(UnaryOpExpr::Type::NOT, arg()); break;
+      case OpType::SHL1: e = UnaryOpExpr::Create(UnaryOpExpr::Type::SHL1, arg()); break;
+      case OpType::SHR1: e = UnaryOpExpr::Create(UnaryOpExpr::Type::SHR1, arg()); break;
+      case OpType::SHR4: e = UnaryOpExpr::Create(UnaryOpExpr::Type::SHR4, arg()); break;
+      case OpType::SHR16: e = UnaryOpExpr::Create(UnaryOpExpr::Type::SHR16, arg()); break;
+      case OpType::AND:
+      case OpType::OR:
+      case OpType::XOR:
+      case OpType::PLUS: {
+        BinaryOpExpr::Type type =
+            (op_type == OpType::AND) ? BinaryOpExpr::Type::AND :
+            (op_type == OpType::OR) ? BinaryOpExpr::Type::OR :
+            (op_type == OpType::XOR) ? BinaryOpExpr::Type::XOR :
+            BinaryOpExpr::Type::PLUS;
+        std::shared_ptr<Expr> arg1 = arg();
+        std::shared_ptr<Expr> arg2 = arg();
+        if (arg1 && arg2) e = BinaryOpExpr::Create(type, arg1, arg2);
+        break;
+      }
+      case OpType::IF0: {
+        std::shared_ptr<Expr> cond = arg();
+        std::shared_ptr<Expr> then_body = arg();
+        std::shared_ptr<Expr> else_body = arg();
+        if (cond && then_body && else_body) e = If0Expr::Create(cond, then_body, else_body);
+        break;
+      }
+      case OpType::FOLD: {
+        std::shared_ptr<Expr> value = arg();
+        std::shared_ptr<Expr> init_value = arg();
+        std::shared_ptr<Expr> body = arg();
+        if (value && init_value && body) e = FoldExpr::Create(value, init_value, body);
+        break;
+      }
+    }
+    if (!is || !e)
+      return false;
+    nodes.push_back(e);
+  }
+
+  std::size_t num_levels = 0;
+  is >> num_levels;
+  table->assign(1, std::vector<std::shared_ptr<Expr> >());
+  build_sec->assign(1, 0.0);
+  for (std::size_t d = 1; d <= std::min(num_levels, max_level); ++d) {
+    double sec;
+    std::size_t count;
+    if (!(is >> sec >> count))
+      return false;
+    table->push_back(std::vector<std::shared_ptr<Expr> >());
+    table->back().reserve(count);
+    for (std::size_t k = 0; k < count; ++k) {
+      std::shared_ptr<Expr> e = arg();
+      if (!e)
+        return false;
+      table->back().push_back(e);
+    }
+    build_sec->push_back(sec);
+  }
+  return static_cast<bool>(is);
+}
+
+// Looks for the cached table in |dir| which serves the most levels of the
+// enumeration of |op_type_set| for programs of |depth|, among the ones for
+// the largest subsets of the operators. Only the levels up to |max_level|
+// are needed. Returns the number of the usable levels (0 if none).
+std::size_t FindCachedExprTable(
+    const std::string& dir, const std::string& mode_name, int op_type_set,
+    std::size_t depth, std::size_t max_level,
+    std::string* path, int* cached_op_type_set) {
+  DIR* dp = opendir(dir.c_str());
+  if (!dp)
+    return 0;
+  std::size_t best_levels = 0;
+  int best_num_ops = -1;
+  std::string prefix = mode_name + "-";
+  while (struct dirent* entry = readdir(dp)) {
+    std::string name = entry->d_name;
+    unsigned int cached_ops;
+    int cached_depth;
+    if (name.compare(0, prefix.size(), prefix) != 0 ||
+        name.size() < 4 || name.compare(name.size() - 4, 4, ".tbl") != 0 ||
+        sscanf(name.c_str() + prefix.size(), "%x-%d.tbl", &cached_ops, &cached_depth) != 2)
+      continue;
+    // The TFOLD tables lack x, and so are not shared with the others.
+    if ((cached_ops & ~op_type_set) ||
+        ((cached_ops ^ op_type_set) & OpType::TFOLD))
+      continue;
+    std::size_t cached_limit =
+        (cached_ops & OpType::TFOLD) ? (cached_depth >= 6 ? cached_depth - 5 : 1) : cached_depth - 1;
+    std::size_t levels = std::min(max_level, cached_limit);
+    if (static_cast<std::size_t>(cached_depth) != depth)
+      levels = std::min(levels, std::min(SizeIndependentLevels(cached_ops, cached_depth),
+                                         SizeIndependentLevels(cached_ops, depth)));
+    int num_ops = __builtin_popcount(cached_ops);
+    if (levels >= 2 &&
+        (num_ops > best_num_ops || (num_ops == best_num_ops && levels > best_levels))) {
+      best_levels = levels;
+      best_num_ops = num_ops;
+      *path = dir + "/" + name;
+      *cached_op_type_set = cached_ops;
+    }
+  }
+  closedir(dp);
+  return best_levels;
+}
+
+}  // namespace icfpc
+
+#endif  // ICFPC_EXPR_TABLE_CACHE_H_
@@ -0,0 +1,177 @@
+#ifndef ICFPC_EXTERNAL_CLUSTER_H_
+#define ICFPC_EXTERNAL_CLUSTER_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "cluster_dump.h"
+#include "expr.h"
+#include "run_file.h"
+
+namespace icfpc {
+
+// Clusters programs like AddToCluster(), but within a memory budget. When the
+// clusters held in memory exceed the budget, they are written to a temporary
+// dir as a run sorted by signature (the CLUSTER_RUN layout of run_file.h
+// without the header and the argument), and all the runs are merged by
+// MergeRunClusters() at the end. The programs are held encoded as in
+// cluster_dump.h, so that the streamed Expr trees can be freed.
+class ExternalCluster {
+ public:
+  typedef std::function<void(const std::vector<uint64_t>&,
+                             const std::vector<std::shared_ptr<Expr> >&)> Visitor;
+
+  // If |dedupe| is set, only the first program of each dedupe key is kept.
+  // The programs of the same key must have the same outputs.
+  ExternalCluster(const std::vector<uint64_t>& input, std::size_t budget_bytes,
+                  const std::string& spill_dir, bool dedupe)
+      : input_(input), budget_bytes_(budget_bytes), dedupe_(dedupe),
+        bytes_(0), seq_(0), spilled_bytes_(0), spill_sec_(0) {
+    std::string pattern = spill_dir + "/spill-XXXXXX";
+    CHECK(mkdtemp(&pattern[0])) << "Failed to create a dir in " << spill_dir;
+    dir_ = pattern;
+  }
+
+  ~ExternalCluster() {
+    for (const std::string& path : runs_)
+      unlink(path.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  void Add(const std::shared_ptr<Expr>& e, const std::string& dedupe_key) {
+    // The keys since the last spill skip the evaluation of the duplicates;
+    // the older ones are deduped by the merge.
+    if (dedupe_) {
+      if (!keys_.insert(dedupe_key).second)
+        return;
+      bytes_ += dedupe_key.size() + kKeyOverhead;
+    }
+    std::vector<uint64_t> signature(input_.size());
+    for (std::size_t i = 0; i < input_.size(); ++i)
+      signature[i] = Eval(*e, input_[i]);
+    std::string code;
+    EncodeDumpExpr(*e, &code);
+
+    std::vector<RunRecord>& records = cluster_[signature];
+    if (records.empty())
+      bytes_ += signature.size() * sizeof(uint64_t) + kClusterOverhead;
+    bytes_ += sizeof(RunRecord) + dedupe_key.size() + code.size();
+    records.push_back(RunRecord { 0, seq_++, dedupe_key, code });
+    if (bytes_ > budget_bytes_)
+      Spill();
+  }
+
+  // Calls |visitor| for each cluster in signature order, with its programs in
+  // the order they were added. Returns the number of the programs visited.
+  std::size_t ForEachCluster(Visitor visitor) {
+    std::size_t num_programs = 0;
+    auto visit = [&](const std::vector<uint64_t>& signature,
+                     const std::vector<RunRecord>& records) {
+      std::vector<std::shared_ptr<Expr> > programs;
+      programs.reserve(records.size());
+      for (const RunRecord& record : records) {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(record.program.data());
+        programs.push_back(DecodeDumpExpr(&p, p + record.program.size()));
+        CHECK(programs.back()) << "Broken spilled program";
+      }
+      num_programs += programs.size();
+      visitor(signature, programs);
+    };
+
+    if (runs_.empty()) {
+      for (auto iter = cluster_.begin(); iter != cluster_.end(); ++iter)
+        visit(iter->first, Dedupe(&iter->second));
+      return num_programs;
+    }
+
+    Spill();
+    auto start = std::chrono::steady_clock::now();
+    std::vector<RunInput> inputs(runs_.size());
+    for (std::size_t i = 0; i < runs_.size(); ++i) {
+      inputs[i].fp = fopen(runs_[i].c_str(), "rb");
+      CHECK(inputs[i].fp) << "Failed to open " << runs_[i];
+      ReadRunCluster(&inputs[i]);
+    }
+    MergeRunClusters(&inputs, dedupe_, visit);
+    for (RunInput& input : inputs)
+      fclose(input.fp);
+    double merge_sec = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    LOG(INFO) << "Spilled " << runs_.size() << " runs, " << (spilled_bytes_ >> 20)
+              << " MB in " << spill_sec_ << " s ("
+              << (spilled_bytes_ >> 20) / std::max(spill_sec_, 1e-3) << " MB/s); merged in "
+              << merge_sec << " s (" << (spilled_bytes_ >> 20) / std::max(merge_sec, 1e-3)
+              << " MB/s)";
+    return num_programs;
+  }
+
+ private:
+  // The approximate memory of a map node and an empty record vector, and of
+  // a hash set node.
+  static const std::size_t kClusterOverhead = 96;
+  static const std::size_t kKeyOverhead = 64;
+
+  const std::vector<RunRecord>& Dedupe(std::vector<RunRecord>* records) {
+    if (dedupe_) {
+      std::set<std::string> known;
+      std::vector<RunRecord> unique;
+      for (RunRecord& record : *records)
+        if (known.insert(record.key).second)
+          unique.push_back(std::move(record));
+      records->swap(unique);
+    }
+    return *records;
+  }
+
+  // Writes the clusters in memory as a new run.
+  void Spill() {
+    if (cluster_.empty())
+      return;
+    auto start = std::chrono::steady_clock::now();
+    runs_.push_back(dir_ + "/run-" + std::to_string(runs_.size()));
+    FILE* fp = fopen(runs_.back().c_str(), "wb");
+    CHECK(fp) << "Failed to open " << runs_.back();
+    for (auto iter = cluster_.begin(); iter != cluster_.end(); ++iter) {
+      const std::vector<RunRecord>& records = Dedupe(&iter->second);
+      WriteRunU64s(fp, iter->first);
+      WriteRunU64s(fp, { records.size() });
+      for (const RunRecord& record : records)
+        WriteRunRecord(fp, record);
+    }
+    spilled_bytes_ += ftell(fp);
+    CHECK(fclose(fp) == 0) << "Failed to write " << runs_.back();
+    cluster_.clear();
+    keys_.clear();
+    bytes_ = 0;
+    spill_sec_ += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+
+  const std::vector<uint64_t> input_;
+  const std::size_t budget_bytes_;
+  const bool dedupe_;
+  std::string dir_;
+  std::map<std::vector<uint64_t>, std::vector<RunRecord> > cluster_;
+  std::unordered_set<std::string> keys_;
+  std::size_t bytes_;
+  uint64_t seq_;
+  std::vector<std::string> runs_;
+  uint64_t spilled_bytes_;
+  double spill_sec_;
+
+  DISALLOW_COPY_AND_ASSIGN(ExternalCluster);
+};
+
+}  // namespace icfpc
+
+#endif  // ICFPC_EXTERNAL_CLUSTER_H_
@@ -0,0 +1,215 @@
+#ifndef ICFPC_FOLD_BODY_TABLE_H_
+#define ICFPC_FOLD_BODY_TABLE_H_
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cluster_dump.h"
+#include "eugeo.h"
+#include "expr.h"
+#include "util.h"
+
+namespace icfpc {
+
+// The fold bodies of PreComputeTable() (eugeo.h), either listed in memory or
+// memory-mapped from a file, so that alice does not list them again on every
+// start and the concurrent alices share the pages. All the numbers are uint64
+// in the host (little-endian) byte order:
+//
+//   "icfpfbt1", version, max_size, num_bodies
+//   size_begin[max_size + 2]       index of the first body of each size
+//   program_begin[num_bodies + 1]  byte offset of a body in the code
+//   op_type_set[num_bodies]        the operators used in a body
+//   code                           the bodies, encoded as in cluster_dump.h
+//
+// A file of another version or max_size is stale, and is built again.
+const char kFoldBodyTableMagic[] = "icfpfbt1";
+// Bump when PreComputeTable() lists other bodies.
+const uint64_t kFoldBodyTableVersion = 2;
+
+class FoldBodyTable {
+ public:
+  FoldBodyTable() : data_(nullptr), size_(0), max_size_(0), num_bodies_(0) {
+  }
+
+  ~FoldBodyTable() {
+    Unmap();
+  }
+
+  // Lists the bodies in memory, as ListFoldBody() does.
+  void Build(std::size_t max_size) {
+    Unmap();
+    bodies_ = PreComputeTable(max_size);
+    decoded_.assign(bodies_.size(), true);
+    max_size_ = max_size;
+  }
+
+  // Maps the table at |path|, building and writing it first if it is missing
+  // or stale.
+  void Open(const std::string& path, std::size_t max_size) {
+    if (Map(path, max_size)) {
+      LOG(INFO) << "Mapped " << num_bodies_ << " fold bodies from " << path;
+      return;
+    }
+    LOG(INFO) << path << " is missing or stale. Building it.";
+    CHECK(Write(path, max_size, PreComputeTable(max_size))) << "Failed to write " << path;
+    CHECK(Map(path, max_size)) << "Broken " << path;
+  }
+
+  std::size_t max_size() const { return max_size_; }
+
+  // The number of the bodies of |size|.
+  std::size_t num_bodies(std::size_t size) const {
+    if (!data_)
+      return bodies_[size].size();
+    return size_begin()[size + 1] - size_begin()[size];
+  }
+
+  // Returns the |i|-th body of |size|. The mapped ones are decoded on every
+  // call, and not kept in memory.
+  std::shared_ptr<Expr> body(std::size_t size, std::size_t i) const {
+    if (decoded_[size])
+      return bodies_[size][i];
+    std::size_t index = size_begin()[size] + i;
+    const uint8_t* p = code() + program_begin()[index];
+    std::shared_ptr<Expr> e = DecodeDumpExpr(&p, code() + program_begin()[index + 1]);
+    CHECK(e) << "Broken fold body table";
+    return e;
+  }
+
+  int op_type_set(std::size_t size, std::size_t i) const {
+    if (!data_)
+      return bodies_[size][i]->op_type_set();
+    return op_type_sets()[size_begin()[size] + i];
+  }
+
+  // Returns all the bodies of |size|, decoding them on the first call.
+  const std::vector<std::shared_ptr<Expr> >& bodies(std::size_t size) {
+    if (!decoded_[size]) {
+      for (std::size_t i = 0; i < num_bodies(size); ++i)
+        bodies_[size].push_back(body(size, i));
+      decoded_[size] = true;
+    }
+    return bodies_[size];
+  }
+
+ private:
+  static const std::size_t kHeaderWords = 4;
+
+  // Writes |table| to |path|. The file is renamed into place, so that
+  // concurrent readers never see a partial one.
+  static bool Write(const std::string& path, std::size_t max_size,
+                    const std::vector<std::vector<std::shared_ptr<Expr> > >& table) {
+    std::vector<uint64_t> size_begin(1, 0), program_begin(1, 0), op_type_sets;
+    std::string code;
+    for (std::size_t size = 0; size <= max_size; ++size) {
+      for (const std::shared_ptr<Expr>& e : table[size]) {
+        EncodeDumpExpr(*e, &code);
+        program_begin.push_back(code.size());
+        op_type_sets.push_back(e->op_type_set());
+      }
+      size_begin.push_back(op_type_sets.size());
+    }
+    uint64_t header[kHeaderWords - 1] = {
+      kFoldBodyTableVersion, max_size, op_type_sets.size()
+    };
+
+    std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    if (!fp)
+      return false;
+    fwrite(kFoldBodyTableMagic, 1, 8, fp);
+    fwrite(header, sizeof(uint64_t), kHeaderWords - 1, fp);
+    fwrite(size_begin.data(), sizeof(uint64_t), size_begin.size(), fp);
+    fwrite(program_begin.data(), sizeof(uint64_t), program_begin.size(), fp);
+    fwrite(op_type_sets.data(), sizeof(uint64_t), op_type_sets.size(), fp);
+    fwrite(code.data(), 1, code.size(), fp);
+    bool ok = !ferror(fp);
+    if (fclose(fp) != 0 || !ok) {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+    return rename(tmp_path.c_str(), path.c_str()) == 0;
+  }
+
+  // Maps the table at |path|. Returns false if it is missing, broken or stale.
+  bool Map(const std::string& path, std::size_t max_size) {
+    Unmap();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = static_cast<const uint8_t*>(data);
+        size_ = st.st_size;
+      }
+    }
+    close(fd);
+    if (!data_ || !Validate(max_size)) {
+      Unmap();
+      return false;
+    }
+    max_size_ = max_size;
+    bodies_.assign(max_size + 1, std::vector<std::shared_ptr<Expr> >());
+    decoded_.assign(max_size + 1, false);
+    return true;
+  }
+
+  void Unmap() {
+    if (data_)
+      munmap(const_cast<uint8_t*>(data_), size_);
+    data_ = nullptr;
+    size_ = 0;
+    num_bodies_ = 0;
+    bodies_.clear();
+    decoded_.clear();
+  }
+
+  const uint64_t* words() const { return reinterpret_cast<const uint64_t*>(data_); }
+  const uint64_t* size_begin() const { return words() + kHeaderWords; }
+  const uint64_t* program_begin() const { return size_begin() + max_size_ + 2; }
+  const uint64_t* op_type_sets() const { return program_begin() + num_bodies_ + 1; }
+  const uint8_t* code() const {
+    return reinterpret_cast<const uint8_t*>(op_type_sets() + num_bodies_);
+  }
+
+  bool Validate(std::size_t max_size) {
+    if (size_ < kHeaderWords * sizeof(uint64_t) || memcmp(data_, kFoldBodyTableMagic, 8) != 0)
+      return false;
+    if (words()[1] != kFoldBodyTableVersion || words()[2] != max_size)
+      return false;
+    max_size_ = max_size;
+    num_bodies_ = words()[3];
+    std::size_t num_words = kHeaderWords + max_size + 2 + 2 * num_bodies_ + 1;
+    if (num_bodies_ > size_ / sizeof(uint64_t) || size_ < num_words * sizeof(uint64_t))
+      return false;
+    std::size_t code_size = size_ - num_words * sizeof(uint64_t);
+    return size_begin()[max_size + 1] == num_bodies_ &&
+        program_begin()[num_bodies_] == code_size;
+  }
+
+  const uint8_t* data_;
+  std::size_t size_;
+  std::size_t max_size_;
+  std::size_t num_bodies_;
+  // The decoded bodies of each size, if decoded_[size].
+  std::vector<std::vector<std::shared_ptr<Expr> > > bodies_;
+  std::vector<bool> decoded_;
+
+  DISALLOW_COPY_AND_ASSIGN(FoldBodyTable);
+};
+
+}  // namespace icfpc
+
+#endif  // ICFPC_FOLD_BODY_TABLE_H_
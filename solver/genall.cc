@@ -3,12 +3,17 @@
 
 #include "expr.h"
 #include "expr_list.h"
+#include "run_file.h"
+#include "util.h"
 
 using namespace icfpc;
 
 DEFINE_int32(size, -1, "Size of the expression");
 DEFINE_string(operators, "", "List of the operators");
+DEFINE_int32(threads, 1, "Number of threads to enumerate expressions");
 DEFINE_bool(simplifyeach, false, "Do simplification each step");
+DEFINE_string(shard, "", "k/N: generate only the k-th of N slices into --run_file");
+DEFINE_string(run_file, "", "Output of --shard, to be merged by the merge tool");
 
 int main(int argc, char* argv[]) {
   google::InstallFailureSignalHandler();
@@ -20,11 +25,41 @@ int main(int argc, char* argv[]) {
   CHECK(!FLAGS_operators.empty()) << "--operators should be specified";
 
   int op_type_set = ParseOpTypeSet(FLAGS_operators);
+  GenAllSimplifyMode mode = FLAGS_simplifyeach ? SIMPLIFY_EACH_STEP : NO_SIMPLIFY;
 
-  std::vector<std::shared_ptr<Expr> > result =
-      ListExpr(FLAGS_size, op_type_set, FLAGS_simplifyeach ? SIMPLIFY_EACH_STEP : NO_SIMPLIFY);
-  for (const std::shared_ptr<Expr>& e : result) {
-    std::cout << *e << std::endl;
+  std::size_t num_exprs;
+  if (FLAGS_shard.empty()) {
+    // Print each program as soon as it is generated.
+    num_exprs = ForEachExpr(
+        FLAGS_size, op_type_set, mode,
+        [](const std::shared_ptr<Expr>& e) { std::cout << *e << "\n"; },
+        FLAGS_threads);
+    std::cout << std::flush;
+  } else {
+    ExprShard shard;
+    CHECK(ParseShard(FLAGS_shard, &shard)) << "--shard should be k/N";
+    CHECK(!FLAGS_run_file.empty()) << "--run_file should be specified";
+    FILE* fp = fopen(FLAGS_run_file.c_str(), "wb");
+    CHECK(fp) << "Failed to open " << FLAGS_run_file;
+    WriteRunHeader(fp, RunHeader {
+        PROGRAM_RUN, mode == SIMPLIFY_EACH_STEP, static_cast<uint32_t>(shard.index),
+        static_cast<uint32_t>(shard.num_shards) });
+    RunRecord record { ~0ULL, 0, "", "" };
+    num_exprs = ForEachExpr(
+        FLAGS_size, op_type_set, mode,
+        [&](const std::shared_ptr<Expr>& e) {
+          // Numbers the programs in each group.
+          record.seq = (record.group == shard.group ? record.seq + 1 : 0);
+          record.group = shard.group;
+          if (mode == SIMPLIFY_EACH_STEP)
+            record.key = RunDedupeKey(e, op_type_set, mode);
+          record.program = e->ToString();
+          WriteRunRecord(fp, record);
+        },
+        FLAGS_threads, "", &shard);
+    CHECK(fclose(fp) == 0) << "Failed to write " << FLAGS_run_file;
   }
+  LOG(INFO) << "SIZE[GEN] " << num_exprs;
+  LOG(INFO) << "Peak RSS: " << GetPeakRssKb() << " KB";
   return 0;
 }
@@ -1,9 +1,20 @@
+#include <ftw.h>
+#include <stdio.h>
+
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include <map>
+#include <set>
+#include <string>
+
+#include "cluster.h"
 #include "expr.h"
 #include "expr_list.h"
 #include "expr_list_naive_for_testing.h"
+#include "plan.h"
+#include "run_file.h"
+#include "sampler.h"
 
 using namespace icfpc;
 
@@ -77,9 +88,258 @@ TEST(GenAllTest, G) {
     ASSERT_TRUE(result[i]->EqualTo(*result_old[i]));
 }
 
+TEST(GenAllTest, FoldConflict) {
+  // A fold conflict between two operands must skip only that pair, not the
+  // rest of the operand list. These if0s come after else-branches that
+  // conflict with the fold condition, and the naive enumeration has them.
+  int size = 11;
+  int op_type_set = ParseOpTypeSet("and,if0,fold");
+  std::set<std::string> programs, programs_old;
+  for (auto& e : ListExpr(size, op_type_set, NO_SIMPLIFY))
+    programs.insert(e->ToString());
+  for (auto& e : old::ListExpr(size, op_type_set))
+    programs_old.insert(e->ToString());
+  for (const char* program : {
+           "(lambda (x) (if0 (fold 0 0 (lambda (y z) 0)) 0 (and x 1)))",
+           "(lambda (x) (if0 (fold 0 0 (lambda (y z) 0)) x (and 1 x)))"}) {
+    EXPECT_TRUE(programs_old.count(program)) << program;
+    EXPECT_TRUE(programs.count(program)) << program;
+  }
+}
+
+TEST(GenAllTest, Threads) {
+  int size = 10;
+  int op_type_set = ParseOpTypeSet("not,if0,fold,plus");
+  for (GenAllSimplifyMode mode : {NO_SIMPLIFY, GLOBAL_SIMPLIFY}) {
+    std::vector<std::shared_ptr<Expr> > result = ListExpr(size, op_type_set, mode, 4);
+    std::vector<std::shared_ptr<Expr> > result_serial = ListExpr(size, op_type_set, mode, 1);
+    EXPECT_EQ(result_serial.size(), result.size());
+    for (size_t i = 0; i < result.size(); ++i)
+      ASSERT_TRUE(result[i]->EqualTo(*result_serial[i]));
+  }
+}
+
+TEST(ThreadPoolTest, ConsumesInOrder) {
+  ThreadPool pool(3);
+  // Reused, and stopped by consume().
+  for (std::size_t stop : { 2000, 500 }) {
+    std::vector<std::size_t> produced(1000, 0), consumed;
+    std::size_t num_consumed = pool.RunOrdered(
+        produced.size(), 8,
+        [&](std::size_t i) { produced[i] = i + 1; },
+        [&](std::size_t i) {
+          EXPECT_EQ(i + 1, produced[i]);
+          consumed.push_back(i);
+          return i + 1 < stop;
+        });
+    EXPECT_EQ(stop < 1000 ? stop - 1 : 1000, num_consumed);
+    ASSERT_EQ(std::min<std::size_t>(stop, 1000), consumed.size());
+    for (std::size_t i = 0; i < consumed.size(); ++i)
+      EXPECT_EQ(i, consumed[i]);
+    // Nothing is started further than the window past the stop.
+    for (std::size_t i = stop + 8; i < produced.size(); ++i)
+      EXPECT_EQ(0U, produced[i]);
+  }
+}
+
+TEST(GenAllTest, Observational) {
+  int size = 8;
+  int op_type_set = ParseOpTypeSet("not,shr1,xor,if0");
+  std::vector<uint64_t> key = CreateKey();
+  auto global = CreateCluster(key, ListExpr(size, op_type_set, GLOBAL_SIMPLIFY));
+  std::vector<std::shared_ptr<Expr> > result = ListExpr(size, op_type_set, OBSERVATIONAL);
+  auto observational = CreateCluster(key, result);
+  std::vector<std::shared_ptr<Expr> > member_list =
+      ListExpr(size, op_type_set, OBSERVATIONAL_KEEP_MEMBERS);
+  auto members = CreateCluster(key, member_list);
+
+  // One program per cluster, and the same clusters as the exact dedupe.
+  EXPECT_EQ(observational.size(), result.size());
+  ASSERT_EQ(global.size(), observational.size());
+  ASSERT_EQ(global.size(), members.size());
+  auto it = observational.begin();
+  auto member_it = members.begin();
+  for (auto& cluster : global) {
+    EXPECT_TRUE(cluster.first == it->first);
+    EXPECT_TRUE(cluster.first == member_it->first);
+    EXPECT_TRUE(it->second[0]->EqualTo(*member_it->second[0]));
+    ++it;
+    ++member_it;
+  }
+
+  // The members include the redundant forms, which the canonical-form
+  // generation skips.
+  std::set<std::string> member_programs;
+  for (auto& e : member_list)
+    member_programs.insert(e->ToString());
+  EXPECT_TRUE(member_programs.count("(lambda (x) (not (not x)))"));
+  EXPECT_TRUE(member_programs.count("(lambda (x) (xor x x))"));
+}
+
+TEST(GenAllTest, Canonical) {
+  // Every function the naive enumeration reaches must survive the
+  // canonical-form generation used by GLOBAL_SIMPLIFY.
+  int size = 8;
+  std::vector<uint64_t> key = CreateKey();
+  for (const char* operators : {"not,shl1,and,plus", "shr1,xor,if0", "or,shr4,fold"}) {
+    int op_type_set = ParseOpTypeSet(operators);
+    auto cluster = CreateCluster(key, ListExpr(size, op_type_set, GLOBAL_SIMPLIFY));
+    for (int s = 3; s <= size; ++s) {
+      for (auto& e : old::ListExpr(s, op_type_set)) {
+        std::vector<uint64_t> outputs;
+        for (uint64_t x : key)
+          outputs.push_back(Eval(*e, x));
+        EXPECT_TRUE(cluster.count(outputs)) << *e;
+      }
+    }
+  }
+}
+
+namespace {
+
+int RemoveEntry(const char* path, const struct stat*, int, struct FTW*) {
+  return remove(path);
+}
+
+// Removes |path| and everything in it, without following symlinks.
+int RemoveTree(const char* path) {
+  return nftw(path, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+}  // namespace
+
+TEST(GenAllTest, TableCache) {
+  // The tables cached for a subset of the operators and for the same set
+  // must lead to the same functions as the enumeration from scratch.
+  char dir[] = "/tmp/genall_unittest.XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != nullptr);
+  std::vector<uint64_t> key = CreateKey();
+  for (GenAllSimplifyMode mode : {GLOBAL_SIMPLIFY, OBSERVATIONAL}) {
+    ListExpr(9, ParseOpTypeSet("not,and"), mode, 1, dir);
+    int op_type_set = ParseOpTypeSet("not,shl1,and,plus,fold");
+    auto expected = CreateCluster(key, ListExpr(10, op_type_set, mode));
+    auto incremental = CreateCluster(key, ListExpr(10, op_type_set, mode, 1, dir));
+    auto cached = CreateCluster(key, ListExpr(10, op_type_set, mode, 1, dir));
+    EXPECT_EQ(expected.size(), incremental.size());
+    EXPECT_EQ(expected.size(), cached.size());
+    for (auto& cluster : expected) {
+      EXPECT_TRUE(incremental.count(cluster.first)) << *cluster.second[0];
+      EXPECT_TRUE(cached.count(cluster.first)) << *cluster.second[0];
+    }
+  }
+  ASSERT_EQ(0, RemoveTree(dir));
+}
+
+TEST(GenAllTest, ShardedObservational) {
+  // The merged shards of the observational simplify_main output what the
+  // unsharded run does, also with the TFOLD bodies which only differ in z.
+  int size = 10;
+  int op_type_set = ParseOpTypeSet("tfold,not,shl1,xor,plus");
+  std::vector<uint64_t> key = CreateKey();
+  auto expected = CreateCluster(key, ListExpr(size, op_type_set, OBSERVATIONAL));
+
+  const int kNumShards = 3;
+  std::vector<RunInput> inputs;
+  for (int k = 0; k < kNumShards; ++k) {
+    // As simplify_main --shard=k/N writes its run file.
+    ExprShard shard = { k, kNumShards, 0 };
+    std::map<const Expr*, std::pair<uint64_t, uint64_t> > positions;
+    std::pair<uint64_t, uint64_t> position(~0ULL, 0);
+    std::vector<std::shared_ptr<Expr> > result;
+    ForEachExpr(size, op_type_set, OBSERVATIONAL, [&](const std::shared_ptr<Expr>& e) {
+      position.second = (position.first == shard.group ? position.second + 1 : 0);
+      position.first = shard.group;
+      positions[e.get()] = position;
+      result.push_back(e);
+    }, 1, "", &shard);
+
+    RunInput input;
+    input.fp = tmpfile();
+    ASSERT_TRUE(input.fp != nullptr);
+    WriteRunHeader(input.fp, RunHeader { CLUSTER_RUN, 1, static_cast<uint32_t>(k), kNumShards });
+    WriteRunU64s(input.fp, key);
+    for (auto& cluster : CreateCluster(key, result)) {
+      WriteRunU64s(input.fp, cluster.first);
+      WriteRunU64s(input.fp, { cluster.second.size() });
+      for (const std::shared_ptr<Expr>& e : cluster.second)
+        WriteRunRecord(input.fp, RunRecord {
+            positions[e.get()].first, positions[e.get()].second,
+            RunDedupeKey(e, op_type_set, OBSERVATIONAL), e->ToString() });
+    }
+    rewind(input.fp);
+    std::vector<uint64_t> argument;
+    ASSERT_TRUE(ReadRunHeader(input.fp, &input.header));
+    ASSERT_TRUE(ReadRunU64s(input.fp, kSignatureSize, &argument));
+    ReadRunCluster(&input);
+    inputs.push_back(input);
+  }
+
+  auto iter = expected.cbegin();
+  MergeRunClusters(&inputs, true, [&](const std::vector<uint64_t>& signature,
+                                      const std::vector<RunRecord>& records) {
+    ASSERT_TRUE(iter != expected.cend());
+    EXPECT_TRUE(iter->first == signature);
+    ASSERT_EQ(iter->second.size(), records.size()) << *iter->second[0];
+    for (std::size_t i = 0; i < records.size(); ++i)
+      EXPECT_EQ(iter->second[i]->ToString(), records[i].program);
+    ++iter;
+  });
+  EXPECT_TRUE(iter == expected.cend());
+  for (RunInput& input : inputs)
+    fclose(input.fp);
+}
+
 int main(int argc, char **argv) {
   google::InstallFailureSignalHandler();
   google::InitGoogleLogging(argv[0]);
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
 }
+
+TEST(PlanTest, SameAsForEachExpr) {
+  const std::pair<int, const char*> kProblems[] = {
+    { 8, "not,shr4,and,plus" },
+    { 10, "not,if0,fold,plus" },
+    { 10, "shl1,if0,tfold" },
+    { 11, "or,shr1,if0,tfold" },
+    { 12, "shr16,xor,fold" },
+  };
+  for (const auto& problem : kProblems) {
+    int op_type_set = ParseOpTypeSet(problem.second);
+    std::size_t num_programs =
+        ForEachExpr(problem.first, op_type_set, NO_SIMPLIFY, [](const std::shared_ptr<Expr>&) {});
+    ExprPlan plan = PlanExprList(problem.first, op_type_set, NO_SIMPLIFY);
+    EXPECT_TRUE(plan.exact);
+    EXPECT_EQ(num_programs, plan.programs) << problem.first << " " << problem.second;
+
+    // The other modes are bounded from above.
+    std::size_t num_simplified = ForEachExpr(
+        problem.first, op_type_set, GLOBAL_SIMPLIFY, [](const std::shared_ptr<Expr>&) {});
+    plan = PlanExprList(problem.first, op_type_set, GLOBAL_SIMPLIFY);
+    EXPECT_FALSE(plan.exact);
+    EXPECT_LE(num_simplified, plan.programs) << problem.first << " " << problem.second;
+  }
+}
+
+TEST(SamplerTest, SamplesEnumeratedPrograms) {
+  const std::pair<int, const char*> kProblems[] = {
+    { 8, "not,shr4,and,plus" },
+    { 10, "not,fold,plus" },
+    { 12, "or,shr1,if0,tfold" },
+  };
+  for (const auto& problem : kProblems) {
+    int op_type_set = ParseOpTypeSet(problem.second);
+    std::set<std::string> programs;
+    ForEachExpr(problem.first, op_type_set, NO_SIMPLIFY, [&programs](const std::shared_ptr<Expr>& e) {
+      programs.insert(e->ToString());
+    });
+    ASSERT_LT(0U, programs.size());
+    ProgramSampler sampler(problem.first, op_type_set, false, 178);
+    EXPECT_EQ(programs.size(), sampler.num_programs()) << problem.first << " " << problem.second;
+    for (int i = 0; i < 100; ++i) {
+      std::shared_ptr<Expr> e = sampler.Sample();
+      EXPECT_EQ(static_cast<std::size_t>(problem.first), e->depth());
+      EXPECT_EQ(1U, programs.count(e->ToString())) << *e;
+    }
+  }
+}
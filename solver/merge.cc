@@ -0,0 +1,104 @@
+#include <stdio.h>
+
+#include <algorithm>
+#include <iostream>
+#include <queue>
+#include <set>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "run_file.h"
+#include "util.h"
+
+using namespace icfpc;
+
+// Merges the run files of all the shards of genall or simplify_main
+// --shard=k/N, and prints what the unsharded run prints.
+// Usage: merge <run file>...
+
+void MergePrograms(std::vector<RunInput>* inputs) {
+  // Min-heap of the head record of each input.
+  typedef std::pair<RunRecord, std::size_t> Head;
+  auto greater = [](const Head& a, const Head& b) { return b.first < a.first; };
+  std::priority_queue<Head, std::vector<Head>, decltype(greater)> heads(greater);
+  for (std::size_t i = 0; i < inputs->size(); ++i) {
+    RunRecord record;
+    if (ReadRunRecord((*inputs)[i].fp, &record))
+      heads.push(Head(record, i));
+  }
+
+  bool dedupe = (*inputs)[0].header.dedupe;
+  std::set<std::string> known;
+  while (!heads.empty()) {
+    Head head = heads.top();
+    heads.pop();
+    if (!dedupe || known.insert(head.first.key).second)
+      std::cout << head.first.program << "\n";
+    RunRecord record;
+    if (ReadRunRecord((*inputs)[head.second].fp, &record))
+      heads.push(Head(record, head.second));
+  }
+}
+
+void MergeClusters(std::vector<RunInput>* inputs) {
+  std::vector<uint64_t> key;
+  for (RunInput& input : *inputs) {
+    std::vector<uint64_t> argument;
+    CHECK(ReadRunU64s(input.fp, kSignatureSize, &argument)) << "Broken run file";
+    CHECK(key.empty() || key == argument) << "The run files have different arguments";
+    key = argument;
+    ReadRunCluster(&input);
+  }
+  std::cout << "argument: ";
+  PrintCollection(&std::cout, key, ",");
+  std::cout << "\n";
+
+  MergeRunClusters(inputs, (*inputs)[0].header.dedupe,
+                   [](const std::vector<uint64_t>& signature,
+                      const std::vector<RunRecord>& records) {
+                     std::cout << "expected: ";
+                     PrintCollection(&std::cout, signature, ",");
+                     std::cout << "\n";
+                     for (const RunRecord& record : records)
+                       std::cout << record.program << "\n";
+                   });
+}
+
+int main(int argc, char* argv[]) {
+  google::InstallFailureSignalHandler();
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  std::ios::sync_with_stdio(false);
+
+  CHECK(argc >= 2) << "Usage: merge <run file>...";
+  std::vector<RunInput> inputs;
+  std::set<uint32_t> shards;
+  for (int i = 1; i < argc; ++i) {
+    RunInput input;
+    input.fp = fopen(argv[i], "rb");
+    CHECK(input.fp) << "Failed to open " << argv[i];
+    CHECK(ReadRunHeader(input.fp, &input.header)) << "Not a run file: " << argv[i];
+    if (!inputs.empty()) {
+      CHECK(input.header.kind == inputs[0].header.kind &&
+            input.header.dedupe == inputs[0].header.dedupe &&
+            input.header.num_shards == inputs[0].header.num_shards)
+          << argv[i] << " is from another run";
+    }
+    CHECK(shards.insert(input.header.shard_index).second)
+        << "Shard " << input.header.shard_index << " is given twice";
+    inputs.push_back(input);
+  }
+  CHECK(shards.size() == inputs[0].header.num_shards)
+      << "Only " << shards.size() << " of " << inputs[0].header.num_shards << " shards";
+
+  if (inputs[0].header.kind == PROGRAM_RUN)
+    MergePrograms(&inputs);
+  else
+    MergeClusters(&inputs);
+  std::cout << std::flush;
+
+  for (RunInput& input : inputs)
+    fclose(input.fp);
+  return 0;
+}
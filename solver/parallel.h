@@ -0,0 +1,139 @@
+#ifndef ICFPC_PARALLEL_H_
+#define ICFPC_PARALLEL_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "expr.h"
+
+namespace icfpc {
+
+// Returns |num_threads|, but no more than the hardware runs at once. More
+// threads only slow the composition down, as the shared_ptr's are counted
+// atomically as soon as there are two threads.
+inline int HardwareThreads(int num_threads) {
+  int hardware = std::thread::hardware_concurrency();
+  return hardware > 0 ? std::min(num_threads, hardware) : num_threads;
+}
+
+// Threads kept across the RunOrdered() calls, so that they are not started
+// for each batch of tasks. RunOrdered() must not be called concurrently.
+class ThreadPool {
+ public:
+  // Starts |num_threads| - 1 threads. The thread calling RunOrdered() is the
+  // other one.
+  explicit ThreadPool(int num_threads)
+      : job_(nullptr), done_(nullptr), next_(0), end_(0), num_running_(0), quit_(false) {
+    for (int t = 1; t < num_threads; ++t)
+      threads_.emplace_back([this]() { Work(); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    work_cond_.notify_all();
+    for (auto& thread : threads_)
+      thread.join();
+  }
+
+  int num_threads() const { return threads_.size() + 1; }
+
+  // Runs fn(0), ..., fn(num_tasks - 1) on the threads, and returns when all
+  // have returned.
+  template<typename Fn>
+  void ParallelFor(std::size_t num_tasks, Fn fn) {
+    RunOrdered(num_tasks, num_tasks, fn, [](std::size_t) { return true; });
+  }
+
+  // Runs produce(0), ..., produce(num_tasks - 1) on the threads, and
+  // consume(i) on the calling thread in the order of i, each after produce(i)
+  // has returned. The threads go on with the next tasks while consume() runs,
+  // up to |window| tasks past the one consumed, so that at most |window|
+  // results are held. The calling thread runs the tasks too while it waits.
+  // Stops starting the tasks once consume() returns false, and returns the
+  // number of the tasks for which it returned true.
+  template<typename Produce, typename Consume>
+  std::size_t RunOrdered(std::size_t num_tasks, std::size_t window, Produce produce,
+                         Consume consume) {
+    std::function<void(std::size_t)> job = produce;
+    std::vector<char> done(num_tasks, false);
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_ = &job;
+    done_ = &done;
+    next_ = 0;
+    end_ = std::min(num_tasks, std::max<std::size_t>(window, 1));
+    work_cond_.notify_all();
+
+    std::size_t i = 0;
+    for (; i < num_tasks; ++i) {
+      while (!done[i]) {
+        if (next_ < end_)
+          RunNext(&lock);
+        else
+          done_cond_.wait(lock);
+      }
+      lock.unlock();
+      bool ok = consume(i);
+      lock.lock();
+      if (!ok)
+        break;
+      end_ = std::min(num_tasks, i + 1 + std::max<std::size_t>(window, 1));
+      work_cond_.notify_all();
+    }
+
+    // The running tasks use |job| and |done| until they return.
+    end_ = next_;
+    done_cond_.wait(lock, [this]() { return num_running_ == 0; });
+    job_ = nullptr;
+    done_ = nullptr;
+    return i;
+  }
+
+ private:
+  // Runs the next task with |lock| released.
+  void RunNext(std::unique_lock<std::mutex>* lock) {
+    std::size_t i = next_++;
+    std::function<void(std::size_t)>* job = job_;
+    std::vector<char>* done = done_;
+    ++num_running_;
+    lock->unlock();
+    (*job)(i);
+    lock->lock();
+    (*done)[i] = true;
+    --num_running_;
+    done_cond_.notify_all();
+  }
+
+  void Work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      work_cond_.wait(lock, [this]() { return quit_ || (job_ && next_ < end_); });
+      if (quit_)
+        return;
+      RunNext(&lock);
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable work_cond_;  // a task to start, or quit
+  std::condition_variable done_cond_;  // a task has returned
+  std::function<void(std::size_t)>* job_;  // nullptr between RunOrdered()
+  std::vector<char>* done_;  // whether each task has returned
+  std::size_t next_;  // the first task not started
+  std::size_t end_;  // the tasks before this may be started
+  std::size_t num_running_;
+  bool quit_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
+}  // namespace icfpc
+
+#endif  // ICFPC_PARALLEL_H_
@@ -0,0 +1,88 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "expr.h"
+#include "expr_list.h"
+#include "plan.h"
+
+using namespace icfpc;
+
+// Predicts the number of the programs cluster_main (--simplify=no) or
+// simplify_main enumerates for a problem, and the memory and time it takes,
+// without enumerating them. Prints the counts of each size level and then
+//   programs: <count>
+//   exact: <true if the count is exact, false if an upper bound>
+//   memory_mb: <predicted peak RSS>
+//   time_sec: <predicted time>
+// The predictions are rough (within a factor of 2) estimates.
+
+DEFINE_int32(size, -1, "Size of the expression");
+DEFINE_string(operators, "", "List of the operators");
+DEFINE_string(simplify, "no", "{no,each,global,observational}: as simplify_main");
+DEFINE_int32(memory_budget_mb, 0, "--memory_budget_mb of simplify_main, if any");
+
+// Measured with cluster_main on 1-3M programs of size 11-15: a table node
+// with its shared_ptr, a clustered program, a string of the GLOBAL_SIMPLIFY
+// set, and the time to evaluate a node of a program on an argument.
+const double kBytesPerTableExpr = 150;
+const double kBytesPerProgram = 400;
+const double kBytesPerSimplifiedKey = 100;
+const double kBaseMb = 10;
+const double kNanosecPerNodeEval = 4.5;
+const double kKeySize = 256;  // CreateKey()
+// Fold bodies are evaluated 8 times.
+const double kFoldEvalFactor = 4;
+
+int main(int argc, char* argv[]) {
+  google::InstallFailureSignalHandler();
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  std::ios::sync_with_stdio(false);
+
+  CHECK(FLAGS_size >= 3) << "--size should be specified";
+  CHECK(!FLAGS_operators.empty()) << "--operators should be specified";
+  GenAllSimplifyMode mode =
+      FLAGS_simplify == "no" ? NO_SIMPLIFY :
+      FLAGS_simplify == "each" ? SIMPLIFY_EACH_STEP :
+      FLAGS_simplify == "global" ? GLOBAL_SIMPLIFY :
+      FLAGS_simplify == "observational" ? OBSERVATIONAL :
+      (LOG(FATAL) << "Unknown --simplify: " << FLAGS_simplify, NO_SIMPLIFY);
+
+  int op_type_set = ParseOpTypeSet(FLAGS_operators);
+  ExprPlan plan = PlanExprList(FLAGS_size, op_type_set, mode);
+
+  // The levels below the last one are held in memory; the last one is
+  // streamed into the clusters.
+  double table_exprs = 0, composed = 0;
+  for (std::size_t d = 1; d < plan.levels.size(); ++d) {
+    std::cout << "SIZE[" << d << "] composed " << plan.levels[d].composed
+              << " kept " << plan.levels[d].kept << "\n";
+    composed += plan.levels[d].composed;
+    if (d + 1 < plan.levels.size())
+      table_exprs += plan.levels[d].kept;
+  }
+
+  double cluster_mb = plan.programs * kBytesPerProgram / (1 << 20);
+  if (FLAGS_memory_budget_mb > 0)
+    cluster_mb = std::min<double>(cluster_mb, FLAGS_memory_budget_mb);
+  double table_mb = table_exprs * kBytesPerTableExpr / (1 << 20);
+  if (mode == GLOBAL_SIMPLIFY || mode == SIMPLIFY_EACH_STEP)
+    table_mb += (table_exprs + plan.programs) * kBytesPerSimplifiedKey / (1 << 20);
+
+  // Every program is evaluated on the key; OBSERVATIONAL evaluates every
+  // composed expression to tell if it is new.
+  double evaluated = plan.programs + (mode == OBSERVATIONAL ? composed : 0);
+  double eval_factor = (op_type_set & (OpType::FOLD | OpType::TFOLD)) ? kFoldEvalFactor : 1;
+  double time_sec = evaluated * kKeySize * FLAGS_size *
+      kNanosecPerNodeEval * eval_factor * 1e-9;
+
+  std::cout << "programs: " << plan.programs << "\n"
+            << "exact: " << (plan.exact ? "true" : "false") << "\n"
+            << "memory_mb: " << std::ceil(kBaseMb + table_mb + cluster_mb) << "\n"
+            << "time_sec: " << time_sec << "\n";
+  return 0;
+}
@@ -0,0 +1,246 @@
+#ifndef ICFPC_PLAN_H_
+#define ICFPC_PLAN_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "expr.h"
+#include "expr_list.h"
+
+namespace icfpc {
+
+// Counts what ForEachExpr() composes and emits for (depth, op_type_set, mode),
+// without composing any expression. The counting follows the composition
+// loops of VisitExprTask() and the prefilter of ForEachExpr(): the operand
+// size splits of unary/binary/if0/fold, the has_fold/in_fold restrictions,
+// the in_fold elements dropped near the top and the exact-operator-cover
+// pruning. The expressions are counted per class (see PlanClass) and per
+// subset of the operators they contain, and the subsets of the operands are
+// combined by the OR-convolution over the subset lattice.
+//
+// The counts are exact for NO_SIMPLIFY. The other modes deduplicate and drop
+// the redundant forms, which can not be counted without composing, so their
+// counts are upper bounds.
+struct ExprPlanLevel {
+  double composed;  // composed at the level, before the prefilter
+  double kept;      // kept in the table (or streamed, for the last level)
+};
+
+struct ExprPlan {
+  // levels[d] for d = 1 .. table_gen_limit; levels[0] is unused.
+  std::vector<ExprPlanLevel> levels;
+  double programs;  // emitted programs
+  bool exact;
+};
+
+// The classes of the expressions the composition rules tell apart.
+enum PlanClass { PLAN_PLAIN, PLAN_IN_FOLD, PLAN_HAS_FOLD, NUM_PLAN_CLASSES };
+
+// Returns the class of an expression composed from the operands of
+// |classes|, or -1 if VisitExprTask() does not compose it.
+int CombinePlanClasses(std::initializer_list<int> classes) {
+  int has_fold = 0, in_fold = 0;
+  for (int c : classes) {
+    has_fold += (c == PLAN_HAS_FOLD);
+    in_fold += (c == PLAN_IN_FOLD);
+  }
+  if (has_fold > 1 || (has_fold == 1 && in_fold > 0))
+    return -1;
+  return has_fold ? PLAN_HAS_FOLD : in_fold ? PLAN_IN_FOLD : PLAN_PLAIN;
+}
+
+ExprPlan PlanExprList(std::size_t depth, int op_type_set, GenAllSimplifyMode mode) {
+  // Counted modulo 2^128, and exact as long as the counts stay below that.
+  // |bound| tracks the totals in double to tell if they do not.
+  typedef unsigned __int128 Count;
+  const double kMaxExactCount = 1e36;
+
+  // The operators which may appear in the table, as the bits of the subsets.
+  std::vector<int> ops;
+  for (int op = OpType::NOT; op <= OpType::FOLD; op <<= 1)
+    if (op_type_set & op)
+      ops.push_back(op);
+  const std::size_t num_subsets = std::size_t(1) << ops.size();
+  std::vector<int> subset_ops(num_subsets, 0);
+  for (std::size_t s = 1; s < num_subsets; ++s)
+    subset_ops[s] = subset_ops[s & (s - 1)] | ops[__builtin_ctzll(s)];
+  auto op_bit = [&ops](int op) {
+    return std::size_t(1) << (std::find(ops.begin(), ops.end(), op) - ops.begin());
+  };
+
+  // f(S) => sum of f(T) for T in S, and back.
+  auto zeta = [&](std::vector<Count>* f) {
+    for (std::size_t b = 1; b < num_subsets; b <<= 1)
+      for (std::size_t s = 0; s < num_subsets; ++s)
+        if (s & b) (*f)[s] += (*f)[s ^ b];
+  };
+  auto moebius = [&](std::vector<Count>* f) {
+    for (std::size_t b = 1; b < num_subsets; b <<= 1)
+      for (std::size_t s = 0; s < num_subsets; ++s)
+        if (s & b) (*f)[s] -= (*f)[s ^ b];
+  };
+
+  // As in ForEachExpr().
+  bool is_tfold = op_type_set & OpType::TFOLD;
+  bool takes_all_sizes = (mode == GLOBAL_SIMPLIFY || mode == OBSERVATIONAL ||
+                          mode == OBSERVATIONAL_KEEP_MEMBERS);
+  std::size_t table_gen_limit =
+    (is_tfold ? (depth >= 6 ? depth - 5 : 1) : depth - 1);
+  int required_ops = (mode == NO_SIMPLIFY ? op_type_set & ~OpType::TFOLD : 0);
+
+  typedef std::vector<std::vector<Count> > ClassCounts;  // [class][subset]
+  std::vector<ClassCounts> table(1), zeta_table(1);
+  std::vector<std::vector<double> > totals(1);  // [class]
+  ExprPlan plan;
+  plan.levels.resize(1);
+  plan.exact = true;
+
+  // Size 1, as ListExprDepth1().
+  table.push_back(ClassCounts(NUM_PLAN_CLASSES, std::vector<Count>(num_subsets, 0)));
+  table[1][PLAN_PLAIN][0] = is_tfold ? 2 : 3;
+  if (op_type_set & (OpType::FOLD | OpType::TFOLD))
+    table[1][PLAN_IN_FOLD][0] = 2;
+
+  auto finish_level = [&](std::size_t d) {
+    ClassCounts z = table[d];
+    std::vector<double> total(NUM_PLAN_CLASSES, 0);
+    for (int c = 0; c < NUM_PLAN_CLASSES; ++c) {
+      zeta(&z[c]);
+      for (Count n : table[d][c])
+        total[c] += static_cast<double>(n);
+    }
+    zeta_table.push_back(z);
+    totals.push_back(total);
+  };
+  finish_level(1);
+  double leaves = totals[1][PLAN_PLAIN] + totals[1][PLAN_IN_FOLD];
+  plan.levels.push_back(ExprPlanLevel { leaves, leaves });
+
+  for (std::size_t d = 2; d <= table_gen_limit; ++d) {
+    ClassCounts composed(NUM_PLAN_CLASSES, std::vector<Count>(num_subsets, 0));
+    std::vector<double> bound(NUM_PLAN_CLASSES, 0);
+    // Adds |counts| of class |c| with the operators |op_mask| of |kind| into
+    // |composed|. |counts| are in the zeta domain if |in_zeta|.
+    auto add = [&](int c, std::vector<Count> counts, bool in_zeta, int op_mask) {
+      if (in_zeta)
+        moebius(&counts);
+      for (int op : ops) {
+        if (!(op & op_mask))
+          continue;
+        std::size_t bit = op_bit(op);
+        for (std::size_t s = 0; s < num_subsets; ++s)
+          composed[c][s | bit] += counts[s];
+      }
+    };
+    auto num_ops = [&ops](int op_mask) {
+      return std::count_if(ops.begin(), ops.end(), [op_mask](int op) { return op & op_mask; });
+    };
+
+    const int kUnary = OpType::NOT | OpType::SHL1 | OpType::SHR1 | OpType::SHR4 | OpType::SHR16;
+    const int kBinary = OpType::AND | OpType::OR | OpType::XOR | OpType::PLUS;
+    if (op_type_set & kUnary)
+      for (int c = 0; c < NUM_PLAN_CLASSES; ++c) {
+        add(c, table[d - 1][c], false, kUnary);
+        bound[c] += totals[d - 1][c] * num_ops(kUnary);
+      }
+
+    if (d >= 3 && (op_type_set & kBinary)) {
+      ClassCounts acc(NUM_PLAN_CLASSES, std::vector<Count>(num_subsets, 0));
+      for (std::size_t i = 1; i < d - 1; ++i) if (i <= d - 1 - i)
+        for (int c1 = 0; c1 < NUM_PLAN_CLASSES; ++c1)
+          for (int c2 = 0; c2 < NUM_PLAN_CLASSES; ++c2) {
+            int c = CombinePlanClasses({ c1, c2 });
+            if (c < 0) continue;
+            const std::vector<Count>& z1 = zeta_table[i][c1];
+            const std::vector<Count>& z2 = zeta_table[d - 1 - i][c2];
+            for (std::size_t s = 0; s < num_subsets; ++s)
+              acc[c][s] += z1[s] * z2[s];
+            bound[c] += totals[i][c1] * totals[d - 1 - i][c2] * num_ops(kBinary);
+          }
+      for (int c = 0; c < NUM_PLAN_CLASSES; ++c)
+        add(c, acc[c], true, kBinary);
+    }
+
+    if (d >= 4 && (op_type_set & OpType::IF0)) {
+      ClassCounts acc(NUM_PLAN_CLASSES, std::vector<Count>(num_subsets, 0));
+      for (std::size_t i = 1; i < d - 2; ++i)
+        for (std::size_t j = 1; j < d - i - 1; ++j)
+          for (int c1 = 0; c1 < NUM_PLAN_CLASSES; ++c1)
+            for (int c2 = 0; c2 < NUM_PLAN_CLASSES; ++c2)
+              for (int c3 = 0; c3 < NUM_PLAN_CLASSES; ++c3) {
+                int c = CombinePlanClasses({ c1, c2, c3 });
+                if (c < 0) continue;
+                const std::vector<Count>& z1 = zeta_table[i][c1];
+                const std::vector<Count>& z2 = zeta_table[j][c2];
+                const std::vector<Count>& z3 = zeta_table[d - 1 - i - j][c3];
+                for (std::size_t s = 0; s < num_subsets; ++s)
+                  acc[c][s] += z1[s] * z2[s] * z3[s];
+                bound[c] += totals[i][c1] * totals[j][c2] * totals[d - 1 - i - j][c3];
+              }
+      for (int c = 0; c < NUM_PLAN_CLASSES; ++c)
+        add(c, acc[c], true, OpType::IF0);
+    }
+
+    if (d >= 5 && (op_type_set & OpType::FOLD)) {
+      // Neither the value nor the init has fold or is in_fold; the body does
+      // not have fold.
+      std::vector<Count> acc(num_subsets, 0);
+      for (std::size_t i = 1; i < d - 3; ++i)
+        for (std::size_t j = 1; j < d - i - 2; ++j)
+          for (int c3 : { PLAN_PLAIN, PLAN_IN_FOLD }) {
+            const std::vector<Count>& z1 = zeta_table[i][PLAN_PLAIN];
+            const std::vector<Count>& z2 = zeta_table[j][PLAN_PLAIN];
+            const std::vector<Count>& z3 = zeta_table[d - 2 - i - j][c3];
+            for (std::size_t s = 0; s < num_subsets; ++s)
+              acc[s] += z1[s] * z2[s] * z3[s];
+            bound[PLAN_HAS_FOLD] +=
+                totals[i][PLAN_PLAIN] * totals[j][PLAN_PLAIN] * totals[d - 2 - i - j][c3];
+          }
+      add(PLAN_HAS_FOLD, acc, true, OpType::FOLD);
+    }
+
+    // The prefilter of ForEachExpr().
+    table.push_back(ClassCounts(NUM_PLAN_CLASSES, std::vector<Count>(num_subsets, 0)));
+    ExprPlanLevel level = { 0, 0 };
+    for (int c = 0; c < NUM_PLAN_CLASSES; ++c) {
+      if (bound[c] > kMaxExactCount)
+        plan.exact = false;
+      for (std::size_t s = 0; s < num_subsets; ++s) {
+        level.composed += static_cast<double>(composed[c][s]);
+        if (d + 5 > depth && c == PLAN_IN_FOLD)
+          continue;
+        if (d + MinCoverSize(required_ops & ~subset_ops[s]) > table_gen_limit)
+          continue;
+        table[d][c][s] = composed[c][s];
+        level.kept += static_cast<double>(composed[c][s]);
+      }
+    }
+    plan.levels.push_back(level);
+    finish_level(d);
+  }
+
+  // The programs wrap() makes of the emitted levels.
+  bool emit_last = (takes_all_sizes || !is_tfold || table_gen_limit + 5 == depth);
+  plan.programs = 0;
+  for (std::size_t d = 1; d <= table_gen_limit; ++d) {
+    if (d < table_gen_limit ? !(takes_all_sizes && table_gen_limit > 1) : !emit_last)
+      continue;
+    for (int c = 0; c < NUM_PLAN_CLASSES; ++c) {
+      if (is_tfold ? (c == PLAN_HAS_FOLD && !takes_all_sizes) : c == PLAN_IN_FOLD)
+        continue;
+      for (std::size_t s = 0; s < num_subsets; ++s) {
+        int program_ops = subset_ops[s] | (is_tfold ? OpType::TFOLD : 0);
+        if (mode == NO_SIMPLIFY && program_ops != op_type_set)
+          continue;
+        plan.programs += static_cast<double>(table[d][c][s]);
+      }
+    }
+  }
+  if (mode != NO_SIMPLIFY)
+    plan.exact = false;
+  return plan;
+}
+
+}  // namespace icfpc
+
+#endif  // ICFPC_PLAN_H_
@@ -0,0 +1,203 @@
+#ifndef ICFPC_RUN_FILE_H_
+#define ICFPC_RUN_FILE_H_
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cluster.h"
+#include "expr.h"
+#include "expr_list.h"
+#include "simplify.h"
+
+namespace icfpc {
+
+// Run files written by genall/simplify_main --shard=k/N, which the merge tool
+// merges into the output of the unsharded run. All the numbers are in the
+// host byte order; a string is a uint32 length followed by the bytes.
+//
+//   "icfprun1", uint32 kind, uint32 dedupe, uint32 shard index, uint32 shards
+//   PROGRAM_RUN: records in order.
+//   CLUSTER_RUN: uint64[256] argument, then per cluster in signature order
+//                uint64[256] signature, uint64 count, count records in order.
+//
+// A record is uint64 group, uint64 seq, string dedupe key, string program:
+// (group, seq) is the position of the program in the unsharded output (see
+// ExprShard). If dedupe is set, only the first program of each dedupe key is
+// output (within a cluster for CLUSTER_RUN).
+enum RunKind {
+  PROGRAM_RUN = 0,
+  CLUSTER_RUN = 1,
+};
+
+struct RunHeader {
+  uint32_t kind;
+  uint32_t dedupe;
+  uint32_t shard_index;
+  uint32_t num_shards;
+};
+
+struct RunRecord {
+  uint64_t group;
+  uint64_t seq;
+  std::string key;
+  std::string program;
+
+  bool operator<(const RunRecord& other) const {
+    return group != other.group ? group < other.group : seq < other.seq;
+  }
+};
+
+const char kRunMagic[] = "icfprun1";
+const std::size_t kSignatureSize = 256;
+
+// Parses "k/N" into |shard|. Returns false if malformed.
+bool ParseShard(const std::string& s, ExprShard* shard) {
+  char slash;
+  std::istringstream is(s);
+  return (is >> shard->index >> slash >> shard->num_shards) && slash == '/' &&
+      is.peek() == EOF && 0 <= shard->index && shard->index < shard->num_shards;
+}
+
+// Returns the key the unsharded run deduplicates |program| by in |mode|.
+std::string RunDedupeKey(const std::shared_ptr<Expr>& program, int op_type_set,
+                         GenAllSimplifyMode mode) {
+  std::shared_ptr<Expr> body = static_cast<const LambdaExpr&>(*program).body();
+  if (op_type_set & OpType::TFOLD)
+    body = static_cast<const FoldExpr&>(*body).body();
+  switch (mode) {
+    case NO_SIMPLIFY:
+      return Simplify(program)->ToString();  // SimplifyExprList()
+    case SIMPLIFY_EACH_STEP:
+    case GLOBAL_SIMPLIFY:
+      return Simplify(body)->ToString();
+    case OBSERVATIONAL: {
+      // The signature keep() takes the first body of. The TFOLD bodies of a
+      // cluster may differ on it.
+      static const std::vector<uint64_t> key = CreateKey();
+      return std::to_string(HashSignature(key, *body));
+    }
+    case OBSERVATIONAL_KEEP_MEMBERS:
+      break;
+  }
+  return "";
+}
+
+void WriteRunHeader(FILE* fp, const RunHeader& header) {
+  fwrite(kRunMagic, 1, 8, fp);
+  fwrite(&header, sizeof(header), 1, fp);
+}
+
+bool ReadRunHeader(FILE* fp, RunHeader* header) {
+  char magic[8];
+  return fread(magic, 1, 8, fp) == 8 && memcmp(magic, kRunMagic, 8) == 0 &&
+      fread(header, sizeof(*header), 1, fp) == 1;
+}
+
+void WriteRunU64s(FILE* fp, const std::vector<uint64_t>& values) {
+  fwrite(values.data(), sizeof(uint64_t), values.size(), fp);
+}
+
+bool ReadRunU64s(FILE* fp, std::size_t n, std::vector<uint64_t>* values) {
+  values->resize(n);
+  return fread(values->data(), sizeof(uint64_t), n, fp) == n;
+}
+
+void WriteRunString(FILE* fp, const std::string& s) {
+  uint32_t size = s.size();
+  fwrite(&size, sizeof(size), 1, fp);
+  fwrite(s.data(), 1, s.size(), fp);
+}
+
+bool ReadRunString(FILE* fp, std::string* s) {
+  uint32_t size;
+  if (fread(&size, sizeof(size), 1, fp) != 1)
+    return false;
+  s->resize(size);
+  return fread(&(*s)[0], 1, size, fp) == size;
+}
+
+void WriteRunRecord(FILE* fp, const RunRecord& record) {
+  WriteRunU64s(fp, { record.group, record.seq });
+  WriteRunString(fp, record.key);
+  WriteRunString(fp, record.program);
+}
+
+bool ReadRunRecord(FILE* fp, RunRecord* record) {
+  std::vector<uint64_t> position;
+  if (!ReadRunU64s(fp, 2, &position))
+    return false;
+  record->group = position[0];
+  record->seq = position[1];
+  return ReadRunString(fp, &record->key) && ReadRunString(fp, &record->program);
+}
+
+// A CLUSTER_RUN being read, positioned at the cluster of |signature|.
+struct RunInput {
+  FILE* fp;
+  RunHeader header;
+  bool has_cluster;
+  std::vector<uint64_t> signature;
+  uint64_t count;
+};
+
+// Reads the signature and the count of the next cluster of |input|.
+void ReadRunCluster(RunInput* input) {
+  std::vector<uint64_t> count;
+  input->has_cluster = ReadRunU64s(input->fp, kSignatureSize, &input->signature) &&
+      ReadRunU64s(input->fp, 1, &count);
+  input->count = input->has_cluster ? count[0] : 0;
+}
+
+// Merges the clusters of |inputs| in signature order. For each signature,
+// |visitor| gets the records of all the inputs sorted by position and, if
+// |dedupe| is set, only the first record of each dedupe key.
+void MergeRunClusters(
+    std::vector<RunInput>* inputs, bool dedupe,
+    std::function<void(const std::vector<uint64_t>&, const std::vector<RunRecord>&)> visitor) {
+  while (true) {
+    // Take the smallest signature among the inputs.
+    const std::vector<uint64_t>* signature = nullptr;
+    for (RunInput& input : *inputs)
+      if (input.has_cluster && (!signature || input.signature < *signature))
+        signature = &input.signature;
+    if (!signature)
+      break;
+    std::vector<uint64_t> current = *signature;
+
+    std::vector<RunRecord> records;
+    for (RunInput& input : *inputs) {
+      if (!input.has_cluster || input.signature != current)
+        continue;
+      for (uint64_t k = 0; k < input.count; ++k) {
+        RunRecord record;
+        CHECK(ReadRunRecord(input.fp, &record)) << "Broken run file";
+        records.push_back(record);
+      }
+      ReadRunCluster(&input);
+    }
+    std::sort(records.begin(), records.end());
+
+    if (dedupe) {
+      std::set<std::string> known;
+      std::vector<RunRecord> unique;
+      for (RunRecord& record : records)
+        if (known.insert(record.key).second)
+          unique.push_back(std::move(record));
+      records.swap(unique);
+    }
+    visitor(current, records);
+  }
+}
+
+}  // namespace icfpc
+
+#endif  // ICFPC_RUN_FILE_H_
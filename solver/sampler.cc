@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "expr.h"
+#include "sampler.h"
+
+using namespace icfpc;
+
+// Generates problems of random programs, drawn uniformly from the programs of
+// the size and the operators (see ProgramSampler), as the lines of
+// data/train_small.tsv:
+//   <id> <size> <operators> <program>
+// The problems are of --size and --operators, or of the size and the
+// operators of each line of --shapes_from (e.g. data/train_small.tsv), so
+// that they have the same mix as the given ones.
+
+DEFINE_int32(size, -1, "Size of the programs");
+DEFINE_string(operators, "", "List of the operators, with bonus for the bonus programs");
+DEFINE_string(shapes_from, "", "TSV of the problems to take the size and the operators from");
+DEFINE_int32(count, 1, "Number of the programs for each size and operators");
+DEFINE_int32(random_seed, 178, "");
+
+const char* const kOpNames[] = {
+  "not", "shl1", "shr1", "shr4", "shr16", "and", "or", "xor", "plus", "if0", "fold", "tfold",
+};
+
+int ParseOpTypeSetWithBonus(const std::string& s, bool* is_bonus) {
+  std::string param = s;
+  for (auto& c : param)
+    if (c == ',')
+      c = ' ';
+  int op_type_set = 0;
+  std::stringstream ss(param);
+  for (std::string op; ss >> op; ) {
+    if (op == "bonus")
+      *is_bonus = true;
+    else
+      op_type_set |= ParseOpType(op);
+  }
+  return op_type_set;
+}
+
+// The operators as in the TSV: bonus, and then the others alphabetically.
+std::string FormatOpTypeSet(int op_type_set, bool is_bonus) {
+  std::vector<std::string> names;
+  for (int i = 0; (1 << i) <= OpType::TFOLD; ++i)
+    if (op_type_set & (1 << i))
+      names.push_back(kOpNames[i]);
+  std::sort(names.begin(), names.end());
+  if (is_bonus)
+    names.insert(names.begin(), "bonus");
+  std::string result;
+  for (const std::string& name : names)
+    result += (result.empty() ? "" : ",") + name;
+  return result;
+}
+
+void Generate(std::mt19937_64* rand_engine, int size, const std::string& operators) {
+  bool is_bonus = false;
+  int op_type_set = ParseOpTypeSetWithBonus(operators, &is_bonus);
+  if (is_bonus)
+    op_type_set |= OpType::IF0 | OpType::AND;
+  ProgramSampler sampler(size, op_type_set, is_bonus, (*rand_engine)());
+  if (sampler.num_programs() == 0) {
+    LOG(WARNING) << "No program of size " << size << " with " << operators;
+    return;
+  }
+  const char kIdChars[] =
+      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+  std::uniform_int_distribution<int> id_char(0, sizeof(kIdChars) - 2);
+  for (int i = 0; i < FLAGS_count; ++i) {
+    std::string id;
+    for (int k = 0; k < 24; ++k)
+      id += kIdChars[id_char(*rand_engine)];
+    std::cout << id << "\t" << size << "\t" << FormatOpTypeSet(op_type_set, is_bonus)
+              << "\t" << *sampler.Sample() << "\n";
+  }
+}
+
+int main(int argc, char* argv[]) {
+  google::InstallFailureSignalHandler();
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  std::ios::sync_with_stdio(false);
+
+  std::mt19937_64 rand_engine(FLAGS_random_seed);
+  if (FLAGS_shapes_from.empty()) {
+    CHECK(FLAGS_size >= 3) << "--size should be specified";
+    CHECK(!FLAGS_operators.empty()) << "--operators should be specified";
+    Generate(&rand_engine, FLAGS_size, FLAGS_operators);
+    return 0;
+  }
+
+  std::ifstream is(FLAGS_shapes_from);
+  CHECK(is) << "Failed to open " << FLAGS_shapes_from;
+  for (std::string line; std::getline(is, line); ) {
+    std::stringstream ss(line);
+    std::string id, size, operators;
+    if (!std::getline(ss, id, '\t') || !std::getline(ss, size, '\t') ||
+        !std::getline(ss, operators, '\t'))
+      continue;
+    Generate(&rand_engine, std::stoi(size), operators);
+  }
+  return 0;
+}
@@ -0,0 +1,410 @@
+#ifndef ICFPC_SAMPLER_H_
+#define ICFPC_SAMPLER_H_
+
+#include <algorithm>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "expr.h"
+#include "plan.h"
+
+namespace icfpc {
+
+// Draws programs uniformly at random from the ones ForEachExpr(NO_SIMPLIFY)
+// enumerates for (size, op_type_set), i.e. those of the size with exactly the
+// operators (a tfold program if op_type_set has TFOLD), or from the bonus
+// programs (lambda (x) (if0 (and c 1) t e)) of the size and the operators.
+//
+// The expressions of each size are counted per class (see PlanClass) and per
+// set of the operators they contain, as PlanExprList() does but exactly and
+// without the pruning. A program is drawn top-down: at each node, one of the
+// ways to compose an expression of the size, class and operator set is taken
+// with the probability proportional to its count, and then the operator sets
+// of the operands likewise.
+class ProgramSampler {
+ public:
+  ProgramSampler(std::size_t size, int op_type_set, bool bonus, uint64_t seed)
+      : size_(size), op_type_set_(op_type_set), bonus_(bonus), rand_engine_(seed) {
+    is_tfold_ = op_type_set & OpType::TFOLD;
+    ops_ = op_type_set & (OpType::TFOLD - 1);
+    std::size_t max_depth =
+        bonus ? (size >= 7 ? size - 6 : 0) : is_tfold_ ? (size >= 6 ? size - 5 : 0) : size - 1;
+    BuildTable(max_depth);
+  }
+
+  // The number of the programs to draw from, in double.
+  double num_programs() {
+    return static_cast<double>(CountRoot(nullptr));
+  }
+
+  // Returns a program drawn uniformly at random, or null if there is none.
+  std::shared_ptr<Expr> Sample() {
+    if (CountRoot(nullptr) == 0)
+      return std::shared_ptr<Expr>();
+    Group root;
+    CountRoot(&root);
+    if (bonus_) {
+      std::shared_ptr<Expr> args[3];
+      SampleArgs(root, ops_, args);
+      return LambdaExpr::Create(If0Expr::Create(
+          BinaryOpExpr::Create(BinaryOpExpr::Type::AND, args[0], ConstantExpr::CreateOne()),
+          args[1], args[2]));
+    }
+    std::shared_ptr<Expr> body = SampleExpr(root.sizes[0], root.classes[0], ops_);
+    return LambdaExpr::Create(is_tfold_ ? FoldExpr::CreateTFold(body) : body);
+  }
+
+ private:
+  typedef unsigned __int128 Count;
+  static const int kNumSubsets = OpType::TFOLD;  // the subsets of NOT .. FOLD
+
+  // A way to compose an expression: |op_mask| over the operands of |sizes|
+  // and |classes|.
+  struct Group {
+    int kind;  // the OpType of the composed expression
+    int op_mask;
+    int arity;
+    std::size_t sizes[3];
+    int classes[3];
+  };
+
+  // Calls |f| with every subset of |mask|.
+  template<typename Function>
+  static void ForEachSubset(int mask, Function f) {
+    for (int s = mask; ; s = (s - 1) & mask) {
+      f(s);
+      if (s == 0)
+        break;
+    }
+  }
+
+  // f(S) => sum of f(T) for T in S, and back, over the subsets of ops_.
+  void Zeta(std::vector<Count>* f) const {
+    for (int b = 1; b < kNumSubsets; b <<= 1)
+      if (ops_ & b)
+        ForEachSubset(ops_, [&](int s) { if (s & b) (*f)[s] += (*f)[s ^ b]; });
+  }
+  void Moebius(std::vector<Count>* f) const {
+    for (int b = 1; b < kNumSubsets; b <<= 1)
+      if (ops_ & b)
+        ForEachSubset(ops_, [&](int s) { if (s & b) (*f)[s] -= (*f)[s ^ b]; });
+  }
+
+  void BuildTable(std::size_t max_depth) {
+    auto empty = [] {
+      return std::vector<std::vector<Count> >(NUM_PLAN_CLASSES, std::vector<Count>(kNumSubsets, 0));
+    };
+    table_.assign(1, empty());
+    zeta_.assign(1, empty());
+    if (max_depth == 0)
+      return;
+    table_.push_back(empty());
+    table_[1][PLAN_PLAIN][0] = is_tfold_ ? 2 : 3;  // 0, 1, x
+    if (op_type_set_ & (OpType::FOLD | OpType::TFOLD))
+      table_[1][PLAN_IN_FOLD][0] = 2;  // y, z
+    FinishLevel(1);
+    for (std::size_t d = 2; d <= max_depth; ++d) {
+      table_.push_back(empty());
+      for (int c = 0; c < NUM_PLAN_CLASSES; ++c) {
+        // The products of the operands in the zeta domain, for each operator.
+        std::vector<std::vector<Count> > acc(kNumSubsets);
+        for (const Group& group : ListGroups(d, c)) {
+          std::vector<Count>& a = acc[group.op_mask];
+          a.resize(kNumSubsets, 0);
+          ForEachSubset(ops_, [&](int t) {
+            Count product = 1;
+            for (int k = 0; k < group.arity; ++k)
+              product *= zeta_[group.sizes[k]][group.classes[k]][t];
+            a[t] += product;
+          });
+        }
+        for (int op = 1; op < kNumSubsets; op <<= 1) {
+          if (acc[op].empty())
+            continue;
+          Moebius(&acc[op]);
+          ForEachSubset(ops_, [&](int r) { table_[d][c][r | op] += acc[op][r]; });
+        }
+      }
+      FinishLevel(d);
+    }
+  }
+
+  void FinishLevel(std::size_t d) {
+    zeta_.push_back(table_[d]);
+    for (int c = 0; c < NUM_PLAN_CLASSES; ++c) {
+      Zeta(&zeta_[d][c]);
+      // zeta_[d][c][ops_] counts all the expressions of the class, which
+      // bounds all the counts of the programs composed from them.
+      CHECK(static_cast<double>(zeta_[d][c][ops_]) < 1e36) << "Too many programs to count exactly";
+    }
+  }
+
+  // Lists the ways of VisitExprTask() to compose an expression of size |d|
+  // and class |c|.
+  std::vector<Group> ListGroups(std::size_t d, int c) {
+    std::vector<Group> groups;
+    auto add = [&](int kind, int op_mask, std::initializer_list<std::size_t> sizes,
+                   std::initializer_list<int> classes) {
+      if (CombinePlanClasses(classes) != c)
+        return;
+      Group group = { kind, op_mask, static_cast<int>(sizes.size()), {}, {} };
+      std::copy(sizes.begin(), sizes.end(), group.sizes);
+      std::copy(classes.begin(), classes.end(), group.classes);
+      groups.push_back(group);
+    };
+    for (int op = OpType::NOT; op <= OpType::SHR16; op <<= 1)
+      if (ops_ & op)
+        add(op, op, { d - 1 }, { c });
+    for (int op = OpType::AND; op <= OpType::PLUS; op <<= 1) {
+      if (!(ops_ & op) || d < 3)
+        continue;
+      for (std::size_t i = 1; i < d - 1; ++i) if (i <= d - 1 - i)
+        for (int c1 = 0; c1 < NUM_PLAN_CLASSES; ++c1)
+          for (int c2 = 0; c2 < NUM_PLAN_CLASSES; ++c2)
+            add(op, op, { i, d - 1 - i }, { c1, c2 });
+    }
+    if ((ops_ & OpType::IF0) && d >= 4)
+      for (std::size_t i = 1; i < d - 2; ++i)
+        for (std::size_t j = 1; j < d - i - 1; ++j)
+          for (int c1 = 0; c1 < NUM_PLAN_CLASSES; ++c1)
+            for (int c2 = 0; c2 < NUM_PLAN_CLASSES; ++c2)
+              for (int c3 = 0; c3 < NUM_PLAN_CLASSES; ++c3)
+                add(OpType::IF0, OpType::IF0, { i, j, d - 1 - i - j }, { c1, c2, c3 });
+    // The fold result is of PLAN_HAS_FOLD, as CombinePlanClasses() of the
+    // value, the init and PLAN_HAS_FOLD is.
+    if ((ops_ & OpType::FOLD) && d >= 5 && c == PLAN_HAS_FOLD)
+      for (std::size_t i = 1; i < d - 3; ++i)
+        for (std::size_t j = 1; j < d - i - 2; ++j)
+          for (int c3 : { PLAN_PLAIN, PLAN_IN_FOLD }) {
+            Group group = { OpType::FOLD, OpType::FOLD, 3, { i, j, d - 2 - i - j },
+                            { PLAN_PLAIN, PLAN_PLAIN, c3 } };
+            groups.push_back(group);
+          }
+    return groups;
+  }
+
+  // Returns the number of the tuples of the operands of |group| whose
+  // operators with |op_mask| are exactly |ops|.
+  Count CountGroup(const Group& group, int ops) {
+    if ((ops & group.op_mask) != group.op_mask)
+      return 0;
+    Count count = 0;
+    ForEachSubset(ops & group.op_mask, [&](int r) { count += CountOperands(group, (ops & ~group.op_mask) | r); });
+    return count;
+  }
+
+  // Returns the number of the tuples of the operands of |group| whose
+  // operators are exactly |ops|, by the inclusion-exclusion over the subsets.
+  Count CountOperands(const Group& group, int ops) {
+    Count count = 0;
+    ForEachSubset(ops, [&](int t) {
+      Count product = 1;
+      for (int k = 0; k < group.arity; ++k)
+        product *= zeta_[group.sizes[k]][group.classes[k]][t];
+      if (__builtin_popcount(ops & ~t) & 1)
+        count -= product;
+      else
+        count += product;
+    });
+    return count;
+  }
+
+  // Returns the number of the programs, and sets the single group of the
+  // root to |root| if given.
+  Count CountRoot(Group* root) {
+    Group group;
+    if (bonus_) {
+      // (lambda (x) (if0 (and c 1) t e)): 4 nodes besides c, t and e.
+      Count count = 0;
+      if (size_ >= 7 && table_.size() > 1) {
+        for (std::size_t i = 1; i + 2 <= size_ - 4; ++i)
+          for (std::size_t j = 1; i + j + 1 <= size_ - 4; ++j) {
+            for (int c1 = 0; c1 < NUM_PLAN_CLASSES; ++c1)
+              for (int c2 = 0; c2 < NUM_PLAN_CLASSES; ++c2)
+                for (int c3 = 0; c3 < NUM_PLAN_CLASSES; ++c3) {
+                  int c = CombinePlanClasses({ c1, c2, c3 });
+                  if (c != PLAN_PLAIN && c != PLAN_HAS_FOLD)
+                    continue;
+                  Group g = { OpType::IF0, OpType::IF0 | OpType::AND, 3,
+                              { i, j, size_ - 4 - i - j }, { c1, c2, c3 } };
+                  Count n = CountGroup(g, ops_);
+                  if (n == 0)
+                    continue;
+                  count += n;
+                  // Takes this one with the probability n / count so far.
+                  if (root && Draw(count) < n)
+                    *root = g;
+                }
+          }
+      }
+      return count;
+    }
+
+    std::size_t d = table_.size() - 1;
+    if (d == 0)
+      return 0;
+    Count count = 0;
+    for (int c = 0; c < NUM_PLAN_CLASSES; ++c) {
+      // The program is not in_fold, unless the body of tfold.
+      if (is_tfold_ ? c == PLAN_HAS_FOLD : c == PLAN_IN_FOLD)
+        continue;
+      Count n = table_[d][c][ops_];
+      if (n == 0)
+        continue;
+      count += n;
+      if (root && Draw(count) < n) {
+        group = { OpType::LAMBDA, 0, 1, { d }, { c } };
+        *root = group;
+      }
+    }
+    return count;
+  }
+
+  // Returns a uniform random number in [0, n).
+  Count Draw(Count n) {
+    Count threshold = (-n) % n;
+    for (;;) {
+      Count r = (static_cast<Count>(rand_engine_()) << 64) | rand_engine_();
+      if (r >= threshold)
+        return r % n;
+    }
+  }
+
+  // Returns the index of |weights| drawn with the probability proportional
+  // to its weight.
+  std::size_t Choose(const std::vector<Count>& weights) {
+    Count total = 0;
+    for (Count w : weights)
+      total += w;
+    CHECK(total > 0);
+    Count r = Draw(total);
+    for (std::size_t i = 0; ; ++i) {
+      if (r < weights[i])
+        return i;
+      r -= weights[i];
+    }
+  }
+
+  // Returns the sum of f[x] for lower ⊆ x ⊆ upper.
+  static Count SumBetween(const std::vector<Count>& f, int lower, int upper) {
+    Count sum = 0;
+    ForEachSubset(upper & ~lower, [&](int r) { sum += f[lower | r]; });
+    return sum;
+  }
+
+  // Draws one of the subsets between |lower| and |upper|, each weighted by
+  // |weight|(subset).
+  template<typename Weight>
+  int ChooseBetween(int lower, int upper, Weight weight) {
+    std::vector<int> subsets;
+    std::vector<Count> weights;
+    ForEachSubset(upper & ~lower, [&](int r) {
+      subsets.push_back(lower | r);
+      weights.push_back(weight(lower | r));
+    });
+    return subsets[Choose(weights)];
+  }
+
+  // Draws the operands of |group| whose operators with |group.op_mask| are
+  // exactly |ops|.
+  void SampleArgs(const Group& group, int ops, std::shared_ptr<Expr>* args) {
+    const std::vector<Count>* t[3];
+    for (int k = 0; k < group.arity; ++k)
+      t[k] = &table_[group.sizes[k]][group.classes[k]];
+
+    // The operators of all the operands, and then of each.
+    int rest = ChooseBetween(ops & ~group.op_mask, ops, [&](int r) {
+      return CountOperands(group, r);
+    });
+    int arg_ops[3] = { rest, 0, 0 };
+    if (group.arity == 2) {
+      arg_ops[0] = ChooseBetween(0, rest, [&](int s1) {
+        return (*t[0])[s1] * SumBetween(*t[1], rest & ~s1, rest);
+      });
+      arg_ops[1] = ChooseBetween(rest & ~arg_ops[0], rest, [&](int s2) { return (*t[1])[s2]; });
+    } else if (group.arity == 3) {
+      // pair[r]: the number of the pairs of the 2nd and 3rd operands whose
+      // operators are exactly r.
+      Group pair = group;
+      pair.arity = 2;
+      pair.sizes[0] = group.sizes[1];
+      pair.sizes[1] = group.sizes[2];
+      pair.classes[0] = group.classes[1];
+      pair.classes[1] = group.classes[2];
+      std::vector<Count> pairs(kNumSubsets, 0);
+      ForEachSubset(rest, [&](int r) { pairs[r] = CountOperands(pair, r); });
+      arg_ops[0] = ChooseBetween(0, rest, [&](int s1) {
+        return (*t[0])[s1] * SumBetween(pairs, rest & ~s1, rest);
+      });
+      int pair_ops = ChooseBetween(rest & ~arg_ops[0], rest, [&](int r) { return pairs[r]; });
+      arg_ops[1] = ChooseBetween(0, pair_ops, [&](int s2) {
+        return (*t[1])[s2] * SumBetween(*t[2], pair_ops & ~s2, pair_ops);
+      });
+      arg_ops[2] = ChooseBetween(pair_ops & ~arg_ops[1], pair_ops,
+                                 [&](int s3) { return (*t[2])[s3]; });
+    }
+    for (int k = 0; k < group.arity; ++k)
+      args[k] = SampleExpr(group.sizes[k], group.classes[k], arg_ops[k]);
+  }
+
+  // Draws an expression of size |d|, class |c| and exactly the operators |ops|.
+  std::shared_ptr<Expr> SampleExpr(std::size_t d, int c, int ops) {
+    if (d == 1) {
+      CHECK_EQ(0, ops);
+      std::uniform_int_distribution<int> leaf(0, static_cast<int>(table_[1][c][0]) - 1);
+      int k = leaf(rand_engine_);
+      if (c == PLAN_IN_FOLD)
+        return k == 0 ? IdExpr::CreateY() : IdExpr::CreateZ();
+      if (k == 2)
+        return IdExpr::CreateX();
+      return k == 0 ? ConstantExpr::CreateZero() : ConstantExpr::CreateOne();
+    }
+
+    // The top levels are visited by every sample, and their weights are
+    // costly to count.
+    std::vector<Group> groups = ListGroups(d, c);
+    std::vector<Count>& weights = weights_[std::make_tuple(d, c, ops)];
+    if (weights.empty())
+      for (const Group& group : groups)
+        weights.push_back(CountGroup(group, ops));
+    const Group& group = groups[Choose(weights)];
+    std::shared_ptr<Expr> args[3];
+    SampleArgs(group, ops, args);
+    switch (group.kind) {
+      case OpType::NOT: return UnaryOpExpr::Create(UnaryOpExpr::Type::NOT, args[0]);
+      case OpType::SHL1: return UnaryOpExpr::Create(UnaryOpExpr::Type::SHL1, args[0]);
+      case OpType::SHR1: return UnaryOpExpr::Create(UnaryOpExpr::Type::SHR1, args[0]);
+      case OpType::SHR4: return UnaryOpExpr::Create(UnaryOpExpr::Type::SHR4, args[0]);
+      case OpType::SHR16: return UnaryOpExpr::Create(UnaryOpExpr::Type::SHR16, args[0]);
+      case OpType::AND: return BinaryOpExpr::Create(BinaryOpExpr::Type::AND, args[0], args[1]);
+      case OpType::OR: return BinaryOpExpr::Create(BinaryOpExpr::Type::OR, args[0], args[1]);
+      case OpType::XOR: return BinaryOpExpr::Create(BinaryOpExpr::Type::XOR, args[0], args[1]);
+      case OpType::PLUS: return BinaryOpExpr::Create(BinaryOpExpr::Type::PLUS, args[0], args[1]);
+      case OpType::IF0: return If0Expr::Create(args[0], args[1], args[2]);
+      default: return FoldExpr::Create(args[0], args[1], args[2]);
+    }
+  }
+
+  const std::size_t size_;
+  const int op_type_set_;
+  const bool bonus_;
+  bool is_tfold_;
+  int ops_;  // op_type_set_ without TFOLD
+  std::mt19937_64 rand_engine_;
+  // [size][class][operators]: the number of the expressions, and its zeta
+  // transform (the number of those with a subset of the operators).
+  std::vector<std::vector<std::vector<Count> > > table_;
+  std::vector<std::vector<std::vector<Count> > > zeta_;
+  // [(size, class, operators)]: the counts of ListGroups(size, class).
+  std::map<std::tuple<std::size_t, int, int>, std::vector<Count> > weights_;
+
+  DISALLOW_COPY_AND_ASSIGN(ProgramSampler);
+};
+
+}  // namespace icfpc
+
+#endif  // ICFPC_SAMPLER_H_
@@ -0,0 +1,273 @@
+#ifndef ICFPC_SIGNATURE_TABLE_H_
+#define ICFPC_SIGNATURE_TABLE_H_
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "expr.h"
+#include "util.h"
+
+namespace icfpc {
+
+// The expressions Cardinal() has found, keyed by their outputs on the
+// arguments (the signature) and whether they have fold. Each signature is
+// kept once, with the smallest size and how it is composed.
+//
+// An entry is referred to by a 32-bit (size, index in the size) pair, which
+// the entries also use to refer to their operands. Each size level stores its
+// signatures back to back in fixed chunks (so that they never move), and the
+// operator and the operands of each entry in columns; an entry takes 8 bytes
+// per output plus 13 bytes, and 16 to 32 bytes of the index. The entries of a
+// level without fold come first, so has_fold is not stored.
+//
+// The index is an open-addressing table of 8-byte slots (a 32-bit hash tag
+// and the entry) probed linearly, so a lookup mostly reads one cache line,
+// and touches the signature only when the tags match.
+//
+// The compositions which had the signature of an entry may be kept as its
+// duplicates, 17 bytes each, so that they can be told apart when more
+// outputs are added.
+class SignatureTable {
+ public:
+  enum : uint32_t { kNone = ~0U };
+
+  // Takes the signatures of |width| outputs, of the sizes up to |max_size|.
+  SignatureTable(std::size_t width, int max_size)
+      : width_(width), mask_(kInitialSlots - 1), slots_(kInitialSlots, 0), num_entries_(0),
+        levels_(max_size + 1) {
+    CHECK_LT(max_size, 1 << (32 - kIndexBits));
+    chunk_shift_ = 0;
+    while ((width_ * sizeof(uint64_t)) << (chunk_shift_ + 1) <= kChunkBytes)
+      ++chunk_shift_;
+  }
+
+  // The number of the outputs in a signature.
+  std::size_t width() const { return width_; }
+  // The number of the entries.
+  std::size_t size() const { return num_entries_; }
+  int max_size() const { return levels_.size() - 1; }
+
+  // The entry of |index| in |size|.
+  static uint32_t Ref(int size, std::size_t index) {
+    return (static_cast<uint32_t>(size) << kIndexBits) | index;
+  }
+  static int expr_size(uint32_t ref) { return ref >> kIndexBits; }
+  static std::size_t index(uint32_t ref) { return ref & ((1U << kIndexBits) - 1); }
+
+  const uint64_t* values(uint32_t ref) const {
+    const Level& level = levels_[expr_size(ref)];
+    std::size_t i = index(ref);
+    return level.chunks[i >> chunk_shift_].get() + (i & ((1 << chunk_shift_) - 1)) * width_;
+  }
+  OpType type(uint32_t ref) const {
+    return static_cast<OpType>(1 << levels_[expr_size(ref)].ops[index(ref)]);
+  }
+  bool has_fold(uint32_t ref) const {
+    return index(ref) >= levels_[expr_size(ref)].num_plain;
+  }
+  // The |k|-th operand, or what the caller put there (e.g. the fold body).
+  uint32_t arg(uint32_t ref, int k) const {
+    return levels_[expr_size(ref)].args[index(ref) * 3 + k];
+  }
+
+  // The entries of a size, those without fold first, as of when taken.
+  class LevelRange {
+   public:
+    class Iterator {
+     public:
+      explicit Iterator(uint32_t ref) : ref_(ref) {}
+      uint32_t operator*() const { return ref_; }
+      Iterator& operator++() { ++ref_; return *this; }
+      bool operator!=(const Iterator& other) const { return ref_ != other.ref_; }
+     private:
+      uint32_t ref_;
+    };
+    LevelRange(int size, std::size_t count) : size_(size), count_(count) {}
+    Iterator begin() const { return Iterator(Ref(size_, 0)); }
+    Iterator end() const { return Iterator(Ref(size_, count_)); }
+    std::size_t size() const { return count_; }
+   private:
+    int size_;
+    std::size_t count_;
+  };
+  LevelRange level(int size) const { return LevelRange(size, levels_[size].ops.size()); }
+
+  // Returns the entry of the signature, or kNone.
+  uint32_t Find(const uint64_t* values, bool has_fold) const {
+    uint64_t hash = Hash(values, has_fold);
+    for (std::size_t i = hash & mask_; ; i = (i + 1) & mask_) {
+      uint64_t slot = slots_[i];
+      if (slot == 0)
+        return kNone;
+      if (Matches(slot, hash, values, has_fold))
+        return static_cast<uint32_t>(slot);
+    }
+  }
+
+  // Adds the signature unless it is there. Returns true if added. Sets
+  // *|entry|, if given, to the entry of the signature. The entries of a size
+  // without fold should be added before those with fold.
+  bool Insert(const uint64_t* values, bool has_fold, int size, OpType type,
+              uint32_t arg1 = kNone, uint32_t arg2 = kNone, uint32_t arg3 = kNone,
+              uint32_t* entry = NULL) {
+    CHECK(size > 0 && size < static_cast<int>(levels_.size()));
+    uint64_t hash = Hash(values, has_fold);
+    std::size_t i = hash & mask_;
+    for (; slots_[i] != 0; i = (i + 1) & mask_) {
+      if (Matches(slots_[i], hash, values, has_fold)) {
+        if (entry)
+          *entry = static_cast<uint32_t>(slots_[i]);
+        return false;
+      }
+    }
+
+    Level& level = levels_[size];
+    std::size_t index = level.ops.size();
+    CHECK_LT(index, std::size_t(1) << kIndexBits);
+    CHECK(has_fold || level.num_plain == index) << "Added without fold after with fold";
+    if ((index >> chunk_shift_) == level.chunks.size())
+      level.chunks.emplace_back(new uint64_t[width_ << chunk_shift_]);
+    memcpy(level.chunks.back().get() + (index & ((1 << chunk_shift_) - 1)) * width_, values,
+           width_ * sizeof(uint64_t));
+    level.ops.push_back(__builtin_ctz(type));
+    level.args.insert(level.args.end(), { arg1, arg2, arg3 });
+    if (!has_fold)
+      ++level.num_plain;
+    ++num_entries_;
+    slots_[i] = (hash >> 32 << 32) | Ref(size, index);
+    if (entry)
+      *entry = Ref(size, index);
+
+    if (num_entries_ * 2 > slots_.size())
+      Rehash();
+    return true;
+  }
+
+  // The entries of a size without fold.
+  std::size_t num_plain(int size) const { return levels_[size].num_plain; }
+
+  // A composition of a size which had the signature of |entry|, and was not
+  // added. Those with fold may be of an entry without fold.
+  struct Duplicate {
+    OpType type;
+    bool has_fold;
+    uint32_t entry;
+    uint32_t args[3];
+  };
+  std::size_t num_duplicates(int size) const { return levels_[size].dup_ops.size(); }
+  Duplicate duplicate(int size, std::size_t i) const {
+    const Level& level = levels_[size];
+    const uint32_t* args = &level.dup_args[i * 4];
+    Duplicate duplicate = {
+      static_cast<OpType>(1 << (level.dup_ops[i] & 0x7F)), (level.dup_ops[i] & 0x80) != 0,
+      args[0], { args[1], args[2], args[3] }
+    };
+    return duplicate;
+  }
+  void AddDuplicate(int size, OpType type, bool has_fold, uint32_t entry,
+                    uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+    Level& level = levels_[size];
+    level.dup_ops.push_back(__builtin_ctz(type) | (has_fold ? 0x80 : 0));
+    level.dup_args.insert(level.dup_args.end(), { entry, arg1, arg2, arg3 });
+  }
+
+  // The bytes of the entries, the signatures, the index and the duplicates.
+  // The chunks are counted as far as filled, as the rest of them is not
+  // touched.
+  std::size_t memory_bytes() const {
+    std::size_t bytes = slots_.capacity() * sizeof(uint64_t);
+    for (const Level& level : levels_) {
+      bytes += level.ops.size() * width_ * sizeof(uint64_t) +
+          level.ops.capacity() + level.args.capacity() * sizeof(uint32_t) +
+          level.dup_ops.capacity() + level.dup_args.capacity() * sizeof(uint32_t);
+    }
+    return bytes;
+  }
+
+ private:
+  static const int kIndexBits = 27;
+  static const std::size_t kInitialSlots = 1 << 10;
+  static const std::size_t kChunkBytes = 1 << 22;
+
+  struct Level {
+    Level() : num_plain(0) {}
+    std::vector<std::unique_ptr<uint64_t[]> > chunks;  // (1 << chunk_shift_) signatures each
+    std::vector<uint8_t> ops;  // log2 of OpType
+    std::vector<uint32_t> args;  // 3 per entry
+    std::size_t num_plain;  // the entries without fold
+    std::vector<uint8_t> dup_ops;  // log2 of OpType, | 0x80 with fold
+    std::vector<uint32_t> dup_args;  // the entry and the 3 operands of each
+  };
+
+  uint64_t Hash(const uint64_t* values, bool has_fold) const {
+    uint64_t hash = has_fold ? 0x9E3779B97F4A7C15ULL : 0;
+    for (std::size_t i = 0; i < width_; ++i) {
+      hash = (hash ^ values[i]) * 0xFF51AFD7ED558CCDULL;
+      hash ^= hash >> 32;
+    }
+    return hash;
+  }
+
+  bool Matches(uint64_t slot, uint64_t hash, const uint64_t* values, bool has_fold) const {
+    if ((slot >> 32) != (hash >> 32))
+      return false;
+    uint32_t ref = static_cast<uint32_t>(slot);
+    return this->has_fold(ref) == has_fold &&
+        memcmp(this->values(ref), values, width_ * sizeof(uint64_t)) == 0;
+  }
+
+  void Rehash() {
+    slots_.assign(slots_.size() * 2, 0);
+    mask_ = slots_.size() - 1;
+    for (std::size_t size = 1; size < levels_.size(); ++size) {
+      for (uint32_t ref : level(size)) {
+        uint64_t hash = Hash(values(ref), has_fold(ref));
+        std::size_t i = hash & mask_;
+        while (slots_[i] != 0)
+          i = (i + 1) & mask_;
+        slots_[i] = (hash >> 32 << 32) | ref;
+      }
+    }
+  }
+
+  const std::size_t width_;
+  int chunk_shift_;
+  std::size_t mask_;
+  std::vector<uint64_t> slots_;  // 0, or (hash tag << 32) | entry
+  std::size_t num_entries_;
+  std::vector<Level> levels_;
+
+  DISALLOW_COPY_AND_ASSIGN(SignatureTable);
+};
+
+// Whether (|type| |e|) is known to have the signature of a smaller entry,
+// from the operator of |e|: not of not, and a shift of 0 or a right shift
+// of 1, which are 0. Cardinal() skips composing those.
+inline bool ComposesSmaller(const SignatureTable& table, OpType type, uint32_t e) {
+  OpType e_type = table.type(e);
+  if (e_type == OpType::NOT)
+    return type == OpType::NOT;
+  if (e_type != OpType::CONSTANT)
+    return false;
+  return type != OpType::NOT && (type != OpType::SHL1 || table.values(e)[0] == 0);
+}
+
+// Whether (|type| |e1| |e2|) is known to have the signature of a smaller
+// entry: with 0, which is 0 or the other one, and and, or and xor of an
+// entry with itself, which is the entry or 0.
+inline bool ComposesSmaller(const SignatureTable& table, OpType type, uint32_t e1, uint32_t e2) {
+  auto is_zero = [&](uint32_t e) {
+    return table.type(e) == OpType::CONSTANT && table.values(e)[0] == 0;
+  };
+  if (is_zero(e1) || is_zero(e2))
+    return true;
+  return e1 == e2 && type != OpType::PLUS;
+}
+
+}  // namespace icfpc
+
+#endif  // ICFPC_SIGNATURE_TABLE_H_
@@ -2,6 +2,7 @@
 #include <sys/file.h>
 
 #include <sstream>
+#include <unordered_map>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -9,6 +10,9 @@
 #include "expr.h"
 #include "expr_list.h"
 #include "cluster.h"
+#include "cluster_dump.h"
+#include "external_cluster.h"
+#include "run_file.h"
 #include "simplify.h"
 #include "util.h"
 
@@ -16,9 +20,57 @@ using namespace icfpc;
 
 DEFINE_int32(size, -1, "Size of the expression");
 DEFINE_string(operators, "", "List of the operators");
-DEFINE_string(simplify, "global", "{no,each,global}");
+DEFINE_int32(threads, 1, "Number of threads to enumerate expressions");
+DEFINE_string(simplify, "global", "{no,each,global,observational}");
+DEFINE_bool(keep_members, false,
+            "With --simplify=observational, output all the members of each cluster");
 DEFINE_bool(quiet, false, "suppress outputs");
+DEFINE_string(format, "text", "{text,binary}: format of the clusters output (see cluster_dump.h)");
 DEFINE_string(cache_dir, "", "Path to cache dir");
+DEFINE_string(table_cache_dir, "",
+              "Path to the dir to cache the enumerated tables across problems "
+              "(--simplify=global or observational)");
+DEFINE_string(shard, "", "k/N: generate only the k-th of N slices into --run_file");
+DEFINE_string(run_file, "", "Output of --shard, to be merged by the merge tool");
+DEFINE_int32(memory_budget_mb, 0,
+             "If positive, the clusters over about this size are spilled to --spill_dir "
+             "and merged at the end, and --format=binary spools its dump there");
+DEFINE_string(spill_dir, "", "Dir for --memory_budget_mb (default: $TMPDIR or /tmp)");
+
+// Appends the programs of the cluster of |signature| to its file in
+// --cache_dir, unless the file is already there.
+void WriteCacheCluster(const std::vector<uint64_t>& signature,
+                       const std::vector<std::shared_ptr<Expr> >& programs) {
+  uint64_t hash = HashKey(signature);
+  char filename[256];
+  MaybeMakeDir(FLAGS_cache_dir.c_str());
+  sprintf(filename, "%s/%02x",
+          FLAGS_cache_dir.c_str(),
+          static_cast<int>(hash & 0xff));
+  MaybeMakeDir(filename);
+  sprintf(filename, "%s/%02x/%02x",
+          FLAGS_cache_dir.c_str(),
+          static_cast<int>(hash & 0xff),
+          static_cast<int>((hash >> 8) & 0xff));
+  MaybeMakeDir(filename);
+  sprintf(filename, "%s/%02x/%02x/%016llx.sxp",
+          FLAGS_cache_dir.c_str(),
+          static_cast<int>(hash & 0xff),
+          static_cast<int>((hash >> 8) & 0xff),
+          static_cast<unsigned long long>(hash));
+  FILE* fp = fopen(filename, "a+");
+  flock(fileno(fp), LOCK_EX);
+  fseek(fp, 0, SEEK_END);
+  if (ftell(fp) == 0) {
+    for (const std::shared_ptr<Expr>& e : programs) {
+      std::ostringstream st;
+      st << *e << "\n";
+      std::string s(st.str());
+      fwrite(s.c_str(), 1, s.size(), fp);
+    }
+  }
+  fclose(fp);
+}
 
 
 int main(int argc, char* argv[]) {
@@ -29,72 +81,121 @@ int main(int argc, char* argv[]) {
 
   CHECK(FLAGS_size >= 3) << "--size should be specified";
   CHECK(!FLAGS_operators.empty()) << "--operators should be specified";
+  CHECK(FLAGS_format == "text" || FLAGS_format == "binary") << "--format should be text or binary";
 
   int op_type_set = ParseOpTypeSet(FLAGS_operators);
 
   GenAllSimplifyMode simp_mode =
      FLAGS_simplify=="global" ? GLOBAL_SIMPLIFY :
-       FLAGS_simplify=="each" ? SIMPLIFY_EACH_STEP : NO_SIMPLIFY;
+       FLAGS_simplify=="each" ? SIMPLIFY_EACH_STEP :
+         FLAGS_simplify=="observational" ?
+           (FLAGS_keep_members ? OBSERVATIONAL_KEEP_MEMBERS : OBSERVATIONAL) : NO_SIMPLIFY;
 
-  std::vector<std::shared_ptr<Expr> > result = ListExpr(FLAGS_size, op_type_set, simp_mode);
-  if (simp_mode == NO_SIMPLIFY)
-    result = SimplifyExprList(result);
-  LOG(INFO) << "SIZE[FIN] " <<  result.size();
+  ExprShard shard;
+  bool sharded = !FLAGS_shard.empty();
+  if (sharded) {
+    CHECK(ParseShard(FLAGS_shard, &shard)) << "--shard should be k/N";
+    CHECK(!FLAGS_run_file.empty()) << "--run_file should be specified";
+    CHECK(FLAGS_cache_dir.empty()) << "--cache_dir is not supported with --shard";
+    CHECK(FLAGS_memory_budget_mb <= 0) << "--memory_budget_mb is not supported with --shard";
+  }
+
+  if (!FLAGS_table_cache_dir.empty())
+    MaybeMakeDir(FLAGS_table_cache_dir.c_str());
+  // The position of each program in the unsharded output.
+  std::unordered_map<const Expr*, std::pair<uint64_t, uint64_t> > positions;
+  std::pair<uint64_t, uint64_t> position(~0ULL, 0);
   std::vector<uint64_t> key = CreateKey();
-  std::map<std::vector<uint64_t>, std::vector<std::shared_ptr<Expr> > > cluster =
-      CreateCluster(key, result);
+  std::vector<std::shared_ptr<Expr> > result;
+  std::unique_ptr<ExternalCluster> external;
+  // Where the clusters and the binary dump are spilled, if under a budget.
+  std::string spill_dir;
+  if (FLAGS_memory_budget_mb > 0) {
+    const char* tmpdir = getenv("TMPDIR");
+    spill_dir = !FLAGS_spill_dir.empty() ? FLAGS_spill_dir : tmpdir ? tmpdir : "/tmp";
+    external.reset(new ExternalCluster(
+        key, static_cast<std::size_t>(FLAGS_memory_budget_mb) << 20, spill_dir,
+        simp_mode == NO_SIMPLIFY));
+  }
+  std::size_t num_generated = 0;
+  ForEachExpr(FLAGS_size, op_type_set, simp_mode,
+              [&](const std::shared_ptr<Expr>& e) {
+                ++num_generated;
+                if (external) {
+                  // Same as SimplifyExprList(), within each cluster.
+                  external->Add(e, simp_mode == NO_SIMPLIFY ? Simplify(e)->ToString() : "");
+                  return;
+                }
+                if (sharded) {
+                  position.second = (position.first == shard.group ? position.second + 1 : 0);
+                  position.first = shard.group;
+                  positions[e.get()] = position;
+                }
+                result.push_back(e);
+              },
+              FLAGS_threads, FLAGS_table_cache_dir, sharded ? &shard : nullptr);
+  LOG(INFO) << "SIZE[GEN] " << num_generated;
 
-  if (!FLAGS_quiet) {
-    std::cout << "argument: ";
-    PrintCollection(&std::cout, key, ",");
-    std::cout << "\n";
-  
-    int i = 0;
-    for (auto iter = cluster.cbegin(); iter != cluster.cend(); ++iter) {
-      VLOG(1) << "Output Cluster " << i++ << ": " << iter->second.size();
+  ClusterDumpWriter dump_writer(spill_dir);
+  int i = 0;
+  auto output = [&](const std::vector<uint64_t>& signature,
+                    const std::vector<std::shared_ptr<Expr> >& programs) {
+    if (!FLAGS_quiet && FLAGS_format == "binary") {
+      dump_writer.Add(signature, programs);
+    } else if (!FLAGS_quiet) {
+      VLOG(1) << "Output Cluster " << i++ << ": " << programs.size();
       std::cout << "expected: ";
-      PrintCollection(&std::cout, iter->first, ",");
+      PrintCollection(&std::cout, signature, ",");
       std::cout << "\n";
-  
-      for (const std::shared_ptr<Expr>& e : iter->second) {
+
+      for (const std::shared_ptr<Expr>& e : programs) {
         std::cout << *e << "\n";
       }
     }
+    if (!FLAGS_cache_dir.empty())
+      WriteCacheCluster(signature, programs);
+  };
+  if (!FLAGS_quiet && FLAGS_format != "binary" && !sharded) {
+    std::cout << "argument: ";
+    PrintCollection(&std::cout, key, ",");
+    std::cout << "\n";
   }
 
-  if (!FLAGS_cache_dir.empty()) {
-    for (auto iter = cluster.cbegin(); iter != cluster.cend(); ++iter) {
-      uint64_t hash = HashKey(iter->first);
-      char filename[256];
-      MaybeMakeDir(FLAGS_cache_dir.c_str());
-      sprintf(filename, "%s/%02x",
-              FLAGS_cache_dir.c_str(),
-              static_cast<int>(hash & 0xff));
-      MaybeMakeDir(filename);
-      sprintf(filename, "%s/%02x/%02x",
-              FLAGS_cache_dir.c_str(),
-              static_cast<int>(hash & 0xff),
-              static_cast<int>((hash >> 8) & 0xff));
-      MaybeMakeDir(filename);
-      sprintf(filename, "%s/%02x/%02x/%016llx.sxp",
-              FLAGS_cache_dir.c_str(),
-              static_cast<int>(hash & 0xff),
-              static_cast<int>((hash >> 8) & 0xff),
-              static_cast<unsigned long long>(hash));
-      FILE* fp = fopen(filename, "a+");
-      flock(fileno(fp), LOCK_EX);
-      fseek(fp, 0, SEEK_END);
-      if (ftell(fp) == 0) {
+  if (external) {
+    std::size_t num_programs = external->ForEachCluster(output);
+    LOG(INFO) << "SIZE[FIN] " << num_programs;
+  } else {
+    if (simp_mode == NO_SIMPLIFY)
+      result = SimplifyExprList(result);
+    LOG(INFO) << "SIZE[FIN] " <<  result.size();
+    std::map<std::vector<uint64_t>, std::vector<std::shared_ptr<Expr> > > cluster =
+        CreateCluster(key, result);
+
+    if (sharded) {
+      FILE* fp = fopen(FLAGS_run_file.c_str(), "wb");
+      CHECK(fp) << "Failed to open " << FLAGS_run_file;
+      WriteRunHeader(fp, RunHeader {
+          CLUSTER_RUN, simp_mode != OBSERVATIONAL_KEEP_MEMBERS,
+          static_cast<uint32_t>(shard.index), static_cast<uint32_t>(shard.num_shards) });
+      WriteRunU64s(fp, key);
+      for (auto iter = cluster.cbegin(); iter != cluster.cend(); ++iter) {
+        WriteRunU64s(fp, iter->first);
+        WriteRunU64s(fp, { iter->second.size() });
         for (const std::shared_ptr<Expr>& e : iter->second) {
-          std::ostringstream st;
-          st << *e << "\n";
-          std::string s(st.str());
-          fwrite(s.c_str(), 1, s.size(), fp);
+          const std::pair<uint64_t, uint64_t>& p = positions[e.get()];
+          WriteRunRecord(fp, RunRecord {
+              p.first, p.second, RunDedupeKey(e, op_type_set, simp_mode), e->ToString() });
         }
       }
-      fclose(fp);
+      CHECK(fclose(fp) == 0) << "Failed to write " << FLAGS_run_file;
+      return 0;
     }
+
+    for (auto iter = cluster.cbegin(); iter != cluster.cend(); ++iter)
+      output(iter->first, iter->second);
   }
+  if (!FLAGS_quiet && FLAGS_format == "binary")
+    CHECK(dump_writer.Finish(stdout, key)) << "Failed to write the clusters";
 
   return 0;
 }
@@ -1,12 +1,542 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <random>
+#include <set>
+#include <string>
+
+#include "cardinal_search.h"
+#include "cluster.h"
+#include "cluster_dump.h"
 #include "expr.h"
 #include "expr_list.h"
+#include "external_cluster.h"
+#include "fold_body_table.h"
 #include "parser.h"
+#include "signature_table.h"
+#include "simplify.h"
 
 using namespace icfpc;
 
 TEST(EvalTest, Foo) {
   ASSERT_TRUE(false) << "kaite mita dake";
 }
+
+TEST(ClusterDumpTest, RoundTrip) {
+  std::vector<uint64_t> key = CreateKey();
+  std::vector<std::shared_ptr<Expr> > programs =
+      ListExpr(10, OpType::NOT | OpType::PLUS | OpType::FOLD, NO_SIMPLIFY);
+  programs.push_back(LambdaExpr::Create(ConstantExpr::Create(0x123456789ULL)));
+  std::map<std::vector<uint64_t>, std::vector<std::shared_ptr<Expr> > > cluster =
+      CreateCluster(key, programs);
+  ASSERT_LT(10U, cluster.size());
+
+  char path[] = "/tmp/cluster_dump_test_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  FILE* fp = fdopen(fd, "wb");
+  ASSERT_TRUE(WriteClusterDump(fp, key, cluster));
+  fclose(fp);
+
+  ClusterDump dump;
+  ASSERT_TRUE(dump.Open(path));
+  unlink(path);
+  ASSERT_EQ(cluster.size(), dump.num_clusters());
+  EXPECT_EQ(programs.size(), dump.num_programs());
+  EXPECT_TRUE(std::equal(key.begin(), key.end(), dump.argument()));
+  std::size_t i = 0;
+  for (auto iter = cluster.cbegin(); iter != cluster.cend(); ++iter, ++i) {
+    EXPECT_TRUE(std::equal(iter->first.begin(), iter->first.end(), dump.signature(i)));
+    EXPECT_EQ(i, dump.Find(iter->first));
+    ASSERT_EQ(iter->second.size(), dump.cluster_size(i));
+    for (std::size_t k = 0; k < iter->second.size(); ++k)
+      EXPECT_EQ(iter->second[k]->ToString(), dump.program(i, k)->ToString());
+  }
+  EXPECT_EQ(dump.num_clusters(), dump.Find(std::vector<uint64_t>(256, 42)));
+}
+
+TEST(ExternalClusterTest, SameAsCreateCluster) {
+  std::vector<uint64_t> key = CreateKey();
+  std::vector<std::shared_ptr<Expr> > programs =
+      ListExpr(9, OpType::NOT | OpType::SHR4 | OpType::AND | OpType::IF0, NO_SIMPLIFY);
+  std::map<std::vector<uint64_t>, std::vector<std::shared_ptr<Expr> > > cluster =
+      CreateCluster(key, SimplifyExprList(programs));
+  ASSERT_LT(100U, cluster.size());
+
+  // Small enough to spill many runs.
+  ExternalCluster external(key, 1 << 16, "/tmp", true);
+  for (const std::shared_ptr<Expr>& e : programs)
+    external.Add(e, Simplify(e)->ToString());
+  auto iter = cluster.cbegin();
+  external.ForEachCluster([&](const std::vector<uint64_t>& signature,
+                              const std::vector<std::shared_ptr<Expr> >& members) {
+    ASSERT_TRUE(iter != cluster.cend());
+    EXPECT_TRUE(iter->first == signature);
+    ASSERT_EQ(iter->second.size(), members.size());
+    for (std::size_t k = 0; k < members.size(); ++k)
+      EXPECT_EQ(iter->second[k]->ToString(), members[k]->ToString());
+    ++iter;
+  });
+  EXPECT_TRUE(iter == cluster.cend());
+}
+
+// Every fold body the lister of old lists (those which pass the filter of
+// the bodies composed from the smallest one of each simplified form) is
+// listed as a function, at the same size or smaller.
+TEST(EugeoTest, ListsFunctionsOfUndedupedFilter) {
+  const std::size_t kDepth = 6;
+  std::vector<Env> sample;
+  std::mt19937_64 rand_engine(1);
+  for (uint64_t z : { 0ULL, 1ULL, ~0ULL, 1ULL << 63, 0xFFFFFFFFULL })
+    for (uint64_t y = 0; y < 256; y += 15)
+      sample.push_back(Env { 0, y, z });
+  for (int i = 0; i < 200; ++i) {
+    uint64_t r = rand_engine();
+    sample.push_back(Env { 0, rand_engine() & 0xFF, i % 2 ? r : ~0ULL >> (r % 64) });
+  }
+  auto outputs = [&](const Expr& e) {
+    std::vector<uint64_t> values;
+    for (const Env& env : sample)
+      values.push_back(e.Eval(env));
+    return values;
+  };
+
+  std::map<std::vector<uint64_t>, std::size_t> listed;
+  std::vector<std::vector<std::shared_ptr<Expr> > > bodies = PreComputeTable(kDepth);
+  for (std::size_t size = 1; size <= kDepth; ++size)
+    for (const std::shared_ptr<Expr>& e : bodies[size])
+      listed.insert(std::make_pair(outputs(*e), size));
+
+  std::vector<std::vector<std::shared_ptr<Expr> > > table(1);
+  std::set<std::string> already_known;
+  std::size_t num_checked = 0;
+  for (std::size_t size = 1; size <= kDepth; ++size) {
+    std::vector<std::shared_ptr<Expr> > es = ListExprInternal(table, size);
+    table.emplace_back();
+    for (const std::shared_ptr<Expr>& e : es) {
+      if (already_known.insert(Simplify(e)->ToString()).second)
+        table.back().push_back(e);
+      if (!e->has_y() || !e->has_z())
+        continue;
+      auto iter = listed.find(outputs(*e));
+      ASSERT_TRUE(iter != listed.end()) << *e;
+      EXPECT_LE(iter->second, size) << *e;
+      ++num_checked;
+    }
+  }
+  EXPECT_LT(5000U, num_checked);
+}
+
+TEST(FoldBodyTableTest, SameAsPreComputeTable) {
+  std::vector<std::vector<std::shared_ptr<Expr> > > table = PreComputeTable(5);
+  char dir[] = "/tmp/fold_body_table_test_XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir));
+  std::string path = std::string(dir) + "/bodies.tbl";
+
+  // Written by the first Open(), and mapped by the second one.
+  for (int i = 0; i < 2; ++i) {
+    FoldBodyTable bodies;
+    bodies.Open(path, 5);
+    ASSERT_EQ(5U, bodies.max_size());
+    for (std::size_t size = 0; size <= 5; ++size) {
+      ASSERT_EQ(table[size].size(), bodies.num_bodies(size));
+      for (std::size_t k = 0; k < table[size].size(); ++k) {
+        EXPECT_EQ(table[size][k]->ToString(), bodies.body(size, k)->ToString());
+        EXPECT_EQ(table[size][k]->op_type_set(), bodies.op_type_set(size, k));
+      }
+    }
+    ASSERT_EQ(table[5].size(), bodies.bodies(5).size());
+    EXPECT_EQ(table[5].back()->ToString(), bodies.bodies(5).back()->ToString());
+  }
+  ASSERT_LT(100U, table[5].size());
+
+  // A table of another max_size is stale, and is written again.
+  FoldBodyTable bodies;
+  bodies.Open(path, 4);
+  EXPECT_EQ(table[4].size(), bodies.num_bodies(4));
+  unlink(path.c_str());
+  rmdir(dir);
+}
+
+TEST(FoldEvaluatorTest, SameAsFoldOp) {
+  std::vector<std::shared_ptr<Expr> > bodies;
+  for (auto& level : PreComputeTable(4))
+    bodies.insert(bodies.end(), level.begin(), level.end());
+  for (const char* fold : { "(fold x 0 (lambda (y z) (if0 (and y 1) (plus x z) (shr4 y))))",
+                            "(fold x 0 (lambda (y z) (xor (not 0) (shl1 (shr16 z)))))" })
+    bodies.push_back(static_cast<const FoldExpr&>(*Parse(fold)).body());
+  std::vector<uint64_t> arguments = { 0, 1, 0x123456789ABCDEFULL, ~0ULL, 0x8000000000000000ULL };
+  std::vector<uint64_t> value1 = { 0xFF, 0, ~0ULL, 0x0102030405060708ULL, 7 };
+  std::vector<uint64_t> value2 = { 1, 0x55, 0, ~0ULL, 0xFFFF0000ULL };
+  std::vector<uint64_t> result(arguments.size());
+  FoldEvaluator evaluator(arguments);
+  for (const std::shared_ptr<Expr>& body : bodies) {
+    evaluator.Eval(value1.data(), value2.data(), *body, result.data());
+    for (std::size_t i = 0; i < arguments.size(); ++i)
+      EXPECT_EQ(FoldOp()(arguments[i], value1[i], value2[i], *body), result[i]) << *body;
+  }
+  ASSERT_LT(50U, bodies.size());
+}
+
+TEST(SignatureTableTest, KeepsFirstAndPlainFirst) {
+  SignatureTable table(2, 3);
+  std::vector<uint64_t> a = { 1, 2 }, b = { 3, 4 };
+  // Enough entries to rehash a few times.
+  for (uint64_t i = 0; i < 5000; ++i) {
+    std::vector<uint64_t> v = { i, ~i };
+    EXPECT_TRUE(table.Insert(v.data(), i % 2 == 0, 1 + i % 2, OpType::NOT));
+  }
+  EXPECT_TRUE(table.Insert(a.data(), false, 3, OpType::PLUS, 3, 4));
+  EXPECT_FALSE(table.Insert(a.data(), false, 3, OpType::XOR, 5, 6));
+  EXPECT_TRUE(table.Insert(b.data(), false, 3, OpType::AND, 7, 8));
+  EXPECT_TRUE(table.Insert(a.data(), true, 3, OpType::FOLD, 0, 1, 2));
+
+  uint32_t plain = table.Find(a.data(), false);
+  ASSERT_NE(SignatureTable::kNone, plain);
+  EXPECT_EQ(OpType::PLUS, table.type(plain));
+  EXPECT_EQ(3U, table.arg(plain, 0));
+  EXPECT_EQ(4U, table.arg(plain, 1));
+  uint32_t folded = table.Find(a.data(), true);
+  ASSERT_NE(SignatureTable::kNone, folded);
+  EXPECT_EQ(OpType::FOLD, table.type(folded));
+  EXPECT_EQ(2U, table.arg(folded, 2));
+  EXPECT_EQ(SignatureTable::kNone, table.Find(b.data(), true));
+
+  std::vector<uint32_t> level;
+  for (uint32_t e : table.level(3))
+    level.push_back(e);
+  ASSERT_EQ(3U, level.size());
+  EXPECT_FALSE(table.has_fold(level[0]));
+  EXPECT_FALSE(table.has_fold(level[1]));
+  EXPECT_TRUE(table.has_fold(level[2]));
+  for (uint64_t i = 0; i < 5000; ++i) {
+    std::vector<uint64_t> v = { i, ~i };
+    uint32_t e = table.Find(v.data(), i % 2 == 0);
+    ASSERT_NE(SignatureTable::kNone, e);
+    EXPECT_EQ(static_cast<int>(1 + i % 2), SignatureTable::expr_size(e));
+    EXPECT_EQ(i, table.values(e)[0]);
+  }
+}
+
+namespace {
+
+// The arguments of the Cardinal tests, of which the first ones are asked
+// first.
+std::vector<uint64_t> CardinalArguments(std::size_t count) {
+  std::vector<uint64_t> arguments;
+  uint64_t value = 0x0123456789ABCDEFULL;
+  for (std::size_t i = 0; i < count; ++i) {
+    value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+    arguments.push_back(value ^ (value >> 29));
+  }
+  return arguments;
+}
+
+std::vector<uint64_t> EvalOn(const Expr& expr, const std::vector<uint64_t>& arguments) {
+  std::vector<uint64_t> outputs;
+  for (uint64_t argument : arguments) {
+    Env env;
+    env.x = argument;
+    outputs.push_back(expr.Eval(env));
+  }
+  return outputs;
+}
+
+// Expects |table| on |arguments| to have the entries of |expected|, up to the
+// order in a size and which of the expressions of a signature each is.
+void ExpectSameEntries(const SignatureTable& expected, const SignatureTable& table,
+                       const std::vector<uint64_t>& arguments) {
+  ASSERT_EQ(expected.size(), table.size());
+  for (int size = 1; size <= table.max_size(); ++size) {
+    ASSERT_EQ(expected.level(size).size(), table.level(size).size()) << size;
+    ASSERT_EQ(expected.num_plain(size), table.num_plain(size)) << size;
+    for (uint32_t e : expected.level(size)) {
+      uint32_t found = table.Find(expected.values(e), expected.has_fold(e));
+      ASSERT_NE(SignatureTable::kNone, found);
+      EXPECT_EQ(size, SignatureTable::expr_size(found));
+    }
+    // The entries evaluate to their signatures.
+    for (uint32_t e : table.level(size)) {
+      EXPECT_EQ(std::vector<uint64_t>(table.values(e), table.values(e) + table.width()),
+                EvalOn(*MakeExpression(table, e), arguments));
+    }
+  }
+}
+
+}  // namespace
+
+TEST(CardinalTest, WidenedTableIsRebuiltTable) {
+  FoldBodies().Build(4);
+  const int kMaxSize = 7;
+  const int op_type_set = OpType::NOT | OpType::SHL1 | OpType::SHR4 | OpType::AND |
+      OpType::XOR | OpType::PLUS | OpType::IF0 | OpType::FOLD;
+  std::vector<uint64_t> arguments = CardinalArguments(8);
+  // No expression has these outputs, so all the sizes are composed.
+  std::vector<uint64_t> goal = CardinalArguments(16);
+  goal.erase(goal.begin(), goal.begin() + 8);
+  const std::vector<uint64_t> few_arguments(arguments.begin(), arguments.begin() + 3);
+  const std::vector<uint64_t> few_goal(goal.begin(), goal.begin() + 3);
+
+  for (int num_threads : { 1, 3 }) {
+    CardinalBank widened, rebuilt;
+    EXPECT_FALSE(Cardinal(&widened, few_arguments, few_goal, kMaxSize, op_type_set, SOLVE,
+                          Deadline(60, NULL), ~std::size_t(0), num_threads).get());
+    ASSERT_EQ(kMaxSize, widened.built_size);
+    EXPECT_FALSE(Cardinal(&widened, arguments, goal, kMaxSize, op_type_set, SOLVE,
+                          Deadline(60, NULL), ~std::size_t(0), num_threads).get());
+    EXPECT_FALSE(Cardinal(&rebuilt, arguments, goal, kMaxSize, op_type_set, SOLVE,
+                          Deadline(60, NULL), ~std::size_t(0), num_threads).get());
+    ASSERT_EQ(arguments, widened.arguments);
+
+    ExpectSameEntries(*rebuilt.table, *widened.table, arguments);
+  }
+}
+
+TEST(CardinalTest, WidensAfterPartialFoldLevel) {
+  FoldBodies().Build(4);
+  const int kMaxSize = 8;
+  const int op_type_set = OpType::FOLD | OpType::OR | OpType::SHR4 | OpType::SHL1;
+  const std::vector<uint64_t> arguments = CardinalArguments(8);
+  const std::vector<uint64_t> few_arguments(arguments.begin(), arguments.begin() + 3);
+  std::vector<uint64_t> goal = CardinalArguments(16);
+  goal.erase(goal.begin(), goal.begin() + 8);
+
+  // Found in the fold steps of size 6, which are left partly composed, and
+  // composed again on more arguments.
+  CardinalBank bank, rebuilt;
+  std::shared_ptr<Expr> first = Parse("(fold x 0 (lambda (y z) (or y z)))");
+  std::shared_ptr<Expr> found = Cardinal(&bank, few_arguments, EvalOn(*first, few_arguments),
+                                         kMaxSize, op_type_set, SOLVE, Deadline(60, NULL),
+                                         ~std::size_t(0), 1);
+  ASSERT_TRUE(found.get());
+  EXPECT_EQ(EvalOn(*first, few_arguments), EvalOn(*found, few_arguments));
+  ASSERT_EQ(5, bank.built_size);
+  ASSERT_LE(FOLD_UNARY_STEP, bank.step);
+
+  EXPECT_FALSE(Cardinal(&bank, arguments, goal, kMaxSize, op_type_set, SOLVE,
+                        Deadline(60, NULL), ~std::size_t(0), 1).get());
+  EXPECT_FALSE(Cardinal(&rebuilt, arguments, goal, kMaxSize, op_type_set, SOLVE,
+                        Deadline(60, NULL), ~std::size_t(0), 1).get());
+  ExpectSameEntries(*rebuilt.table, *bank.table, arguments);
+}
+
+TEST(CardinalTest, ResumesAfterFoundGoal) {
+  FoldBodies().Build(4);
+  const int kMaxSize = 8;
+  const int op_type_set = OpType::FOLD | OpType::OR | OpType::SHR4 | OpType::SHL1;
+  const std::vector<uint64_t> arguments = CardinalArguments(4);
+  std::vector<uint64_t> goal = CardinalArguments(8);
+  goal.erase(goal.begin(), goal.begin() + 4);
+
+  // Stops in the fold steps of size 6, and composes the rest of it for the
+  // next request.
+  CardinalBank bank, rebuilt;
+  std::shared_ptr<Expr> first = Parse("(fold x 0 (lambda (y z) (or y z)))");
+  ASSERT_TRUE(Cardinal(&bank, arguments, EvalOn(*first, arguments), kMaxSize, op_type_set, SOLVE,
+                       Deadline(60, NULL), ~std::size_t(0), 1).get());
+  ASSERT_EQ(5, bank.built_size);
+  ASSERT_LE(FOLD_UNARY_STEP, bank.step);
+  EXPECT_FALSE(Cardinal(&bank, arguments, goal, kMaxSize, op_type_set, SOLVE,
+                        Deadline(60, NULL), ~std::size_t(0), 1).get());
+  EXPECT_FALSE(Cardinal(&rebuilt, arguments, goal, kMaxSize, op_type_set, SOLVE,
+                        Deadline(60, NULL), ~std::size_t(0), 1).get());
+  ExpectSameEntries(*rebuilt.table, *bank.table, arguments);
+}
+
+TEST(CardinalTest, FindGoalByInverseSkipsIdentities) {
+  const std::vector<uint64_t> arguments = CardinalArguments(3);
+  SignatureTable table(3, 5);
+  std::vector<uint64_t> zeroes(3, 0), ones(3, 1), not_x(3);
+  for (std::size_t i = 0; i < 3; ++i)
+    not_x[i] = ~arguments[i];
+  table.Insert(zeroes.data(), false, 1, OpType::CONSTANT);
+  table.Insert(ones.data(), false, 1, OpType::CONSTANT);
+  uint32_t x;
+  table.Insert(arguments.data(), false, 1, OpType::ID, SignatureTable::kNone,
+               SignatureTable::kNone, SignatureTable::kNone, &x);
+  table.Insert(not_x.data(), false, 2, OpType::NOT, x);
+
+  // Not (xor 0 x), (plus 0 x), nor (not (not x)), which are x.
+  const int op_type_set = OpType::NOT | OpType::XOR | OpType::PLUS;
+  for (int size = 1; size <= 2; ++size)
+    EXPECT_FALSE(FindGoalByInverse(table, arguments, size, 5, op_type_set).get()) << size;
+  std::shared_ptr<Expr> found = FindGoalByInverse(table, not_x, 1, 5, op_type_set);
+  ASSERT_TRUE(found.get());
+  EXPECT_EQ("(not x)", found->ToString());
+
+  // Nor does Cardinal() take them for the goals of size 1.
+  CardinalBank bank;
+  for (const std::vector<uint64_t>& goal : { arguments, zeroes, ones }) {
+    found = Cardinal(&bank, arguments, goal, 5, op_type_set, SOLVE, Deadline(60, NULL),
+                     ~std::size_t(0), 1);
+    ASSERT_TRUE(found.get());
+    EXPECT_EQ(1U, found->depth()) << *found;
+    EXPECT_EQ(goal, EvalOn(*found, arguments));
+  }
+}
+
+TEST(CardinalTest, FindGoalByIf0RespectsMinSize) {
+  // x is zero on the first and the third.
+  const std::vector<uint64_t> arguments = { 0, 5, 0, 7 };
+  SignatureTable table(4, 5);
+  std::vector<uint64_t> zeroes(4, 0), ones(4, 1), not_x(4);
+  for (std::size_t i = 0; i < 4; ++i)
+    not_x[i] = ~arguments[i];
+  table.Insert(zeroes.data(), false, 1, OpType::CONSTANT);
+  table.Insert(ones.data(), false, 1, OpType::CONSTANT);
+  uint32_t x;
+  table.Insert(arguments.data(), false, 1, OpType::ID, SignatureTable::kNone,
+               SignatureTable::kNone, SignatureTable::kNone, &x);
+  table.Insert(not_x.data(), false, 2, OpType::NOT, x);
+  std::vector<std::vector<uint32_t> > conditions(2);
+  conditions[1].push_back(x);
+
+  const std::vector<uint64_t> goal = { 1, ~5ULL, 1, ~7ULL };
+  std::shared_ptr<Expr> found = FindGoalByIf0(table, goal, conditions, 5, 5);
+  ASSERT_TRUE(found.get());
+  EXPECT_EQ("(if0 x 1 (not x))", found->ToString());
+  EXPECT_EQ(goal, EvalOn(*found, arguments));
+  // Of size 5, so left to the composing of size 5 if smaller ones are not
+  // composed yet.
+  EXPECT_FALSE(FindGoalByIf0(table, goal, conditions, 6, 5).get());
+  // Nor found in less than its size.
+  EXPECT_FALSE(FindGoalByIf0(table, goal, conditions, 1, 4).get());
+}
+
+TEST(CardinalTest, ConditionsHaveOutcomesOfGoal) {
+  const int kMaxSize = 6;
+  const int op_type_set = OpType::NOT | OpType::SHL1 | OpType::SHR4 | OpType::AND |
+      OpType::XOR | OpType::PLUS;
+  const std::vector<uint64_t> arguments = CardinalArguments(6);
+  // The outcomes of these, found in each size up to kMaxSize.
+  const char* const kPredicates[] = {
+    "(shr4 x)", "(and x 1)", "(and (shr4 x) (shl1 x))", "(xor (shr4 (shr4 x)) x)",
+    "(plus (and (shr4 x) 1) (not x))",
+  };
+  for (CardinalMode mode : { CONDITION, BONUS_CONDITION }) {
+    CardinalBank bank;
+    for (const char* predicate : kPredicates) {
+      std::vector<uint64_t> goal = EvalOn(*Parse(predicate), arguments);
+      std::shared_ptr<Expr> found =
+          Cardinal(&bank, arguments, goal, kMaxSize, op_type_set, mode, Deadline(60, NULL),
+                   ~std::size_t(0), 1);
+      ASSERT_TRUE(found.get()) << predicate;
+      std::vector<uint64_t> outputs = EvalOn(*found, arguments);
+      for (std::size_t i = 0; i < arguments.size(); ++i) {
+        if (mode == CONDITION)
+          EXPECT_EQ(goal[i] != 0, outputs[i] != 0) << predicate << " " << *found;
+        else
+          EXPECT_EQ(goal[i] & 1, outputs[i] & 1) << predicate << " " << *found;
+      }
+    }
+  }
+}
+
+TEST(CardinalTest, SkipsNoSignature) {
+  const int kMaxSize = 7;
+  const int op_type_set = OpType::NOT | OpType::SHL1 | OpType::SHR1 | OpType::AND |
+      OpType::OR | OpType::XOR | OpType::PLUS | OpType::IF0;
+  const std::vector<uint64_t> arguments = CardinalArguments(4);
+  std::vector<uint64_t> goal = CardinalArguments(8);
+  goal.erase(goal.begin(), goal.begin() + 4);
+  CardinalBank bank;
+  EXPECT_FALSE(Cardinal(&bank, arguments, goal, kMaxSize, op_type_set, SOLVE,
+                        Deadline(60, NULL), ~std::size_t(0), 1).get());
+  ASSERT_EQ(kMaxSize, bank.built_size);
+
+  // Every composition of every size, none skipped. Cardinal() has the
+  // signatures of each size which are not of a smaller one.
+  typedef std::vector<uint64_t> Signature;
+  std::set<Signature> seen;
+  std::vector<std::vector<Signature> > levels(kMaxSize + 1);
+  auto add = [&](int size, const Signature& s) {
+    if (seen.insert(s).second)
+      levels[size].push_back(s);
+  };
+  add(1, Signature(4, 0));
+  add(1, Signature(4, 1));
+  add(1, arguments);
+  for (int size = 2; size <= kMaxSize; ++size) {
+    for (const Signature& a : levels[size - 1]) {
+      Signature s(4);
+      for (uint64_t (*op)(uint64_t) : std::vector<uint64_t (*)(uint64_t)> {
+          [](uint64_t v) { return ~v; }, [](uint64_t v) { return v << 1; },
+          [](uint64_t v) { return v >> 1; } }) {
+        std::transform(a.begin(), a.end(), s.begin(), op);
+        add(size, s);
+      }
+    }
+    for (int size1 = 1; size1 < size - 1; ++size1) {
+      for (const Signature& a : levels[size1]) {
+        for (const Signature& b : levels[size - 1 - size1]) {
+          Signature s(4);
+          for (uint64_t (*op)(uint64_t, uint64_t) :
+                   std::vector<uint64_t (*)(uint64_t, uint64_t)> {
+                     [](uint64_t v, uint64_t w) { return v & w; },
+                     [](uint64_t v, uint64_t w) { return v | w; },
+                     [](uint64_t v, uint64_t w) { return v ^ w; },
+                     [](uint64_t v, uint64_t w) { return v + w; } }) {
+            std::transform(a.begin(), a.end(), b.begin(), s.begin(), op);
+            add(size, s);
+          }
+        }
+      }
+    }
+    for (int size1 = 1; size1 < size - 2; ++size1) {
+      for (int size2 = 1; size1 + size2 < size - 1; ++size2) {
+        for (const Signature& c : levels[size1]) {
+          for (const Signature& t : levels[size2]) {
+            for (const Signature& e : levels[size - 1 - size1 - size2]) {
+              Signature s(4);
+              for (std::size_t i = 0; i < 4; ++i)
+                s[i] = c[i] == 0 ? t[i] : e[i];
+              add(size, s);
+            }
+          }
+        }
+      }
+    }
+    EXPECT_EQ(levels[size].size(), bank.table->level(size).size()) << size;
+  }
+}
+
+TEST(CardinalTest, FullBankOnlyLooksUp) {
+  const int kMaxSize = 9;
+  const int op_type_set = OpType::NOT | OpType::SHL1 | OpType::SHR4 | OpType::AND |
+      OpType::XOR | OpType::PLUS;
+  const std::vector<uint64_t> arguments = CardinalArguments(4);
+  std::vector<uint64_t> goal = CardinalArguments(8);
+  goal.erase(goal.begin(), goal.begin() + 4);
+
+  // Stops at the first check of the budget.
+  CardinalBank bank;
+  EXPECT_FALSE(Cardinal(&bank, arguments, goal, kMaxSize, op_type_set, SOLVE,
+                        Deadline(60, NULL), 1, 1).get());
+  ASSERT_TRUE(bank.full);
+  ASSERT_LT(bank.built_size, kMaxSize);
+  const std::size_t num_entries = bank.table->size();
+
+  // The entries composed are found, and nothing more is composed.
+  for (int size = 1; size <= bank.built_size + 1; ++size) {
+    for (uint32_t e : bank.table->level(size)) {
+      std::vector<uint64_t> outputs(bank.table->values(e),
+                                    bank.table->values(e) + arguments.size());
+      std::shared_ptr<Expr> found = Cardinal(&bank, arguments, outputs, kMaxSize, op_type_set,
+                                             SOLVE, Deadline(60, NULL), 1, 1);
+      ASSERT_TRUE(found.get()) << size;
+      EXPECT_EQ(outputs, EvalOn(*found, arguments));
+      break;
+    }
+  }
+  EXPECT_FALSE(Cardinal(&bank, arguments, goal, kMaxSize, op_type_set, SOLVE,
+                        Deadline(60, NULL), 1, 1).get());
+  EXPECT_TRUE(bank.full);
+  EXPECT_EQ(num_entries, bank.table->size());
+
+  // New arguments reset it.
+  goal.push_back(0x123);
+  EXPECT_FALSE(Cardinal(&bank, CardinalArguments(5), goal, 3, op_type_set, SOLVE,
+                        Deadline(60, NULL), ~std::size_t(0), 1).get());
+  EXPECT_FALSE(bank.full);
+}
@@ -1,6 +1,7 @@
 #ifndef ICFPC_UTIL_H_
 #define ICFPC_UTIL_H_
 
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -106,4 +107,11 @@ void MaybeMakeDir(const char* path) {
   mkdir(path, 0755);
 }
 
+// Returns the peak resident set size of this process in KB.
+long GetPeakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
 #endif  // ICFPC_UTIL_H_
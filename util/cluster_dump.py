@@ -0,0 +1,146 @@
+"""Reader of the binary cluster dumps.
+
+The dumps are written by solver/cluster_main and solver/simplify_main with
+--format=binary; see solver/cluster_dump.h for the layout. The file is
+memory-mapped, and a cluster is decoded only when it is accessed.
+"""
+
+import mmap
+import struct
+import subprocess
+import tempfile
+
+_MAGIC = b'icfpcls1'
+_SIGNATURE_SIZE = 256
+_HEADER = struct.Struct('<8sQQ')
+_SIGNATURE = struct.Struct('<%dQ' % _SIGNATURE_SIZE)
+_OFFSETS = struct.Struct('<QQ')
+
+_UNARY_OPS = ('not', 'shl1', 'shr1', 'shr4', 'shr16')
+_BINARY_OPS = ('and', 'or', 'xor', 'plus')
+_IF0 = 9
+_FOLD = 10
+_LAMBDA = 12
+_LEAVES = {13: '0', 14: '1', 15: 'x', 16: 'y', 17: 'z'}
+_CONSTANT = 18
+
+
+def _Decode(code, pos):
+  """Returns the program text at code[pos:] and the position after it."""
+  op = code[pos]
+  pos += 1
+  if op in _LEAVES:
+    return _LEAVES[op], pos
+  if op == _CONSTANT:
+    value = 0
+    for i in range(8):
+      value |= code[pos + i] << (8 * i)
+    return str(value), pos + 8
+  if op == _LAMBDA:
+    body, pos = _Decode(code, pos)
+    return '(lambda (x) %s)' % body, pos
+  if op < len(_UNARY_OPS):
+    arg, pos = _Decode(code, pos)
+    return '(%s %s)' % (_UNARY_OPS[op], arg), pos
+  if op < len(_UNARY_OPS) + len(_BINARY_OPS):
+    arg1, pos = _Decode(code, pos)
+    arg2, pos = _Decode(code, pos)
+    return '(%s %s %s)' % (_BINARY_OPS[op - len(_UNARY_OPS)], arg1, arg2), pos
+  assert op in (_IF0, _FOLD), 'Broken cluster dump'
+  arg1, pos = _Decode(code, pos)
+  arg2, pos = _Decode(code, pos)
+  arg3, pos = _Decode(code, pos)
+  if op == _IF0:
+    return '(if0 %s %s %s)' % (arg1, arg2, arg3), pos
+  return '(fold %s %s (lambda (y z) %s))' % (arg1, arg2, arg3), pos
+
+
+class ClusterPrograms(object):
+  """The programs of a cluster, decoded on access."""
+
+  def __init__(self, dump, begin, end):
+    self._dump = dump
+    self._begin = begin
+    self._end = end
+
+  def __len__(self):
+    return self._end - self._begin
+
+  def __getitem__(self, k):
+    if isinstance(k, slice):
+      return [self[i] for i in range(*k.indices(len(self)))]
+    if k < 0:
+      k += len(self)
+    if not 0 <= k < len(self):
+      raise IndexError(k)
+    return self._dump._Program(self._begin + k)
+
+  def __iter__(self):
+    for k in range(len(self)):
+      yield self[k]
+
+
+class ClusterDump(object):
+  """Memory-mapped cluster dump.
+
+  Clusters are indexed 0 .. len(dump) - 1 in ascending order of signatures.
+  """
+
+  def __init__(self, f):
+    self._mmap = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    magic, self._num_clusters, self._num_programs = _HEADER.unpack_from(self._mmap, 0)
+    assert magic == _MAGIC, 'Not a cluster dump'
+    self._argument_pos = _HEADER.size
+    self._cluster_begin_pos = (
+        self._argument_pos + (self._num_clusters + 1) * _SIGNATURE.size)
+    self._program_begin_pos = self._cluster_begin_pos + (self._num_clusters + 1) * 8
+    self._code_pos = self._program_begin_pos + (self._num_programs + 1) * 8
+
+  def close(self):
+    self._mmap.close()
+
+  def __len__(self):
+    return self._num_clusters
+
+  def Argument(self):
+    return list(_SIGNATURE.unpack_from(self._mmap, self._argument_pos))
+
+  def Signature(self, i):
+    """Returns the expected outputs of the i-th cluster."""
+    return list(_SIGNATURE.unpack_from(
+        self._mmap, self._argument_pos + (i + 1) * _SIGNATURE.size))
+
+  def Programs(self, i):
+    begin, end = _OFFSETS.unpack_from(self._mmap, self._cluster_begin_pos + i * 8)
+    return ClusterPrograms(self, begin, end)
+
+  def Find(self, outputs):
+    """Returns the index of the cluster of outputs, or None."""
+    outputs = tuple(outputs)
+    lo, hi = 0, self._num_clusters
+    while lo < hi:
+      mid = (lo + hi) // 2
+      if tuple(self.Signature(mid)) < outputs:
+        lo = mid + 1
+      else:
+        hi = mid
+    if lo < self._num_clusters and tuple(self.Signature(lo)) == outputs:
+      return lo
+    return None
+
+  def _Program(self, k):
+    begin, end = _OFFSETS.unpack_from(self._mmap, self._program_begin_pos + k * 8)
+    code = bytearray(self._mmap[self._code_pos + begin:self._code_pos + end])
+    return _Decode(code, 0)[0]
+
+
+def Run(command):
+  """Runs a cluster solver command with --format=binary and maps its output."""
+  f = tempfile.TemporaryFile()
+  try:
+    subprocess.check_call(command + ['--format=binary'], stdout=f)
+    f.flush()
+    return ClusterDump(f)
+  finally:
+    # The mapping stays valid after the (unlinked) file is closed.
+    f.close()
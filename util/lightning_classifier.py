@@ -11,6 +11,8 @@ import sys
 
 import gflags
 
+from util import plan
+
 FLAGS = gflags.FLAGS
 
 SOLVER_DIR = os.path.join(os.path.dirname(__file__), '../solver')
@@ -31,6 +33,15 @@ gflags.DEFINE_integer(
     'a problem. Specify 0 for no threshold.')
 gflags.MarkFlagAsRequired('max_cluster_size')
 
+gflags.DEFINE_string(
+    'planner', os.path.join(SOLVER_DIR, 'plan'),
+    'Path to the plan binary.')
+
+gflags.DEFINE_integer(
+    'max_memory_mb', 0,
+    'Problems predicted to take more memory to cluster are skipped without '
+    'running the cluster solver. Specify 0 for no threshold.')
+
 
 def RunClusterSolver(problem):
   cluster_solver_output = subprocess.check_output(
@@ -109,6 +120,11 @@ def main():
   problems = ReadProblemset()
 
   for problem in problems:
+    if FLAGS.max_memory_mb:
+      problem_plan = plan.Run(FLAGS.planner, problem.size, problem.operators)
+      if problem_plan.memory_mb > FLAGS.max_memory_mb:
+        print '#', '%s\tskipped=%r' % (problem.ToProblemLine(), problem_plan)
+        continue
     arguments, clusters = RunClusterSolver(problem)
     max_cluster_size = max([len(programs) for expected, programs in clusters])
     line = '%s\tmax_cluster_size=%d' % (problem.ToProblemLine(), max_cluster_size)
@@ -0,0 +1,37 @@
+"""Runner of solver/plan, the predictor of the enumeration size.
+
+The plan tells the number of the programs cluster_main or simplify_main
+enumerates for a problem, and their memory and time, without enumerating
+them; see solver/plan.cc.
+"""
+
+import subprocess
+
+
+class Plan(object):
+  def __init__(self, programs, exact, memory_mb, time_sec):
+    self.programs = programs
+    self.exact = exact
+    self.memory_mb = memory_mb
+    self.time_sec = time_sec
+
+  def __repr__(self):
+    return '<Plan programs=%.3g%s memory_mb=%.0f time_sec=%.1f>' % (
+        self.programs, '' if self.exact else ' (upper bound)',
+        self.memory_mb, self.time_sec)
+
+
+def Run(planner, size, operators, simplify='no', memory_budget_mb=None):
+  command = [planner,
+             '--size=%d' % size,
+             '--operators=%s' % ','.join(operators),
+             '--simplify=%s' % simplify]
+  if memory_budget_mb:
+    command.append('--memory_budget_mb=%d' % memory_budget_mb)
+  values = {}
+  for line in subprocess.check_output(command).splitlines():
+    if ': ' in line:
+      key, value = line.split(': ', 1)
+      values[key] = value
+  return Plan(float(values['programs']), values['exact'] == 'true',
+              float(values['memory_mb']), float(values['time_sec']))
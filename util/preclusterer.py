@@ -2,7 +2,7 @@
 Concurrent preclusterer.
 
 Example:
-./python.sh -m util.preclusterer --cluster_solver=solver/simplify_main --problemset_file=data/myproblems__do_not_try_before_we_get_ready.tsv --threads=12 --time_limit_sec=300 --memory_limit_kb=10000000
+./python.sh -m util.preclusterer --cluster_solver=solver/simplify_main --problemset_file=data/myproblems__do_not_try_before_we_get_ready.tsv --threads=12 --time_limit_sec=300 --memory_limit_kb=10000000 --cache_dir=cache --table_cache_dir=table_cache
 """
 
 import logging
@@ -13,6 +13,7 @@ import sys
 import threading
 
 import gflags
+from util import plan
 from util import stdlog
 
 FLAGS = gflags.FLAGS
@@ -49,6 +50,23 @@ gflags.DEFINE_string(
     'Path to cache dir')
 gflags.MarkFlagAsRequired('cache_dir')
 
+gflags.DEFINE_string(
+    'table_cache_dir', None,
+    'Path to the dir to share the enumerated tables across problems.')
+
+gflags.DEFINE_integer(
+    'memory_budget_mb', None,
+    'Memory for the clusters per problem in MB, over which they are spilled '
+    'to disk. Should be well below --memory_limit_kb.')
+
+gflags.DEFINE_string(
+    'planner', None,
+    'Path to the plan binary. If given, the problems are run in the order of '
+    'the predicted time, longest first.')
+
+# The simplification the solver runs, and the planner plans.
+SIMPLIFY = 'global'
+
 
 class Problem(object):
   def __init__(self, id, size, operators, answer=None, solved=None, time_left=None):
@@ -58,6 +76,7 @@ class Problem(object):
     self.answer = answer
     self.solved = solved
     self.time_left = time_left
+    self.plan = None
 
   def AsDict(self):
     data = {
@@ -114,25 +133,60 @@ def Worker(q):
            'go',
            FLAGS.cluster_solver,
            '--quiet',
+           # For the lines below, which are logged at INFO.
+           '--logtostderr',
+           '--simplify=%s' % SIMPLIFY,
            '--size=%d' % problem.size,
            '--operators=%s' % ','.join(problem.operators),
-           '--cache_dir=%s' % FLAGS.cache_dir],
+           '--cache_dir=%s' % FLAGS.cache_dir] +
+          (['--table_cache_dir=%s' % FLAGS.table_cache_dir]
+           if FLAGS.table_cache_dir else []) +
+          (['--memory_budget_mb=%d' % FLAGS.memory_budget_mb]
+           if FLAGS.memory_budget_mb else []),
           stdout=null,
-          stderr=null)
+          stderr=subprocess.PIPE)
     line = problem.ToProblemLine().replace('\t', ' ')
-    logging.info('start: %s', line)
-    if p.wait() != 0:
+    if problem.plan:
+      logging.info('start: %s: %r', line, problem.plan)
+    else:
+      logging.info('start: %s', line)
+    # Read as it comes, so that the whole log is not held.
+    for log_line in iter(p.stderr.readline, ''):
+      if 'Table cache' in log_line or 'Spilled' in log_line:
+        logging.info('%s: %s', line, log_line.rstrip('\n'))
+    p.wait()
+    if p.returncode != 0:
       logging.info('FAIL: %s', line)
     else:
       logging.info('SUCCESS: %s', line)
     q.task_done()
 
 
+def PlanProblems(problems):
+  """Plans the problems, and returns them longest first.
+
+  The plans of the simplified enumeration are upper bounds, which order the
+  problems well enough, but are too loose to skip any by the limits.
+  """
+  for problem in problems:
+    problem.plan = plan.Run(
+        FLAGS.planner, problem.size, problem.operators, simplify=SIMPLIFY,
+        memory_budget_mb=FLAGS.memory_budget_mb)
+  return sorted(problems, key=lambda problem: -problem.plan.time_sec)
+
+
 def main():
   sys.argv = FLAGS(sys.argv)
   stdlog.setup()
 
   problems = ReadProblemset()
+  if FLAGS.planner:
+    problems = PlanProblems(problems)
+  if FLAGS.table_cache_dir:
+    # Smaller operator sets first, so that their tables are cached for the
+    # larger ones, and the longest first among the same.
+    problems.sort(key=lambda problem: (len(problem.operators), problem.size,
+                                       -problem.plan.time_sec if problem.plan else 0))
 
   q = Queue.Queue()
 